@@ -0,0 +1,150 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "device_manager.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEVICE_COUNT 1000000
+#define REPEATS 50
+#define NAME_LEN 50
+#define RANGE_MIN 75
+#define RANGE_MAX 90
+
+// Replica of the previous one-node-per-device layout, kept as the "before" baseline
+typedef struct ListDevice {
+    char name[NAME_LEN];
+    DeviceType type;
+    int id;
+    bool state;
+    int attribute;
+    struct ListDevice* next;
+} ListDevice;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char* label, double seconds, long long checksum) {
+    fprintf(stderr, "%-28s %8.3f ms/scan %10.0f Mdevices/s  (checksum %lld)\n", label, seconds * 1e3 / REPEATS,
+            (double)DEVICE_COUNT * REPEATS / seconds / 1e6, checksum);
+}
+
+static int attribute_of(int i) {
+    return (int)(((unsigned)i * 2654435761U) >> 25) % 120;
+}
+
+static ListDevice* build_list(void) {
+    ListDevice* head = NULL;
+    for (int i = 0; i < DEVICE_COUNT; i++) {
+        ListDevice* device = (ListDevice*)malloc(sizeof(ListDevice));
+        if (!device) {
+            break;
+        }
+        snprintf(device->name, sizeof(device->name), "device-%d", i);
+        device->type = (DeviceType)(i % 3);
+        device->id = i;
+        device->state = false;
+        device->attribute = attribute_of(i);
+        device->next = head;
+        head = device;
+    }
+    return head;
+}
+
+// A sparse fleet mixes the three types, so a third of the slots are thermostats;
+// a dense one is thermostats only, selecting every slot
+static DeviceType type_of(int i, bool dense) {
+    return dense ? DEVICE_THERMOSTAT : (DeviceType)(i % 3);
+}
+
+static DeviceManager* build_manager(bool dense) {
+    DeviceManager* manager = device_manager_create();
+    device_manager_reserve(manager, DEVICE_COUNT);
+    char name[NAME_LEN];
+    for (int i = 0; i < DEVICE_COUNT; i++) {
+        snprintf(name, sizeof(name), "device-%d", i);
+        DeviceSpec spec = {name, type_of(i, dense), i, false, attribute_of(i)};
+        device_manager_add_devices(manager, &spec, 1, NULL);
+    }
+    return manager;
+}
+
+static void bench_list(void) {
+    ListDevice* head = build_list();
+    long long checksum = 0;
+    double start = now_seconds();
+    for (int r = 0; r < REPEATS; r++) {
+        int min = INT_MAX;
+        int max = INT_MIN;
+        long long sum = 0;
+        for (const ListDevice* current = head; current; current = current->next) {
+            if (current->type == DEVICE_THERMOSTAT) {
+                min = current->attribute < min ? current->attribute : min;
+                max = current->attribute > max ? current->attribute : max;
+                sum += current->attribute;
+            }
+        }
+        checksum += min + max + sum;
+    }
+    report("list walk: aggregate", now_seconds() - start, checksum);
+
+    checksum = 0;
+    start = now_seconds();
+    for (int r = 0; r < REPEATS; r++) {
+        for (const ListDevice* current = head; current; current = current->next) {
+            checksum += current->type == DEVICE_THERMOSTAT && current->attribute >= RANGE_MIN &&
+                        current->attribute <= RANGE_MAX;
+        }
+    }
+    report("list walk: range count", now_seconds() - start, checksum);
+
+    while (head) {
+        ListDevice* next = head->next;
+        free(head);
+        head = next;
+    }
+}
+
+// Kernels are picked when the manager is created, so each set gets its own manager
+static void bench_kernels(const char* kernels, bool dense) {
+    setenv("DEVICE_MANAGER_SIMD", kernels, 1);
+    DeviceManager* manager = build_manager(dense);
+    const char* fleet = dense ? "dense" : "sparse";
+    char label[64];
+
+    long long checksum = 0;
+    double start = now_seconds();
+    for (int r = 0; r < REPEATS; r++) {
+        AggregateResult result;
+        device_manager_aggregate_attribute(manager, DEVICE_THERMOSTAT, &result);
+        checksum += result.min + result.max + result.sum;
+    }
+    snprintf(label, sizeof(label), "%s %s: aggregate", kernels, fleet);
+    report(label, now_seconds() - start, checksum);
+
+    checksum = 0;
+    start = now_seconds();
+    for (int r = 0; r < REPEATS; r++) {
+        checksum += (long long)device_manager_filter_attribute_range(manager, DEVICE_THERMOSTAT, RANGE_MIN, RANGE_MAX,
+                                                                     NULL, 0);
+    }
+    snprintf(label, sizeof(label), "%s %s: range count", kernels, fleet);
+    report(label, now_seconds() - start, checksum);
+
+    device_manager_destroy(manager);
+}
+
+int main(void) {
+    bench_list();
+    const char* kernels[] = {"scalar", "sse2", "avx2"};
+    for (int dense = 0; dense < 2; dense++) {
+        for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+            bench_kernels(kernels[i], dense != 0);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include "device_manager.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEVICE_COUNT 1000000
+#define NAME_LEN 50
+
+// Replica of the previous one-node-per-device layout, kept as the "before" baseline
+typedef struct ListDevice {
+    char name[NAME_LEN];
+    DeviceType type;
+    int id;
+    bool state;
+    int attribute;
+    struct ListDevice* next;
+} ListDevice;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void report(const char* label, double seconds) {
+    fprintf(stderr, "%-28s %8.3f s %12.0f devices/s\n", label, seconds, DEVICE_COUNT / seconds);
+}
+
+static ListDevice* build_list(void) {
+    ListDevice* head = NULL;
+    for (int i = 0; i < DEVICE_COUNT; i++) {
+        ListDevice* device = (ListDevice*)malloc(sizeof(ListDevice));
+        if (!device) {
+            break;
+        }
+        snprintf(device->name, sizeof(device->name), "device-%d", i);
+        device->type = (DeviceType)(i % 3);
+        device->id = i;
+        device->state = (i % 2) != 0;
+        device->attribute = i % 100;
+        device->next = head;
+        head = device;
+    }
+    return head;
+}
+
+static DeviceManager* build_manager(void) {
+    DeviceManager* manager = device_manager_create();
+    char name[NAME_LEN];
+    for (int i = 0; i < DEVICE_COUNT; i++) {
+        snprintf(name, sizeof(name), "device-%d", i);
+        device_manager_add_device(manager, name, (DeviceType)(i % 3), i);
+        device_manager_set_device_state(manager, i, (i % 2) != 0);
+        device_manager_set_device_attribute(manager, i, i % 100);
+    }
+    return manager;
+}
+
+static long file_bytes(const char* filename) {
+    FILE* file = fopen(filename, "rb");
+    long size = file && fseek(file, 0, SEEK_END) == 0 ? ftell(file) : 0;
+    if (file) {
+        fclose(file);
+    }
+    return size > 0 ? size : 1;
+}
+
+// Counts bytes so exports are measured without any I/O behind them
+static bool discard_sink(const char* data, size_t size, void* udata) {
+    (void)data;
+    *(size_t*)udata += size;
+    return true;
+}
+
+int main(void) {
+    // Listing goes to stdout; discard it so only the scan is measured
+    if (!freopen("/dev/null", "w", stdout)) {
+        return 1;
+    }
+    const char* filename = "bench_device_scan.txt";
+
+    ListDevice* head = build_list();
+    double start = now_seconds();
+    int count = 0;
+    for (const ListDevice* current = head; current; current = current->next) {
+        count++;
+    }
+    report("before: count", now_seconds() - start);
+    start = now_seconds();
+    for (const ListDevice* current = head; current; current = current->next) {
+        printf("Device ID: %d, Name: %s, Type: %d, State: %s, Attribute: %d\n",
+               current->id, current->name, current->type, current->state ? "ON" : "OFF", current->attribute);
+    }
+    report("before: list", now_seconds() - start);
+    start = now_seconds();
+    FILE* file = fopen(filename, "w");
+    for (const ListDevice* current = head; file && current; current = current->next) {
+        fprintf(file, "%d %s %d %d %d\n", current->id, current->name, current->type, current->state, current->attribute);
+    }
+    if (file) {
+        fclose(file);
+    }
+    report("before: save", now_seconds() - start);
+    while (head) {
+        ListDevice* next = head->next;
+        free(head);
+        head = next;
+    }
+
+    DeviceManager* manager = build_manager();
+    // The list has no count to read, so compare its walk with a pass over every
+    // live bitset word rather than the stored device count
+    start = now_seconds();
+    count += (int)device_manager_query(manager, NULL, NULL, 0);
+    report("after: count (query)", now_seconds() - start);
+    start = now_seconds();
+    device_manager_list_devices(manager);
+    report("after: list", now_seconds() - start);
+    start = now_seconds();
+    device_manager_save(manager, filename);
+    report("after: save", now_seconds() - start);
+    static const size_t load_threads[] = {1, 0};
+    for (size_t i = 0; i < sizeof(load_threads) / sizeof(load_threads[0]); i++) {
+        start = now_seconds();
+        DeviceManager* loaded = device_manager_load_parallel(filename, load_threads[i], NULL, NULL);
+        report(load_threads[i] ? "after: load 1 thread" : "after: load all threads", now_seconds() - start);
+        device_manager_destroy(loaded);
+    }
+    // Compressed snapshots, sized against the text one just written
+    const char* compressed = "bench_device_scan.dmz";
+    start = now_seconds();
+    device_manager_save_compressed(manager, compressed);
+    double saved = now_seconds() - start;
+    char label[64];
+    snprintf(label, sizeof(label), "after: save packed (1/%.1f)",
+             (double)file_bytes(filename) / (double)file_bytes(compressed));
+    report(label, saved);
+    start = now_seconds();
+    device_manager_destroy(device_manager_load_compressed(compressed));
+    report("after: load packed", now_seconds() - start);
+    remove(compressed);
+    static const char* const formats[] = {"text", "csv", "jsonl"};
+    for (int format = DEVICE_FORMAT_TEXT; format <= DEVICE_FORMAT_JSONL; format++) {
+        size_t bytes = 0;
+        start = now_seconds();
+        device_manager_write_devices(manager, discard_sink, &bytes, (DeviceFormat)format);
+        snprintf(label, sizeof(label), "after: export %s (%zu MB)", formats[format], bytes >> 20);
+        report(label, now_seconds() - start);
+    }
+    // Incremental sync after 0.1% of the fleet changed, against the full export above
+    uint64_t version = 0;
+    size_t bytes = 0;
+    device_manager_export_changes_since(manager, 0, discard_sink, &bytes, &version);
+    for (int i = 0; i < DEVICE_COUNT; i += 1000) {
+        device_manager_set_device_attribute(manager, i, i);
+    }
+    bytes = 0;
+    start = now_seconds();
+    device_manager_export_changes_since(manager, version, discard_sink, &bytes, &version);
+    snprintf(label, sizeof(label), "after: delta 0.1%% (%zu KB)", bytes >> 10);
+    report(label, now_seconds() - start);
+    device_manager_destroy(manager);
+
+    remove(filename);
+    return count == 2 * DEVICE_COUNT ? 0 : 1;
+}
@@ -0,0 +1,76 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "device_manager.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEVICE_COUNT 1000000
+#define REPEATS 20
+
+static double now_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static DeviceManager* build_manager(void) {
+    DeviceManager* manager = device_manager_create();
+    device_manager_reserve(manager, DEVICE_COUNT);
+    char name[32];
+    for (int i = 0; i < DEVICE_COUNT; i++) {
+        snprintf(name, sizeof(name), "device-%d", i);
+        DeviceSpec spec = {name, (DeviceType)(i % 3), i, i % 2 != 0, i % 100};
+        device_manager_add_devices(manager, &spec, 1, NULL);
+    }
+    return manager;
+}
+
+// Stand-in for per-device work heavier than a single store
+static bool smooth(DeviceView* device, void* udata) {
+    (void)udata;
+    int value = device->attribute;
+    for (int i = 0; i < 8; i++) {
+        value = (value * 7 + 3) % 100;
+    }
+    device->attribute = value;
+    return true;
+}
+
+// Scaling of built-in and callback ops with the worker count; run on a many-core host
+static void bench_threads(DeviceManager* manager, size_t threads) {
+    if (!device_manager_set_worker_threads(manager, threads)) {
+        fprintf(stderr, "cannot start %zu workers\n", threads);
+        return;
+    }
+    DeviceFilter thermostats = {DEVICE_TYPE_BIT(DEVICE_THERMOSTAT), DEVICE_STATE_ANY, false, 0, 0};
+    DeviceOp toggle[2] = {{DEVICE_OP_SET_STATE, 1, 0, 0, NULL, NULL}, {DEVICE_OP_SET_STATE, 0, 0, 0, NULL, NULL}};
+    DeviceOp clamp = {DEVICE_OP_CLAMP_ATTRIBUTE, 0, 20, 30, NULL, NULL};
+    DeviceOp callback = {DEVICE_OP_CALLBACK, 0, 0, 0, smooth, NULL};
+
+    size_t changed = 0;
+    double start = now_seconds();
+    for (int r = 0; r < REPEATS; r++) {
+        changed += device_manager_apply_parallel(manager, NULL, &toggle[r % 2]);
+        changed += device_manager_apply_parallel(manager, &thermostats, &clamp);
+    }
+    double builtin = now_seconds() - start;
+
+    start = now_seconds();
+    for (int r = 0; r < REPEATS; r++) {
+        changed += device_manager_apply_parallel(manager, NULL, &callback);
+    }
+    double callbacks = now_seconds() - start;
+    fprintf(stderr, "%3zu threads: built-in %8.3f ms/pass  callback %8.3f ms/pass  (changed %zu)\n", threads,
+            builtin * 1e3 / (REPEATS * 2), callbacks * 1e3 / REPEATS, changed);
+}
+
+int main(int argc, char** argv) {
+    size_t max_threads = argc > 1 ? (size_t)strtoul(argv[1], NULL, 10) : 32;
+    DeviceManager* manager = build_manager();
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        bench_threads(manager, threads);
+    }
+    device_manager_destroy(manager);
+    return 0;
+}
@@ -1,5 +1,8 @@
 function(add_sanitizer_flags)
-    if(NOT ENABLE_SANITIZE_ADDR AND NOT ENABLE_SANITIZE_UNDEF)
+    if(NOT ENABLE_SANITIZE_ADDR
+       AND NOT ENABLE_SANITIZE_UNDEF
+       AND NOT ENABLE_SANITIZE_LEAK
+       AND NOT ENABLE_SANITIZE_THREAD)
         return()
     endif()
 
@@ -20,10 +20,41 @@
  * IN THE SOFTWARE.
  */
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "log.h"
 
+#include <string.h>
+
 #define MAX_CALLBACKS 32
 
+/*
+ * Async mode needs threads and atomics; elsewhere log_start_async() fails and
+ * logging stays synchronous.
+ */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define LOG_ASYNC_SUPPORTED 1
+#include <pthread.h>
+#endif
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define LOG_THREAD_LOCAL _Thread_local
+#else
+#define LOG_THREAD_LOCAL __thread
+#endif
+
+/*
+ * Queued records: a power of two; longer messages are truncated. The writer
+ * sleeps this long when it finds nothing to write.
+ */
+#define LOG_ASYNC_RING_SIZE 4096
+#ifndef LOG_ASYNC_MESSAGE_MAX
+#define LOG_ASYNC_MESSAGE_MAX 256
+#endif
+#define LOG_ASYNC_IDLE_NS 2000000L
+
 typedef struct
 {
     log_LogFn fn;
@@ -38,6 +69,7 @@ static struct
     int level;
     bool quiet;
     Callback callbacks[MAX_CALLBACKS];
+    int async;
 } L;
 
 
@@ -166,6 +198,281 @@ static void init_event(log_Event *ev, void *udata)
 }
 
 
+#ifdef LOG_ASYNC_SUPPORTED
+
+/*
+ * Async mode: callers format the message into a per-thread buffer and push it
+ * onto a bounded multi-producer ring (one sequence number per cell, producers
+ * claim cells by compare-exchange on the tail). A single writer thread drains
+ * it in batches to stderr and the log_add_fp() sinks, flushing each sink once
+ * per batch and formatting the timestamp once per second. A full ring drops
+ * the record rather than wait; the writer reports how many were dropped.
+ */
+typedef struct
+{
+    size_t sequence;
+    const char *file;
+    time_t time;
+    int line;
+    int level;
+    int length;
+    char message[LOG_ASYNC_MESSAGE_MAX];
+} AsyncRecord;
+
+static struct
+{
+    size_t tail;
+    char tail_padding[64 - sizeof(size_t)];
+    size_t head; /* Owned by the writer */
+    size_t dropped;
+    int stopping;
+    pthread_t thread;
+    time_t cached_time;
+    char date_time[32];
+    char clock[16];
+    AsyncRecord records[LOG_ASYNC_RING_SIZE];
+} A;
+
+static LOG_THREAD_LOCAL char message_buffer[LOG_ASYNC_MESSAGE_MAX];
+
+
+static int async_push(int level, const char *file, int line, const char *message, int length)
+{
+    size_t pos = __atomic_load_n(&A.tail, __ATOMIC_RELAXED);
+    AsyncRecord *record;
+    for (;;)
+    {
+        record = &A.records[pos & (LOG_ASYNC_RING_SIZE - 1)];
+        size_t sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+        if (sequence == pos)
+        {
+            if (__atomic_compare_exchange_n(&A.tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (sequence < pos)
+        {
+            return -1;
+        }
+        else
+        {
+            pos = __atomic_load_n(&A.tail, __ATOMIC_RELAXED);
+        }
+    }
+    record->file = file;
+    record->time = time(NULL);
+    record->line = line;
+    record->level = level;
+    record->length = length;
+    memcpy(record->message, message, (size_t)length);
+    __atomic_store_n(&record->sequence, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+static void async_log(int level, const char *file, int line, const char *fmt, va_list ap)
+{
+    int length = vsnprintf(message_buffer, sizeof(message_buffer), fmt, ap);
+    if (length < 0)
+    {
+        length = 0;
+    }
+    else if (length >= (int)sizeof(message_buffer))
+    {
+        length = (int)sizeof(message_buffer) - 1;
+    }
+    if (async_push(level, file, line, message_buffer, length) != 0)
+    {
+        __atomic_fetch_add(&A.dropped, 1, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* Whether stderr or any file sink would print the record; checked before formatting */
+static bool async_wanted(int level)
+{
+    if (!L.quiet && level >= L.level)
+    {
+        return true;
+    }
+    for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++)
+    {
+        if (L.callbacks[i].fn == file_callback && level >= L.callbacks[i].level)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static void async_write(FILE *fp, const char *stamp, const AsyncRecord *record, bool color)
+{
+#ifdef LOG_USE_COLOR
+    if (color)
+    {
+        fprintf(fp,
+                "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
+                stamp,
+                level_colors[record->level],
+                level_strings[record->level],
+                record->file,
+                record->line);
+    }
+    else
+#endif
+    {
+        (void)color;
+        fprintf(fp, "%s %-5s %s:%d: ", stamp, level_strings[record->level], record->file, record->line);
+    }
+    fwrite(record->message, 1, (size_t)record->length, fp);
+    fputc('\n', fp);
+}
+
+
+static void async_deliver(const AsyncRecord *record)
+{
+    if (record->time != A.cached_time)
+    {
+        struct tm local;
+        localtime_r(&record->time, &local);
+        strftime(A.date_time, sizeof(A.date_time), "%Y-%m-%d %H:%M:%S", &local);
+        strftime(A.clock, sizeof(A.clock), "%H:%M:%S", &local);
+        A.cached_time = record->time;
+    }
+    if (!L.quiet && record->level >= L.level)
+    {
+        async_write(stderr, A.clock, record, true);
+    }
+    for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++)
+    {
+        Callback *cb = &L.callbacks[i];
+        if (cb->fn == file_callback && record->level >= cb->level)
+        {
+            async_write(cb->udata, A.date_time, record, false);
+        }
+    }
+}
+
+
+static void async_flush(void)
+{
+    if (!L.quiet)
+    {
+        fflush(stderr);
+    }
+    for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++)
+    {
+        if (L.callbacks[i].fn == file_callback)
+        {
+            fflush(L.callbacks[i].udata);
+        }
+    }
+}
+
+
+/* Writes out everything queued so far; returns the number of records written */
+static size_t async_drain(void)
+{
+    size_t written = 0;
+    for (;;)
+    {
+        AsyncRecord *record = &A.records[A.head & (LOG_ASYNC_RING_SIZE - 1)];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != A.head + 1)
+        {
+            break;
+        }
+        async_deliver(record);
+        __atomic_store_n(&record->sequence, A.head + LOG_ASYNC_RING_SIZE, __ATOMIC_RELEASE);
+        A.head++;
+        written++;
+    }
+    size_t dropped = __atomic_exchange_n(&A.dropped, 0, __ATOMIC_RELAXED);
+    if (dropped)
+    {
+        AsyncRecord notice = {0, __FILE__, time(NULL), __LINE__, LOG_WARN, 0, {0}};
+        notice.length = snprintf(notice.message, sizeof(notice.message), "%zu log messages dropped", dropped);
+        async_deliver(&notice);
+        written++;
+    }
+    if (written)
+    {
+        async_flush();
+    }
+    return written;
+}
+
+
+static void *async_main(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        bool stopping = __atomic_load_n(&A.stopping, __ATOMIC_ACQUIRE);
+        if (async_drain() == 0)
+        {
+            if (stopping)
+            {
+                break;
+            }
+            struct timespec idle = {0, LOG_ASYNC_IDLE_NS};
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+
+int log_start_async(void)
+{
+    if (__atomic_load_n(&L.async, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+    /* A restart resumes at the position the last writer stopped at */
+    for (size_t pos = A.head; pos < A.head + LOG_ASYNC_RING_SIZE; pos++)
+    {
+        A.records[pos & (LOG_ASYNC_RING_SIZE - 1)].sequence = pos;
+    }
+    A.tail = A.head;
+    A.stopping = 0;
+    A.cached_time = (time_t)-1;
+    if (pthread_create(&A.thread, NULL, async_main, NULL) != 0)
+    {
+        return -1;
+    }
+    __atomic_store_n(&L.async, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+
+void log_stop_async(void)
+{
+    if (!__atomic_load_n(&L.async, __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+    __atomic_store_n(&L.async, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&A.stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(A.thread, NULL);
+}
+
+#else
+
+int log_start_async(void)
+{
+    return -1;
+}
+
+
+void log_stop_async(void)
+{
+}
+
+#endif
+
+
 void log_log(int level, const char *file, int line, const char *fmt, ...)
 {
     log_Event ev = {
@@ -174,10 +481,39 @@ void log_log(int level, const char *file, int line, const char *fmt, ...)
         .line = line,
         .level = level,
     };
+    bool queued = false;
+
+#ifdef LOG_ASYNC_SUPPORTED
+    if (__atomic_load_n(&L.async, __ATOMIC_ACQUIRE))
+    {
+        /* Filtered records are neither formatted nor given a slot */
+        if (async_wanted(level))
+        {
+            va_start(ev.ap, fmt);
+            async_log(level, file, line, fmt, ev.ap);
+            va_end(ev.ap);
+        }
+        queued = true;
+    }
+#endif
+
+    /* Queued records reach stderr and the file sinks on the writer thread */
+    if (queued)
+    {
+        bool others = false;
+        for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++)
+        {
+            others = others || L.callbacks[i].fn != file_callback;
+        }
+        if (!others)
+        {
+            return;
+        }
+    }
 
     lock();
 
-    if (!L.quiet && level >= L.level)
+    if (!queued && !L.quiet && level >= L.level)
     {
         init_event(&ev, stderr);
         va_start(ev.ap, fmt);
@@ -188,7 +524,7 @@ void log_log(int level, const char *file, int line, const char *fmt, ...)
     for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++)
     {
         Callback *cb = &L.callbacks[i];
-        if (level >= cb->level)
+        if (level >= cb->level && !(queued && cb->fn == file_callback))
         {
             init_event(&ev, cb->udata);
             va_start(ev.ap, fmt);
@@ -53,6 +53,9 @@ void log_set_quiet(bool enable);
 int log_add_callback(log_LogFn fn, void *udata, int level);
 int log_add_fp(FILE *fp, int level);
 
+int log_start_async(void);
+void log_stop_async(void);
+
 void log_log(int level, const char *file, int line, const char *fmt, ...);
 
 #endif
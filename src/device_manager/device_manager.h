@@ -2,6 +2,8 @@
 #define DEVICE_MANAGER_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 // Forward declaration of DeviceManager for Opaque Pointer
 typedef struct DeviceManager DeviceManager;
@@ -13,29 +15,393 @@ typedef enum {
     DEVICE_CAMERA
 } DeviceType;
 
+// Kind of change carried by a DeviceUpdate
+typedef enum {
+    DEVICE_UPDATE_STATE, // value != 0 turns the device ON
+    DEVICE_UPDATE_ATTRIBUTE
+} DeviceUpdateKind;
+
+// One state/attribute change addressed by device id
+typedef struct DeviceUpdate {
+    int ident;
+    DeviceUpdateKind kind;
+    int value;
+} DeviceUpdate;
+
+// Full description of a device for bulk insertion
+typedef struct DeviceSpec {
+    const char* name;
+    DeviceType type;
+    int ident;
+    bool state;
+    int attribute;
+} DeviceSpec;
+
+// Reference to one device that skips id/name resolution. Treat the fields as private;
+// a handle goes stale once its device is removed and is then rejected, never followed.
+typedef struct DeviceHandle {
+    unsigned int slot;
+    unsigned int generation;
+} DeviceHandle;
+
+#define DEVICE_HANDLE_NULL ((DeviceHandle){0U, 0U})
+
+// Query filter; a zeroed filter matches every device
+typedef enum {
+    DEVICE_STATE_ANY,
+    DEVICE_STATE_ON,
+    DEVICE_STATE_OFF
+} DeviceStateFilter;
+
+#define DEVICE_TYPE_BIT(type) (1U << (type))
+
+typedef struct DeviceFilter {
+    unsigned int type_mask; // DEVICE_TYPE_BIT of each wanted type; 0 matches any type
+    DeviceStateFilter state;
+    bool by_attribute; // Also require attribute_min <= attribute <= attribute_max
+    int attribute_min;
+    int attribute_max;
+} DeviceFilter;
+
+// Attribute statistics over one device type; all zero when there are no such devices
+typedef struct AggregateResult {
+    size_t count;
+    int min;
+    int max;
+    long long sum;
+    double mean;
+} AggregateResult;
+
+// Longest device name accepted, including the terminator; adding a longer one fails
+#define DEVICE_NAME_MAX 256
+
+// Copy of one device handed to per-device callbacks; name is only valid during the call
+typedef struct DeviceView {
+    int ident;
+    const char* name;
+    DeviceType type;
+    bool state;
+    int attribute;
+} DeviceView;
+
+typedef void (*DeviceVisitFn)(const DeviceView* device, void* udata);
+// Edits state and/or attribute in place; returns true to store the edited values
+typedef bool (*DeviceUpdateFn)(DeviceView* device, void* udata);
+
+// Operation applied to every device matching a filter
+typedef enum {
+    DEVICE_OP_SET_STATE, // value != 0 turns the device ON
+    DEVICE_OP_SET_ATTRIBUTE, // attribute = value
+    DEVICE_OP_ADD_ATTRIBUTE, // attribute += value, wrapping on overflow
+    DEVICE_OP_CLAMP_ATTRIBUTE, // attribute limited to [min, max]
+    DEVICE_OP_CALLBACK // update(device, udata)
+} DeviceOpKind;
+
+typedef struct DeviceOp {
+    DeviceOpKind kind;
+    int value;
+    int min;
+    int max;
+    DeviceUpdateFn update;
+    void* udata;
+} DeviceOp;
+
+// Output formats of device_manager_write_devices; one line per device
+typedef enum {
+    DEVICE_FORMAT_TEXT, // "Device ID: 1, Name: ..., Type: 0, State: ON, Attribute: 5", as listed
+    DEVICE_FORMAT_CSV, // Header line, then id,name,type,state,attribute with state as 0/1
+    DEVICE_FORMAT_JSONL, // {"id":1,"name":"...","type":0,"state":true,"attribute":5}
+    DEVICE_FORMAT_SNAPSHOT // "id name type state attribute", as written by device_manager_save; spaces,
+                           // control bytes and '%' in names are written as %XX
+} DeviceFormat;
+
+// Receives exported output in large chunks; returns false to stop the export
+typedef bool (*DeviceSinkFn)(const char* data, size_t size, void* udata);
+
+// Cursor over every device, in storage order. Caller-owned; treat the fields as private.
+typedef struct DeviceIterator {
+    DeviceManager* manager;
+    unsigned int slot;
+    char name[DEVICE_NAME_MAX]; // Backs the name of the view last returned by iter_next
+} DeviceIterator;
+
+// Change notifications
+typedef enum {
+    DEVICE_EVENT_ADDED,
+    DEVICE_EVENT_REMOVED,
+    DEVICE_EVENT_STATE,
+    DEVICE_EVENT_ATTRIBUTE,
+    DEVICE_EVENT_OVERFLOW // Changes were dropped; re-read whatever the subscriber tracks
+} DeviceEventKind;
+
+#define DEVICE_EVENT_BIT(kind) (1U << (kind))
+
+// Every change to one device since the previous delivery, folded into one event
+typedef struct DeviceEvent {
+    unsigned int changes; // DEVICE_EVENT_BIT of each kind of change seen
+    int ident; // -1 for DEVICE_EVENT_OVERFLOW
+    DeviceType type;
+    bool state; // Latest values; as last seen for a removed device
+    int attribute;
+} DeviceEvent;
+
+typedef void (*DeviceEventFn)(const DeviceEvent* events, size_t count, void* udata);
+
+// Per-spec outcome of device_manager_add_devices
+typedef enum {
+    DEVICE_ADD_OK,
+    DEVICE_ADD_DUPLICATE_ID, // Added, but shadows an older device with the same id
+    DEVICE_ADD_INVALID,
+    DEVICE_ADD_NO_MEMORY
+} DeviceAddResult;
+
 // Create and destroy device manager
 DeviceManager* device_manager_create(void);
 void device_manager_destroy(DeviceManager* manager);
 
+// Create a device manager that may be shared between threads. Lookups and state/attribute
+// changes run in parallel, the changes as single atomic stores or RMWs (serialized only
+// while journaling); adding, removing and reserving devices take the manager
+// exclusively. Destroy it only once no other thread is using it.
+DeviceManager* device_manager_create_concurrent(void);
+
+// Create a device manager whose device storage is carved from caller-owned memory.
+// Adding fails once the buffer is full; the buffer must outlive the manager. Names
+// and indexes still live on the heap.
+DeviceManager* device_manager_create_with_arena(void* buffer, size_t size);
+size_t device_manager_arena_size(int device_count);
+
+// Read-only point-in-time view of a manager, for reporting while writers carry on.
+// Taking one only references the manager's storage slabs and name chunks; each is
+// copied the first time the manager changes it afterwards. Every read function works
+// on the view (keyed lookups index it on first use), and it can be read from any
+// thread; changes to it fail. Release it with device_manager_destroy before destroying the manager.
+DeviceManager* device_manager_snapshot(DeviceManager* manager);
+
 // Add and remove devices
 bool device_manager_add_device(DeviceManager* manager, const char* name, DeviceType type, int ident);
 bool device_manager_remove_device(DeviceManager* manager, int ident, const char* name);
 
+// Preallocate storage and index space for device_count devices in total
+bool device_manager_reserve(DeviceManager* manager, size_t device_count);
+// Insert many devices in one pass; results[i] (optional) reports the outcome for specs[i].
+// Returns the number of devices added.
+size_t device_manager_add_devices(DeviceManager* manager, const DeviceSpec* specs, size_t count,
+                                  DeviceAddResult* results);
+
 // Control and query devices
 bool device_manager_set_device_state(DeviceManager* manager, int ident, bool state);
 bool device_manager_set_device_attribute(DeviceManager* manager, int ident, int value);
+// Atomically add delta to a device's attribute; *previous (optional) receives the old value.
+// Returns false if no device has the id.
+bool device_manager_attribute_fetch_add(DeviceManager* manager, int ident, int delta, int* previous);
+// Set a device's attribute to desired only if it still equals *expected. On a mismatch
+// *expected receives the current value; it is left alone if no device has the id.
+bool device_manager_attribute_compare_exchange(DeviceManager* manager, int ident, int* expected, int desired);
+// Apply many updates in one call; results[i] (optional) tells whether ops[i] found its device.
+// Returns the number of updates applied.
+size_t device_manager_apply_batch(DeviceManager* manager, const DeviceUpdate* ops, size_t count, bool* results);
+// Lists every device to stdout in DEVICE_FORMAT_TEXT
 void device_manager_list_devices(DeviceManager* manager);
 int device_manager_get_device_count(DeviceManager* manager);
+// Bytes of device storage, names and indexes the manager holds, wherever they live
+// (heap, arena or a mapped binary snapshot); slabs shared with snapshots count for each
+size_t device_manager_memory_usage(DeviceManager* manager);
+
+// Queries run over per-type and ON/OFF bitsets. device_manager_query stores the ids of
+// up to cap matching devices in out_ids (may be NULL when cap is 0) and returns the
+// total number of matches; a NULL filter matches every device.
+size_t device_manager_query(DeviceManager* manager, const DeviceFilter* filter, int* out_ids, size_t cap);
+int device_manager_count_by_type(DeviceManager* manager, DeviceType type);
+
+// Attribute scans use SSE2/AVX2 kernels when the CPU has them (scalar otherwise).
+// filter_attribute_range is device_manager_query for one type and min <= attribute <= max.
+bool device_manager_aggregate_attribute(DeviceManager* manager, DeviceType type, AggregateResult* result);
+size_t device_manager_filter_attribute_range(DeviceManager* manager, DeviceType type, int min, int max, int* out_ids,
+                                             size_t cap);
+
+// Fleet-wide operations split device storage into 1024-slot chunks shared out between
+// the manager's worker threads, idle workers stealing chunks from busy ones. threads
+// counts the calling thread, which always takes part: 1 (the default) runs everything
+// on the caller, 0 uses one worker per online CPU. Callbacks run concurrently for
+// different devices and must not call back into the manager. Each device is read,
+// changed and written back, so a setter racing the operation on the same device may
+// be overwritten. apply_parallel returns the number of devices it changed,
+// for_each_parallel the number visited; a NULL filter matches every device.
+bool device_manager_set_worker_threads(DeviceManager* manager, size_t threads);
+size_t device_manager_apply_parallel(DeviceManager* manager, const DeviceFilter* filter, const DeviceOp* op);
+size_t device_manager_for_each_parallel(DeviceManager* manager, const DeviceFilter* filter, DeviceVisitFn visit,
+                                        void* udata);
+
+// Streams every device to sink in the given format, formatted into a large buffer
+// that is handed over whenever it fills. The sink runs with the manager locked and
+// must not call back into it. Returns false if the sink or an allocation failed.
+bool device_manager_write_devices(DeviceManager* manager, DeviceSinkFn sink, void* udata, DeviceFormat format);
+// Sink writing to the FILE* passed as udata
+bool device_manager_file_sink(const char* data, size_t size, void* udata);
+
+// Iteration copies devices out, taking the manager's lock only inside each call, so other
+// threads may add and remove devices between calls. Every device present for the whole
+// walk is returned exactly once; devices removed before the cursor reaches them are
+// skipped, and devices added meanwhile may or may not be returned. iter_next points
+// view->name into the iterator; iter_next_batch copies up to count devices, views[i].name
+// pointing at names[i], and returns how many it copied (0 at the end). Nothing is
+// allocated; iter_end only marks the cursor finished.
+void device_manager_iter_begin(DeviceManager* manager, DeviceIterator* iterator);
+bool device_manager_iter_next(DeviceIterator* iterator, DeviceView* view);
+size_t device_manager_iter_next_batch(DeviceIterator* iterator, DeviceView* views, char (*names)[DEVICE_NAME_MAX],
+                                      size_t count);
+void device_manager_iter_end(DeviceIterator* iterator);
+
+// Subscriptions: adds, removals and state/attribute changes are queued in a lock-free
+// ring as they happen and handed out by device_manager_deliver_events, which folds
+// all changes to a device since the previous delivery into one event carrying its
+// latest values. Each subscriber gets the events whose type and latest values match
+// its filter (NULL matches all), in one callback per delivery, on the delivering
+// thread. Callbacks may call into the manager. If more changes pile up between
+// deliveries than the ring holds (16384), the excess is dropped and every subscriber
+// is sent a DEVICE_EVENT_OVERFLOW event first. subscribe returns 0 on failure;
+// unsubscribing from another thread while a delivery runs may still see one callback.
+unsigned int device_manager_subscribe(DeviceManager* manager, const DeviceFilter* filter, DeviceEventFn callback,
+                                      void* udata);
+bool device_manager_unsubscribe(DeviceManager* manager, unsigned int subscription);
+// Returns the number of coalesced events delivered; 0 while another thread is delivering
+size_t device_manager_deliver_events(DeviceManager* manager);
+
+// Replication by deltas. Every add, removal and change bumps the manager's version and
+// stamps the device with it. device_manager_export_changes_since streams what changed
+// after `since` (removals, then added or changed devices in the text snapshot record
+// format) and stores the version to pass next time. Its cost follows the number of
+// changes, not the fleet size. A since of 0, one older than the removals still
+// remembered, or one from another manager yields a full delta listing every device.
+// Versions survive binary snapshots but not text ones, so replicas of a manager
+// loaded from text start over from 0. The sink runs with the manager locked
+// exclusively and must not call back into it.
+uint64_t device_manager_version(DeviceManager* manager);
+bool device_manager_export_changes_since(DeviceManager* manager, uint64_t since, DeviceSinkFn sink, void* udata,
+                                         uint64_t* version);
+// Applies a delta to a replica; a full delta also removes the devices it does not list.
+// Returns false on a malformed delta, leaving the lines before the bad one applied.
+bool device_manager_apply_changes(DeviceManager* manager, const char* data, size_t size);
 
 // Save and load configuration
 bool device_manager_save(DeviceManager* manager, const char* filename);
 DeviceManager* device_manager_load(const char* filename);
 
+// Saves like device_manager_save without waiting for the disk: the request takes a
+// snapshot (see device_manager_snapshot) and a background thread, one per manager,
+// writes it beside filename, syncs it and renames it into place. A request for a file
+// whose previous save has not started yet replaces that save's snapshot, so a burst
+// of checkpoints costs one write. on_done (optional) runs on the background thread
+// once the file holding the request's state is written or has failed, and must not
+// destroy the manager. device_manager_wait_saves blocks until every save requested
+// so far is done; device_manager_destroy writes out queued saves first.
+typedef void (*DeviceSaveFn)(const char* filename, bool saved, void* udata);
+bool device_manager_save_async(DeviceManager* manager, const char* filename, DeviceSaveFn on_done, void* udata);
+void device_manager_wait_saves(DeviceManager* manager);
+
+// Loads a text snapshot like device_manager_load on `threads` threads (0 for one per
+// CPU): the file is mapped, split at line boundaries and parsed range by range, and
+// the records are added in file order. Lines that do not parse are skipped; on_error
+// (optional) gets each one's 1-based number and problem, in order, once parsing is done.
+// device_manager_load is this on the calling thread without error reporting.
+typedef void (*DeviceLoadErrorFn)(size_t line, const char* message, void* udata);
+DeviceManager* device_manager_load_parallel(const char* filename, size_t threads, DeviceLoadErrorFn on_error,
+                                            void* udata);
+
+// Journaling: once enabled, every add/remove/set_state/set_attribute call is appended
+// to "<filename>.wal". Records are fsync'ed in groups of sync_every and the log is
+// folded into a fresh "<filename>" text snapshot every compact_every records (0 never
+// compacts automatically). device_manager_load replays the log onto the snapshot.
+bool device_manager_enable_journal(DeviceManager* manager, const char* filename, size_t sync_every,
+                                   size_t compact_every);
+bool device_manager_journal_sync(DeviceManager* manager);
+bool device_manager_journal_compact(DeviceManager* manager);
+void device_manager_disable_journal(DeviceManager* manager);
+
+// Versioned, checksummed binary snapshots in the in-memory layout. Loading maps
+// the file and uses it directly as device storage; files from a build with a
+// different layout or byte order are rejected.
+bool device_manager_save_binary(DeviceManager* manager, const char* filename);
+DeviceManager* device_manager_load_binary(const char* filename);
+
+// Compact, portable snapshots for slow storage: devices sorted by id, stored column by
+// column with delta-encoded ids, bit-packed types and states, variable-length
+// attributes and names front-coded against the previous one, behind a checksum.
+// Loading rejects damaged files. Device order is by id afterwards, and devices that
+// share an id keep their relative order. Files for bench_device_scan's 1M-device fleet
+// are about 1/4.7 the size of text snapshots, short of the 5x hoped for; most of what
+// remains is the names' unshared suffixes. Saves go through a temp file and a rename.
+bool device_manager_save_compressed(DeviceManager* manager, const char* filename);
+DeviceManager* device_manager_load_compressed(const char* filename);
+
+// Handles: add_device_with_handle and lookup (newest device with the id) hand them
+// out; the by-handle calls below run in O(1) and return false on a stale handle
+bool device_manager_add_device_with_handle(DeviceManager* manager, const char* name, DeviceType type, int ident,
+                                           DeviceHandle* handle);
+DeviceHandle device_manager_lookup(DeviceManager* manager, int ident);
+bool device_manager_handle_valid(DeviceManager* manager, DeviceHandle handle);
+bool device_manager_set_state_by_handle(DeviceManager* manager, DeviceHandle handle, bool state);
+bool device_manager_set_attribute_by_handle(DeviceManager* manager, DeviceHandle handle, int value);
+bool device_manager_get_state_by_handle(DeviceManager* manager, DeviceHandle handle, bool* state);
+bool device_manager_get_attribute_by_handle(DeviceManager* manager, DeviceHandle handle, int* value);
+
+// Sharded registry for fleets too large for one manager. Devices are spread over
+// shard_count concurrent managers by a hash of their id, so callers working on
+// different shards never contend. A shard is created or loaded from disk the first
+// time something needs it, which keeps opening a registry independent of fleet
+// size. Single-device calls go to the id's shard; counts and queries fan out over
+// every shard on the registry's worker threads (threads as for
+// device_manager_set_worker_threads), loading any shard not yet loaded.
+typedef struct DeviceRegistry DeviceRegistry;
+
+// On-disk format of each shard: device_manager_save text, device_manager_save_binary
+// or device_manager_save_compressed
+typedef enum {
+    DEVICE_SHARD_TEXT,
+    DEVICE_SHARD_BINARY,
+    DEVICE_SHARD_COMPRESSED
+} DeviceShardFormat;
+
+DeviceRegistry* device_registry_create(size_t shard_count, size_t threads);
+void device_registry_destroy(DeviceRegistry* registry);
+size_t device_registry_shard_count(DeviceRegistry* registry);
+// Index of the shard holding devices with the given id
+size_t device_registry_shard_of(DeviceRegistry* registry, int ident);
+// The shard's manager, loaded if need be; NULL if it cannot be loaded. It stays owned
+// by the registry and may be used from any thread. Devices added through it directly
+// must belong to the shard (device_registry_shard_of their id).
+DeviceManager* device_registry_shard(DeviceRegistry* registry, size_t index);
+// Shards loaded or created so far
+size_t device_registry_loaded_shards(DeviceRegistry* registry);
+
+bool device_registry_add_device(DeviceRegistry* registry, const char* name, DeviceType type, int ident);
+bool device_registry_remove_device(DeviceRegistry* registry, int ident, const char* name);
+bool device_registry_set_device_state(DeviceRegistry* registry, int ident, bool state);
+bool device_registry_set_device_attribute(DeviceRegistry* registry, int ident, int value);
+int device_registry_get_device_attribute(DeviceRegistry* registry, int ident);
+
+// Fan-out over all shards; a shard that fails to load counts as empty. Query results
+// are grouped by shard, in shard order, with the same meaning of cap and the return
+// value as device_manager_query.
+size_t device_registry_get_device_count(DeviceRegistry* registry);
+size_t device_registry_count_by_type(DeviceRegistry* registry, DeviceType type);
+size_t device_registry_query(DeviceRegistry* registry, const DeviceFilter* filter, int* out_ids, size_t cap);
+
+// Persistence: a small manifest at path names the shard count and format, and shard
+// i lives in "<path>.<i>". Each file is written beside its target and renamed into
+// place, shards in parallel. Shards never loaded since the registry was opened from
+// the same path in the same format are already on disk and are skipped; others are
+// loaded first. device_registry_open reads only the manifest. Shards load in whatever
+// format their file is in, so a save switching formats that fails part way leaves a
+// registry that still opens, with some shards in the new format.
+bool device_registry_save(DeviceRegistry* registry, const char* path, DeviceShardFormat format);
+DeviceRegistry* device_registry_open(const char* path, size_t threads);
+
 // Additional functions to expose internal data for testing
 const char* device_manager_get_device_name(DeviceManager* manager, int ident, const char* name);
 DeviceType device_manager_get_device_type(DeviceManager* manager, int ident, const char* name);
 bool device_manager_get_device_state(DeviceManager* manager, int ident, const char* name);
 int device_manager_get_device_attribute(DeviceManager* manager, int ident);
-DeviceManager* device_manager_get_device_head(DeviceManager* manager);
 int get_device_id(DeviceManager* manager, const char* name);
 #endif // DEVICE_MANAGER_H
@@ -0,0 +1,381 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "device_manager_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Binary snapshots are the slab images and then the name chunks, in host layout
+// behind a fixed header.
+// The header pins every layout parameter so a mismatched build refuses the file
+// instead of misreading it.
+#define SNAPSHOT_MAGIC "DMSNAP\r\n"
+#define SNAPSHOT_MAGIC_LEN 8
+#define SNAPSHOT_VERSION 8
+#define SNAPSHOT_BYTE_ORDER 0x01020304U
+#define SNAPSHOT_TEMP_SUFFIX ".tmp"
+_Static_assert(SNAPSHOT_MAGIC_LEN <= SNAPSHOT_SNIFF_LEN, "the magic must fit in SNAPSHOT_SNIFF_LEN");
+
+typedef struct SnapshotHeader {
+    char magic[SNAPSHOT_MAGIC_LEN];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t byte_order;
+    uint32_t slab_slots;
+    uint32_t name_len;
+    uint32_t slab_size;
+    uint32_t slab_count;
+    uint32_t high_water;
+    uint32_t device_count;
+    uint32_t name_chunk_size;
+    uint32_t name_chunk_count;
+    uint32_t names_used;
+    uint32_t free_lists[NAME_CLASSES];
+    uint32_t free_head; // First slot of the free list, linked through id_next
+    uint32_t reserved;
+    uint64_t checksum; // Over the slab images and name chunks that follow
+} SnapshotHeader;
+
+// Word-at-a-time FNV-style hash; only guards against truncation and bit rot
+static uint64_t checksum_update(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        memcpy(&word, bytes + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001b3ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t checksum_storage(DeviceSlab* const* slabs, uint32_t slab_count, NameChunk* const* chunks,
+                                 uint32_t chunk_count) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (uint32_t i = 0; i < slab_count; i++) {
+        hash = checksum_update(hash, slabs[i], sizeof(DeviceSlab));
+    }
+    for (uint32_t i = 0; i < chunk_count; i++) {
+        hash = checksum_update(hash, chunks[i], sizeof(NameChunk));
+    }
+    return hash;
+}
+
+bool snapshot_is_binary(const unsigned char* head, size_t size) {
+    return size >= SNAPSHOT_MAGIC_LEN && memcmp(head, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) == 0;
+}
+
+static bool header_valid(const SnapshotHeader* header, size_t file_size) {
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0 || header->version != SNAPSHOT_VERSION ||
+        header->header_size != sizeof(SnapshotHeader) || header->byte_order != SNAPSHOT_BYTE_ORDER ||
+        header->slab_slots != SLAB_SLOTS || header->name_len != NAME_LEN ||
+        header->slab_size != sizeof(DeviceSlab) || header->name_chunk_size != sizeof(NameChunk)) {
+        return false;
+    }
+    if (header->high_water > (uint64_t)header->slab_count * SLAB_SLOTS ||
+        header->device_count > header->high_water || header->name_chunk_count > (1U << (32 - NAME_CHUNK_SHIFT)) ||
+        header->names_used > NAME_CHUNK_SIZE || (header->names_used != 0 && header->name_chunk_count == 0)) {
+        return false;
+    }
+    return file_size == sizeof(SnapshotHeader) + (size_t)header->slab_count * sizeof(DeviceSlab) +
+                            (size_t)header->name_chunk_count * sizeof(NameChunk);
+}
+
+// A reference must name a whole, aligned block inside the chunks written
+static bool name_ref_valid(const DeviceNames* names, uint32_t ref) {
+    uint32_t chunk = ref >> NAME_CHUNK_SHIFT;
+    uint32_t offset = ref & (NAME_CHUNK_SIZE - 1);
+    uint32_t limit = chunk + 1 == names->chunk_count ? names->used : NAME_CHUNK_SIZE;
+    return chunk < names->chunk_count && offset % NAME_ALIGN == 0 && offset + NAME_ALIGN <= limit;
+}
+
+// Free lists are walked in full so a corrupt link can never send a later add out of bounds
+static bool free_lists_valid(const DeviceStorage* storage) {
+    const DeviceNames* names = &storage->names;
+    size_t budget = (size_t)names->chunk_count * (NAME_CHUNK_SIZE / NAME_ALIGN);
+    for (uint32_t size_class = 0; size_class < NAME_CLASSES; size_class++) {
+        for (uint32_t ref = names->free_lists[size_class]; ref != NO_NAME;) {
+            if (budget-- == 0 || !name_ref_valid(names, ref) ||
+                (ref & (NAME_CHUNK_SIZE - 1)) + size_class * NAME_ALIGN > NAME_CHUNK_SIZE ||
+                size_class * NAME_ALIGN < NAME_BLOCK_SIZE(0)) {
+                return false;
+            }
+            memcpy(&ref, name_block(storage, ref), sizeof(ref));
+        }
+    }
+    return true;
+}
+
+// Rejects live slots the public API could never have produced
+static bool slabs_valid(const DeviceStorage* storage) {
+    for (uint32_t slot = 0; slot < storage->high_water; slot++) {
+        const DeviceSlab* slab = SLAB_OF(storage, slot);
+        uint32_t index = SLAB_INDEX(slot);
+        if (!bit_test(slab->live_bits, index)) {
+            continue;
+        }
+        if (slab->ids[index] < 0 || slab->types[index] >= DEVICE_TYPE_COUNT) {
+            return false;
+        }
+        uint32_t ref = slab->name_refs[index];
+        if (!name_ref_valid(&storage->names, ref)) {
+            return false;
+        }
+        const unsigned char* block = name_block(storage, ref);
+        uint32_t limit = ref >> NAME_CHUNK_SHIFT == storage->names.chunk_count - 1 ? storage->names.used
+                                                                                   : NAME_CHUNK_SIZE;
+        if (block[0] == 0 || (ref & (NAME_CHUNK_SIZE - 1)) + NAME_BLOCK_SIZE(block[0]) > limit ||
+            memchr(block + 1, '\0', block[0]) != NULL || block[1 + block[0]] != '\0') {
+            return false;
+        }
+    }
+    // Scans cover whole bitset words, so nothing past the high water mark may be live
+    for (uint32_t slot = storage->high_water; slot % BITS_PER_WORD != 0; slot++) {
+        if (bit_test(SLAB_OF(storage, slot)->live_bits, SLAB_INDEX(slot))) {
+            return false;
+        }
+    }
+    return free_lists_valid(storage);
+}
+
+// Copy of a slab whose values may be changing under atomic setters, column by column
+static void slab_image(const DeviceSlab* slab, DeviceSlab* image) {
+    memset(image, 0, sizeof(DeviceSlab));
+    memcpy(image->ids, slab->ids, sizeof(slab->ids));
+    memcpy(image->id_next, slab->id_next, sizeof(slab->id_next));
+    memcpy(image->name_next, slab->name_next, sizeof(slab->name_next));
+    memcpy(image->generations, slab->generations, sizeof(slab->generations));
+    memcpy(image->live_bits, slab->live_bits, sizeof(slab->live_bits));
+    memcpy(image->type_bits, slab->type_bits, sizeof(slab->type_bits));
+    memcpy(image->types, slab->types, sizeof(slab->types));
+    memcpy(image->name_refs, slab->name_refs, sizeof(slab->name_refs));
+    for (uint32_t i = 0; i < SLAB_SLOTS; i++) {
+        image->attributes[i] = atomic_load_int(&slab->attributes[i]);
+    }
+    for (uint32_t i = 0; i < SLAB_SLOTS; i++) {
+        image->versions[i] = atomic_load_word(&slab->versions[i]);
+    }
+    for (uint32_t i = 0; i < SLAB_WORDS; i++) {
+        image->state_bits[i] = atomic_load_word(&slab->state_bits[i]);
+        image->word_versions[i] = atomic_load_word(&slab->word_versions[i]);
+    }
+}
+
+static bool write_snapshot(DeviceManager* manager, FILE* file) {
+    manager_read_lock(manager);
+    const DeviceStorage* storage = &manager->storage;
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(SnapshotHeader);
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.slab_slots = SLAB_SLOTS;
+    header.name_len = NAME_LEN;
+    header.slab_size = sizeof(DeviceSlab);
+    // Trailing slabs that never held a device are left out
+    header.slab_count = (storage->high_water + SLAB_SLOTS - 1) / SLAB_SLOTS;
+    header.high_water = storage->high_water;
+    header.free_head = storage->free_head;
+    header.device_count = (uint32_t)manager->count;
+    header.name_chunk_size = sizeof(NameChunk);
+    header.name_chunk_count = storage->names.chunk_count;
+    header.names_used = storage->names.used;
+    memcpy(header.free_lists, storage->names.free_lists, sizeof(header.free_lists));
+
+    // The checksum is taken over exactly the bytes written and the header is
+    // rewritten last, so values changing during the save cannot invalidate it.
+    // Slabs and chunks shared with snapshots are imaged too, as their share count is live.
+    DeviceSlab* image = (DeviceSlab*)malloc(sizeof(DeviceSlab));
+    NameChunk* chunk_image = (NameChunk*)malloc(sizeof(NameChunk));
+    uint64_t checksum = 0xcbf29ce484222325ULL;
+    bool written = image && chunk_image && fwrite(&header, sizeof(header), 1, file) == 1;
+    for (uint32_t i = 0; written && i < header.slab_count; i++) {
+        const DeviceSlab* slab = storage->slabs[i];
+        if (storage->atomic_values || atomic_load_int(&slab->shares) != 0) {
+            slab_image(slab, image);
+            slab = image;
+        }
+        checksum = checksum_update(checksum, slab, sizeof(DeviceSlab));
+        written = fwrite(slab, sizeof(DeviceSlab), 1, file) == 1;
+    }
+    for (uint32_t i = 0; written && i < header.name_chunk_count; i++) {
+        const NameChunk* chunk = storage->names.chunks[i];
+        if (atomic_load_int(&chunk->shares) != 0) {
+            memcpy(chunk_image->bytes, chunk->bytes, sizeof(chunk->bytes));
+            chunk_image->shares = 0;
+            chunk = chunk_image;
+        }
+        checksum = checksum_update(checksum, chunk, sizeof(NameChunk));
+        written = fwrite(chunk, sizeof(NameChunk), 1, file) == 1;
+    }
+    manager_read_unlock(manager);
+    free(image);
+    free(chunk_image);
+    header.checksum = checksum;
+    return written && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+// Written beside the target and renamed over it: a manager loaded from the target
+// may still be using its mapping, which truncating in place would pull out from under it
+bool device_manager_save_binary(DeviceManager* manager, const char* filename) {
+    if (!manager || !filename) {
+        return false;
+    }
+    char* temp = path_with_suffix(filename, SNAPSHOT_TEMP_SUFFIX);
+    FILE* file = temp ? fopen(temp, "wb") : NULL;
+    bool saved = file && write_snapshot(manager, file) && file_sync(file);
+    saved = file && fclose(file) == 0 && saved && file_replace(temp, filename);
+    if (file && !saved) {
+        remove(temp);
+    }
+    free(temp);
+    return saved;
+}
+
+// Hands the slab images and name chunks (and the mapping they live in, if any) to
+// an empty manager and builds its indexes from the links stored in the slabs, without
+// writing to them; the manager is destroyed on failure
+static DeviceManager* adopt_slabs(DeviceManager* manager, DeviceSlab** slabs, NameChunk** chunks,
+                                  const SnapshotHeader* header, void* mapping, size_t mapping_size) {
+    DeviceStorage* storage = &manager->storage;
+    storage->names.chunks = chunks;
+    storage->names.chunk_count = header->name_chunk_count;
+    storage->names.chunk_capacity = header->name_chunk_count;
+    storage->names.used = header->names_used;
+    memcpy(storage->names.free_lists, header->free_lists, sizeof(storage->names.free_lists));
+    storage->slabs = slabs;
+    storage->slab_count = header->slab_count;
+    storage->slab_capacity = header->slab_count;
+    storage->high_water = header->high_water;
+    storage->free_head = header->free_head;
+    storage->mapping = mapping;
+    storage->mapping_size = mapping_size;
+    if (!slabs_valid(storage) || !manager_reindex(manager) || manager->count != (int)header->device_count) {
+        device_manager_destroy(manager);
+        return NULL;
+    }
+    return manager;
+}
+
+#if defined(_WIN32)
+
+void storage_release_mapping(DeviceStorage* storage) {
+    storage->mapping = NULL;
+}
+
+// No mmap here: slabs are read into heap memory instead
+DeviceManager* device_manager_load_binary(const char* filename) {
+    FILE* file = filename ? fopen(filename, "rb") : NULL;
+    if (!file) {
+        return NULL;
+    }
+    SnapshotHeader header;
+    long file_size = 0;
+    if (fread(&header, sizeof(header), 1, file) != 1 || fseek(file, 0, SEEK_END) != 0 ||
+        (file_size = ftell(file)) < 0 || !header_valid(&header, (size_t)file_size) ||
+        fseek(file, (long)sizeof(header), SEEK_SET) != 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    DeviceManager* manager = device_manager_create();
+    DeviceSlab** slabs = (DeviceSlab**)calloc(header.slab_count ? header.slab_count : 1, sizeof(DeviceSlab*));
+    NameChunk** chunks =
+        (NameChunk**)calloc(header.name_chunk_count ? header.name_chunk_count : 1, sizeof(NameChunk*));
+    bool loaded = manager && slabs && chunks;
+    for (uint32_t i = 0; loaded && i < header.slab_count; i++) {
+        slabs[i] = (DeviceSlab*)malloc(sizeof(DeviceSlab));
+        loaded = slabs[i] && fread(slabs[i], sizeof(DeviceSlab), 1, file) == 1;
+    }
+    for (uint32_t i = 0; loaded && i < header.name_chunk_count; i++) {
+        chunks[i] = (NameChunk*)malloc(sizeof(NameChunk));
+        loaded = chunks[i] && fread(chunks[i], sizeof(NameChunk), 1, file) == 1;
+    }
+    fclose(file);
+    if (loaded && checksum_storage(slabs, header.slab_count, chunks, header.name_chunk_count) == header.checksum) {
+        return adopt_slabs(manager, slabs, chunks, &header, NULL, 0);
+    }
+    for (uint32_t i = 0; slabs && i < header.slab_count; i++) {
+        free(slabs[i]);
+    }
+    for (uint32_t i = 0; chunks && i < header.name_chunk_count; i++) {
+        free(chunks[i]);
+    }
+    free((void*)slabs);
+    free((void*)chunks);
+    device_manager_destroy(manager);
+    return NULL;
+}
+
+#else
+
+void storage_release_mapping(DeviceStorage* storage) {
+    if (storage->mapping) {
+        munmap(storage->mapping, storage->mapping_size);
+        storage->mapping = NULL;
+    }
+}
+
+// The file is mapped privately and its slab images become the device storage:
+// nothing is parsed or copied, and pages are only duplicated once they are written
+DeviceManager* device_manager_load_binary(const char* filename) {
+    int fd = filename ? open(filename, O_RDONLY) : -1;
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(SnapshotHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)info.st_size;
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    SnapshotHeader header;
+    memcpy(&header, mapping, sizeof(header));
+    DeviceManager* manager = NULL;
+    DeviceSlab** slabs = NULL;
+    NameChunk** chunks = NULL;
+    if (header_valid(&header, size)) {
+        manager = device_manager_create();
+        slabs = (DeviceSlab**)calloc(header.slab_count ? header.slab_count : 1, sizeof(DeviceSlab*));
+        chunks = (NameChunk**)calloc(header.name_chunk_count ? header.name_chunk_count : 1, sizeof(NameChunk*));
+    }
+    if (manager && slabs && chunks) {
+        unsigned char* images = (unsigned char*)mapping + sizeof(SnapshotHeader);
+        for (uint32_t i = 0; i < header.slab_count; i++) {
+            slabs[i] = (DeviceSlab*)(void*)(images + (size_t)i * sizeof(DeviceSlab));
+        }
+        images += (size_t)header.slab_count * sizeof(DeviceSlab);
+        for (uint32_t i = 0; i < header.name_chunk_count; i++) {
+            chunks[i] = (NameChunk*)(void*)(images + (size_t)i * sizeof(NameChunk));
+        }
+        if (checksum_storage(slabs, header.slab_count, chunks, header.name_chunk_count) == header.checksum) {
+            return adopt_slabs(manager, slabs, chunks, &header, mapping, size);
+        }
+    }
+    free((void*)slabs);
+    free((void*)chunks);
+    device_manager_destroy(manager);
+    munmap(mapping, size);
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,353 @@
+#include "device_manager_internal.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Compressed snapshots hold the devices sorted by id, one column at a time:
+//   magic, varint format version, varint device count
+//   ids         varint gap from the previous id (the first from 0)
+//   types       2 bits per device, packed from the low bits of each byte
+//   states      1 bit per device, packed the same way
+//   attributes  zigzag varints
+//   names       varint bytes shared with the previous name, varint length of the
+//               rest, then the rest
+//   checksum    8 bytes, little-endian, over everything before it
+// Varints are little-endian base 128, so the file reads the same on every host.
+#define PACK_MAGIC "DMPACK\r\n"
+#define PACK_MAGIC_LEN 8
+#define PACK_VERSION 1
+#define PACK_TYPE_BITS 2
+#define PACK_TEMP_SUFFIX ".tmp"
+_Static_assert(PACK_MAGIC_LEN <= SNAPSHOT_SNIFF_LEN, "the magic must fit in SNAPSHOT_SNIFF_LEN");
+_Static_assert(DEVICE_TYPE_COUNT <= 1 << PACK_TYPE_BITS, "device types must fit in PACK_TYPE_BITS");
+
+bool snapshot_is_compressed(const unsigned char* head, size_t size) {
+    return size >= PACK_MAGIC_LEN && memcmp(head, PACK_MAGIC, PACK_MAGIC_LEN) == 0;
+}
+
+typedef struct PackBuffer {
+    unsigned char* data;
+    size_t used;
+    size_t capacity;
+    bool failed;
+} PackBuffer;
+
+static unsigned char* pack_reserve(PackBuffer* buffer, size_t size) {
+    if (buffer->failed) {
+        return NULL;
+    }
+    if (buffer->capacity - buffer->used < size) {
+        size_t capacity = buffer->capacity * 2 > buffer->used + size ? buffer->capacity * 2 : buffer->used + size;
+        unsigned char* data = (unsigned char*)realloc(buffer->data, capacity);
+        if (!data) {
+            buffer->failed = true;
+            return NULL;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    return buffer->data + buffer->used;
+}
+
+static void pack_bytes(PackBuffer* buffer, const void* bytes, size_t size) {
+    unsigned char* out = pack_reserve(buffer, size);
+    if (out) {
+        memcpy(out, bytes, size);
+        buffer->used += size;
+    }
+}
+
+static void pack_varint(PackBuffer* buffer, uint64_t value) {
+    unsigned char* out = pack_reserve(buffer, 10);
+    if (!out) {
+        return;
+    }
+    size_t length = 0;
+    for (; value >= 0x80; value >>= 7) {
+        out[length++] = (unsigned char)(value | 0x80);
+    }
+    out[length++] = (unsigned char)value;
+    buffer->used += length;
+}
+
+static uint64_t zigzag(int value) {
+    return value < 0 ? ((uint64_t)-(int64_t)value << 1) - 1 : (uint64_t)value << 1;
+}
+
+static int unzigzag(uint64_t value) {
+    return value & 1 ? (int)(-(int64_t)(value >> 1) - 1) : (int)(value >> 1);
+}
+
+// Fixed-width fields packed low bits first; bytes are zeroed as they are reached
+static void pack_bits(PackBuffer* buffer, size_t index, unsigned bits, unsigned value) {
+    size_t bit = index * bits;
+    if (bit % 8 == 0) {
+        pack_bytes(buffer, "", 1);
+    }
+    if (!buffer->failed) {
+        buffer->data[buffer->used - 1] |= (unsigned char)(value << (bit % 8));
+    }
+}
+
+// Slots of the live devices ordered by id. The stable LSD radix sort on the id runs
+// over the slots in age order, so devices sharing an id stay oldest first and the
+// newest of them is still the newest on load. Devices sharing only a name are put in
+// id order, so by-name lookups may find another of them first after a reload.
+static uint32_t* sorted_slots(const DeviceManager* manager, size_t count) {
+    size_t live = 0;
+    uint32_t* slots = storage_age_order(&manager->storage, &live);
+    uint64_t* keys = (uint64_t*)malloc((count ? count : 1) * sizeof(uint64_t));
+    uint64_t* spare = (uint64_t*)malloc((count ? count : 1) * sizeof(uint64_t));
+    if (!keys || !spare || !slots || live != count) {
+        free(keys);
+        free(spare);
+        free(slots);
+        return NULL;
+    }
+    const DeviceStorage* storage = &manager->storage;
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = (uint64_t)(uint32_t)SLOT_FIELD(storage, slots[i], ids) << 32 | slots[i];
+    }
+    for (unsigned shift = 32; shift < 64; shift += 8) {
+        size_t offsets[256] = {0};
+        for (size_t i = 0; i < count; i++) {
+            offsets[(keys[i] >> shift) & 0xFF]++;
+        }
+        size_t total = 0;
+        for (size_t digit = 0; digit < 256; digit++) {
+            size_t bucket = offsets[digit];
+            offsets[digit] = total;
+            total += bucket;
+        }
+        for (size_t i = 0; i < count; i++) {
+            spare[offsets[(keys[i] >> shift) & 0xFF]++] = keys[i];
+        }
+        uint64_t* swap = keys;
+        keys = spare;
+        spare = swap;
+    }
+    for (size_t i = 0; i < count; i++) {
+        slots[i] = (uint32_t)keys[i];
+    }
+    free(keys);
+    free(spare);
+    return slots;
+}
+
+static void pack_devices(const DeviceManager* manager, const uint32_t* slots, size_t count, PackBuffer* buffer) {
+    const DeviceStorage* storage = &manager->storage;
+    pack_bytes(buffer, PACK_MAGIC, PACK_MAGIC_LEN);
+    pack_varint(buffer, PACK_VERSION);
+    pack_varint(buffer, count);
+    uint32_t previous = 0;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t ident = (uint32_t)SLOT_FIELD(storage, slots[i], ids);
+        pack_varint(buffer, ident - previous);
+        previous = ident;
+    }
+    for (size_t i = 0; i < count; i++) {
+        pack_bits(buffer, i, PACK_TYPE_BITS, SLOT_FIELD(storage, slots[i], types));
+    }
+    for (size_t i = 0; i < count; i++) {
+        pack_bits(buffer, i, 1, slot_state(storage, slots[i]));
+    }
+    for (size_t i = 0; i < count; i++) {
+        pack_varint(buffer, zigzag(slot_attribute(storage, slots[i])));
+    }
+    const char* last = "";
+    size_t last_length = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char* name = slot_name(storage, slots[i]);
+        size_t length = slot_name_length(storage, slots[i]);
+        size_t shared = 0;
+        while (shared < length && shared < last_length && name[shared] == last[shared]) {
+            shared++;
+        }
+        pack_varint(buffer, shared);
+        pack_varint(buffer, length - shared);
+        pack_bytes(buffer, name + shared, length - shared);
+        last = name;
+        last_length = length;
+    }
+}
+
+// Packed in memory first, then written beside the target and renamed over it, so a
+// failure at any point leaves the previous snapshot intact
+bool device_manager_save_compressed(DeviceManager* manager, const char* filename) {
+    if (!manager || !filename) {
+        return false;
+    }
+    manager_read_lock(manager);
+    size_t count = (size_t)manager->count;
+    uint32_t* slots = sorted_slots(manager, count);
+    // Typically well under 16 bytes a device; the buffer grows if not
+    PackBuffer buffer = {NULL, 0, 0, slots == NULL};
+    pack_reserve(&buffer, count * 16 + 64);
+    if (slots) {
+        pack_devices(manager, slots, count, &buffer);
+    }
+    manager_read_unlock(manager);
+    free(slots);
+
+    uint64_t checksum = buffer.failed ? 0 : fnv1a64(FNV_OFFSET_BASIS, buffer.data, buffer.used);
+    unsigned char trailer[sizeof(uint64_t)];
+    for (size_t i = 0; i < sizeof(trailer); i++) {
+        trailer[i] = (unsigned char)(checksum >> (8 * i));
+    }
+    pack_bytes(&buffer, trailer, sizeof(trailer));
+    if (buffer.failed) {
+        free(buffer.data);
+        return false;
+    }
+    char* temp = path_with_suffix(filename, PACK_TEMP_SUFFIX);
+    FILE* file = temp ? fopen(temp, "wb") : NULL;
+    bool saved = file && fwrite(buffer.data, buffer.used, 1, file) == 1 && file_sync(file);
+    saved = file && fclose(file) == 0 && saved && file_replace(temp, filename);
+    if (file && !saved) {
+        remove(temp);
+    }
+    free(temp);
+    free(buffer.data);
+    return saved;
+}
+
+typedef struct UnpackCursor {
+    const unsigned char* at;
+    const unsigned char* end;
+    bool failed;
+} UnpackCursor;
+
+static uint64_t unpack_varint(UnpackCursor* cursor) {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64 && cursor->at < cursor->end; shift += 7) {
+        unsigned char byte = *cursor->at++;
+        value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    cursor->failed = true;
+    return 0;
+}
+
+// Returns the start of a column of count fields of the given width, skipping past it
+static const unsigned char* unpack_bits(UnpackCursor* cursor, size_t count, unsigned bits) {
+    size_t size = (count * bits + 7) / 8;
+    if ((size_t)(cursor->end - cursor->at) < size) {
+        cursor->failed = true;
+        return NULL;
+    }
+    const unsigned char* column = cursor->at;
+    cursor->at += size;
+    return column;
+}
+
+static unsigned bits_at(const unsigned char* column, size_t index, unsigned bits) {
+    size_t bit = index * bits;
+    return (unsigned)(column[bit / 8] >> (bit % 8)) & ((1U << bits) - 1);
+}
+
+// Decodes every device into specs, their names one after another in *names, each
+// terminated; fails on anything save_compressed could not have written
+static bool unpack_devices(UnpackCursor* cursor, DeviceSpec* specs, size_t count, PackBuffer* names) {
+    uint64_t ident = 0;
+    for (size_t i = 0; i < count && !cursor->failed; i++) {
+        ident += unpack_varint(cursor);
+        if (ident > INT_MAX) {
+            return false;
+        }
+        specs[i].ident = (int)ident;
+    }
+    const unsigned char* types = unpack_bits(cursor, count, PACK_TYPE_BITS);
+    const unsigned char* states = unpack_bits(cursor, count, 1);
+    for (size_t i = 0; i < count && !cursor->failed; i++) {
+        unsigned type = bits_at(types, i, PACK_TYPE_BITS);
+        if (type >= DEVICE_TYPE_COUNT) {
+            return false;
+        }
+        specs[i].type = (DeviceType)type;
+        specs[i].state = bits_at(states, i, 1) != 0;
+        uint64_t attribute = unpack_varint(cursor);
+        if (attribute > UINT32_MAX) {
+            return false;
+        }
+        specs[i].attribute = unzigzag(attribute);
+    }
+    size_t last = 0;
+    size_t last_length = 0;
+    for (size_t i = 0; i < count && !cursor->failed; i++) {
+        uint64_t shared = unpack_varint(cursor);
+        uint64_t rest = unpack_varint(cursor);
+        if (cursor->failed || shared > last_length || rest > (uint64_t)(cursor->end - cursor->at) ||
+            shared + rest == 0 || shared + rest >= NAME_LEN || memchr(cursor->at, '\0', rest) != NULL) {
+            return false;
+        }
+        char* name = (char*)pack_reserve(names, shared + rest + 1);
+        if (!name) {
+            return false;
+        }
+        memcpy(name, names->data + last, shared);
+        memcpy(name + shared, cursor->at, rest);
+        name[shared + rest] = '\0';
+        cursor->at += rest;
+        last = names->used;
+        last_length = shared + rest;
+        names->used += last_length + 1;
+    }
+    if (cursor->failed || cursor->at != cursor->end) {
+        return false;
+    }
+    // Names only stop moving once the buffer is complete
+    const char* name = (const char*)names->data;
+    for (size_t i = 0; i < count; i++) {
+        specs[i].name = name;
+        name += strlen(name) + 1;
+    }
+    return true;
+}
+
+DeviceManager* device_manager_load_compressed(const char* filename) {
+    FILE* file = filename ? fopen(filename, "rb") : NULL;
+    if (!file) {
+        return NULL;
+    }
+    long size = 0;
+    unsigned char* data = NULL;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = (unsigned char*)malloc(size ? (size_t)size : 1);
+    }
+    bool read = data && size >= PACK_MAGIC_LEN + (long)sizeof(uint64_t) && fread(data, (size_t)size, 1, file) == 1;
+    fclose(file);
+    if (!read) {
+        free(data);
+        return NULL;
+    }
+
+    size_t body = (size_t)size - sizeof(uint64_t);
+    uint64_t checksum = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); i++) {
+        checksum |= (uint64_t)data[body + i] << (8 * i);
+    }
+    UnpackCursor cursor = {data + PACK_MAGIC_LEN, data + body, false};
+    bool valid = memcmp(data, PACK_MAGIC, PACK_MAGIC_LEN) == 0 &&
+                 fnv1a64(FNV_OFFSET_BASIS, data, body) == checksum && unpack_varint(&cursor) == PACK_VERSION;
+    uint64_t count = valid ? unpack_varint(&cursor) : 0;
+    // Every device takes at least three bytes, which bounds what a bad count can allocate
+    valid = valid && !cursor.failed && count <= body / 3;
+
+    DeviceSpec* specs = valid ? (DeviceSpec*)malloc((count ? count : 1) * sizeof(DeviceSpec)) : NULL;
+    PackBuffer names = {NULL, 0, 0, false};
+    pack_reserve(&names, body * 2);
+    DeviceManager* manager = specs && !names.failed ? device_manager_create() : NULL;
+    bool loaded = manager && unpack_devices(&cursor, specs, (size_t)count, &names) &&
+                  device_manager_add_devices(manager, specs, (size_t)count, NULL) == count;
+    free(data);
+    free(specs);
+    free(names.data);
+    if (!loaded) {
+        device_manager_destroy(manager);
+        return NULL;
+    }
+    return manager;
+}
@@ -0,0 +1,212 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "device_manager_internal.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Removals are kept in a ring that doubles on demand up to TOMBSTONE_LIMIT entries
+// and then overwrites its oldest entry.
+#define TOMBSTONE_MIN_CAPACITY 64
+#define TOMBSTONE_LIMIT (1U << 16)
+
+void delta_record_removal(DeviceManager* manager, int ident, const char* name, uint64_t version) {
+    DeviceTombstones* tombstones = &manager->tombstones;
+    if (tombstones->count == tombstones->capacity && tombstones->capacity < TOMBSTONE_LIMIT) {
+        size_t capacity = tombstones->capacity ? tombstones->capacity * 2 : TOMBSTONE_MIN_CAPACITY;
+        DeviceTombstone* grown = (DeviceTombstone*)malloc(capacity * sizeof(DeviceTombstone));
+        if (grown) {
+            // Unrolled so the oldest entry lands at index 0
+            for (size_t i = 0; i < tombstones->count; i++) {
+                grown[i] = tombstones->entries[(tombstones->head + i) % tombstones->capacity];
+            }
+            free(tombstones->entries);
+            tombstones->entries = grown;
+            tombstones->capacity = capacity;
+            tombstones->head = 0;
+        }
+    }
+    if (tombstones->capacity == 0) {
+        // Nowhere to keep it: no delta from before this removal can be trusted
+        tombstones->horizon = version;
+        return;
+    }
+    size_t length = strlen(name);
+    char* copy = (char*)malloc(length + 1);
+    if (!copy) {
+        tombstones->horizon = version;
+        return;
+    }
+    memcpy(copy, name, length + 1);
+    DeviceTombstone* tombstone;
+    if (tombstones->count == tombstones->capacity) {
+        tombstone = &tombstones->entries[tombstones->head];
+        tombstones->horizon = tombstone->version;
+        tombstones->head = (tombstones->head + 1) % tombstones->capacity;
+        free(tombstone->name);
+    } else {
+        tombstone = &tombstones->entries[(tombstones->head + tombstones->count++) % tombstones->capacity];
+    }
+    tombstone->version = version;
+    tombstone->ident = ident;
+    tombstone->name = copy;
+}
+
+void delta_free(DeviceManager* manager) {
+    DeviceTombstones* tombstones = &manager->tombstones;
+    for (size_t i = 0; i < tombstones->count; i++) {
+        free(tombstones->entries[(tombstones->head + i) % tombstones->capacity].name);
+    }
+    free(tombstones->entries);
+    memset(tombstones, 0, sizeof(*tombstones));
+}
+
+uint64_t device_manager_version(DeviceManager* manager) {
+    return manager ? atomic_load_word(&manager->version) : 0;
+}
+
+// Cursor over one line of a delta; fields are separated by single spaces
+typedef struct DeltaLine {
+    const char* at;
+    const char* end;
+} DeltaLine;
+
+static bool parse_field(DeltaLine* line, const char** field, size_t* length) {
+    const char* start = line->at;
+    while (line->at < line->end && *line->at != ' ') {
+        line->at++;
+    }
+    *field = start;
+    *length = (size_t)(line->at - start);
+    if (line->at < line->end) {
+        line->at++;
+    }
+    return *length > 0;
+}
+
+static bool parse_version(DeltaLine* line, uint64_t* value) {
+    const char* field;
+    size_t length;
+    if (!parse_field(line, &field, &length) || length > 19) {
+        return false;
+    }
+    *value = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (field[i] < '0' || field[i] > '9') {
+            return false;
+        }
+        *value = *value * 10 + (uint64_t)(field[i] - '0');
+    }
+    return true;
+}
+
+static bool parse_int(DeltaLine* line, int* value) {
+    const char* field;
+    size_t length;
+    if (!parse_field(line, &field, &length)) {
+        return false;
+    }
+    bool negative = field[0] == '-';
+    size_t i = negative ? 1 : 0;
+    if (i == length) {
+        return false;
+    }
+    long long magnitude = 0;
+    for (; i < length; i++) {
+        if (field[i] < '0' || field[i] > '9' || magnitude > (long long)INT_MAX + 1) {
+            return false;
+        }
+        magnitude = magnitude * 10 + (field[i] - '0');
+    }
+    magnitude = negative ? -magnitude : magnitude;
+    if (magnitude < INT_MIN || magnitude > INT_MAX) {
+        return false;
+    }
+    *value = (int)magnitude;
+    return true;
+}
+
+// Format 1 wrote names as they were, so it cannot carry names with spaces;
+// format 2 percent-encodes them
+static bool parse_name(DeltaLine* line, uint64_t format, char name[NAME_LEN]) {
+    const char* field;
+    size_t length;
+    char decoded[NAME_LEN * 3];
+    if (!parse_field(line, &field, &length) || length >= sizeof(decoded)) {
+        return false;
+    }
+    if (format > 1) {
+        length = name_unescape(decoded, field, length);
+        field = decoded;
+    }
+    if (length >= NAME_LEN) {
+        return false;
+    }
+    memcpy(name, field, length);
+    name[length] = '\0';
+    return true;
+}
+
+// Applies one "- id name" or "+ id name type state attribute" line
+static bool apply_line(DeviceManager* manager, DeltaLine* line, uint64_t format) {
+    const char* op;
+    size_t length;
+    char name[NAME_LEN];
+    int ident = 0;
+    if (!parse_field(line, &op, &length) || length != 1 || !parse_int(line, &ident) ||
+        !parse_name(line, format, name)) {
+        return false;
+    }
+    if (*op == '-') {
+        // The device may already be gone, e.g. when it was added and removed in between
+        device_manager_remove_device(manager, ident, name);
+        return line->at == line->end;
+    }
+    int type = 0;
+    int state = 0;
+    int attribute = 0;
+    if (*op != '+' || !parse_int(line, &type) || !parse_int(line, &state) || !parse_int(line, &attribute) ||
+        line->at != line->end || type < 0 || type >= DEVICE_TYPE_COUNT) {
+        return false;
+    }
+    DeviceSpec spec = {name, (DeviceType)type, ident, state != 0, attribute};
+    return manager_upsert(manager, &spec);
+}
+
+bool device_manager_apply_changes(DeviceManager* manager, const char* data, size_t size) {
+    if (!manager || manager->read_only || !data) {
+        return false;
+    }
+    const char* end = data + size;
+    const char* newline = (const char*)memchr(data, '\n', size);
+    DeltaLine header = {data, newline ? newline : end};
+    const char* magic;
+    size_t magic_length;
+    uint64_t format = 0;
+    uint64_t since = 0;
+    uint64_t version = 0;
+    uint64_t full = 0;
+    if (!newline || !parse_field(&header, &magic, &magic_length) || magic_length != 7 ||
+        memcmp(magic, "DMDELTA", 7) != 0 || !parse_version(&header, &format) || format < 1 || format > 2 ||
+        !parse_version(&header, &since) || !parse_version(&header, &version) || !parse_version(&header, &full) ||
+        full > 1 || header.at != header.end) {
+        return false;
+    }
+
+    // Every device a full delta lists is touched after this version; the rest go
+    uint64_t before = device_manager_version(manager);
+    for (const char* at = newline + 1; at < end;) {
+        newline = (const char*)memchr(at, '\n', (size_t)(end - at));
+        DeltaLine line = {at, newline ? newline : end};
+        if (!apply_line(manager, &line, format)) {
+            return false;
+        }
+        at = line.end + 1;
+    }
+    if (full) {
+        manager_prune(manager, before);
+    }
+    return true;
+}
@@ -0,0 +1,297 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "device_manager_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Changes are queued in a bounded multi-producer ring (one sequence number per cell,
+// producers claim cells by compare-exchange on the tail) and drained by whichever
+// thread delivers. Delivery folds the queued changes per device through a small
+// open-addressing table keyed by slot and generation.
+#define EVENT_RING_SIZE (1U << 14)
+#define EVENT_TABLE_SIZE (EVENT_RING_SIZE * 2)
+#define CACHE_LINE 64
+
+typedef struct QueuedEvent {
+    uint32_t slot;
+    uint32_t generation;
+    int ident;
+    int attribute;
+    uint8_t kind;
+    uint8_t type;
+    bool state;
+} QueuedEvent;
+
+typedef struct EventCell {
+    uint64_t sequence; // Position + 1 once the event is written; position + ring size once taken
+    QueuedEvent event;
+} EventCell;
+
+typedef struct Subscription {
+    unsigned int id;
+    DeviceFilter filter;
+    DeviceEventFn callback;
+    void* udata;
+} Subscription;
+
+typedef struct PendingEvent {
+    DeviceEvent event;
+    uint32_t slot;
+    uint32_t generation;
+    uint32_t table_pos;
+} PendingEvent;
+
+struct EventHub {
+    uint64_t tail; // Next position producers claim
+    char tail_padding[CACHE_LINE - sizeof(uint64_t)];
+    uint64_t head; // Next position to drain; owned by the delivering thread
+    uint64_t delivering; // 1 while a thread owns the head and the scratch below
+    int overflowed;
+    EventCell* cells;
+    // Changed only under the structure lock held exclusively
+    Subscription* subscriptions;
+    size_t subscription_count;
+    size_t subscription_capacity;
+    unsigned int next_id;
+    // Delivery scratch, owned by the delivering thread
+    PendingEvent* pending; // EVENT_RING_SIZE
+    uint32_t* table; // EVENT_TABLE_SIZE; pending index + 1, 0 when empty
+    DeviceEvent* matched; // EVENT_RING_SIZE + 1 for the overflow event
+};
+
+static EventHub* events_create(void) {
+    EventHub* hub = (EventHub*)calloc(1, sizeof(EventHub));
+    if (!hub) {
+        return NULL;
+    }
+    hub->cells = (EventCell*)malloc(EVENT_RING_SIZE * sizeof(EventCell));
+    hub->pending = (PendingEvent*)malloc(EVENT_RING_SIZE * sizeof(PendingEvent));
+    hub->table = (uint32_t*)calloc(EVENT_TABLE_SIZE, sizeof(uint32_t));
+    hub->matched = (DeviceEvent*)malloc((EVENT_RING_SIZE + 1) * sizeof(DeviceEvent));
+    if (!hub->cells || !hub->pending || !hub->table || !hub->matched) {
+        events_free(hub);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < EVENT_RING_SIZE; i++) {
+        hub->cells[i].sequence = i;
+    }
+    return hub;
+}
+
+void events_free(EventHub* hub) {
+    if (!hub) {
+        return;
+    }
+    free(hub->cells);
+    free(hub->subscriptions);
+    free(hub->pending);
+    free(hub->table);
+    free(hub->matched);
+    free(hub);
+}
+
+void events_publish(DeviceManager* manager, DeviceEventKind kind, uint32_t slot) {
+    EventHub* hub = manager->events;
+    if (hub->subscription_count == 0) {
+        return;
+    }
+    const DeviceStorage* storage = &manager->storage;
+    const DeviceSlab* slab = SLAB_OF(storage, slot);
+    uint32_t index = SLAB_INDEX(slot);
+    QueuedEvent event = {slot,
+                         slab->generations[index],
+                         slab->ids[index],
+                         slot_attribute(storage, slot),
+                         (uint8_t)kind,
+                         slab->types[index],
+                         slot_state(storage, slot)};
+
+    uint64_t position = atomic_load_word(&hub->tail);
+    for (;;) {
+        EventCell* cell = &hub->cells[position & (EVENT_RING_SIZE - 1)];
+        uint64_t sequence = atomic_load_acquire_word(&cell->sequence);
+        if (sequence == position) {
+            if (atomic_compare_exchange_word(&hub->tail, &position, position + 1)) {
+                cell->event = event;
+                atomic_store_release_word(&cell->sequence, position + 1);
+                return;
+            }
+        } else if (sequence < position) {
+            // The cell still holds an event from one lap ago: the ring is full
+            atomic_store_int(&hub->overflowed, 1);
+            return;
+        } else {
+            position = atomic_load_word(&hub->tail);
+        }
+    }
+}
+
+// Takes the next queued event, if any; only the delivering thread calls this
+static bool events_take(EventHub* hub, QueuedEvent* event) {
+    EventCell* cell = &hub->cells[hub->head & (EVENT_RING_SIZE - 1)];
+    if (atomic_load_acquire_word(&cell->sequence) != hub->head + 1) {
+        return false;
+    }
+    *event = cell->event;
+    atomic_store_release_word(&cell->sequence, hub->head + EVENT_RING_SIZE);
+    hub->head++;
+    return true;
+}
+
+// Folds a queued event into the pending event of its device, last value winning
+static void events_coalesce(EventHub* hub, const QueuedEvent* queued, size_t* count) {
+    uint32_t hash = (queued->slot ^ (queued->generation << 16)) * 0x9E3779B1U;
+    uint32_t pos = hash & (EVENT_TABLE_SIZE - 1);
+    PendingEvent* pending = NULL;
+    while (hub->table[pos] != 0) {
+        PendingEvent* candidate = &hub->pending[hub->table[pos] - 1];
+        if (candidate->slot == queued->slot && candidate->generation == queued->generation) {
+            pending = candidate;
+            break;
+        }
+        pos = (pos + 1) & (EVENT_TABLE_SIZE - 1);
+    }
+    if (!pending) {
+        pending = &hub->pending[*count];
+        memset(pending, 0, sizeof(*pending));
+        pending->event.ident = queued->ident;
+        pending->event.type = (DeviceType)queued->type;
+        pending->slot = queued->slot;
+        pending->generation = queued->generation;
+        pending->table_pos = pos;
+        hub->table[pos] = (uint32_t)++*count;
+    }
+    pending->event.changes |= DEVICE_EVENT_BIT(queued->kind);
+    pending->event.state = queued->state;
+    pending->event.attribute = queued->attribute;
+}
+
+static bool event_matches(const DeviceFilter* filter, const DeviceEvent* event) {
+    if (filter->type_mask && !(filter->type_mask & DEVICE_TYPE_BIT(event->type))) {
+        return false;
+    }
+    if (filter->state != DEVICE_STATE_ANY && (filter->state == DEVICE_STATE_ON) != event->state) {
+        return false;
+    }
+    return !filter->by_attribute ||
+           (event->attribute >= filter->attribute_min && event->attribute <= filter->attribute_max);
+}
+
+unsigned int device_manager_subscribe(DeviceManager* manager, const DeviceFilter* filter, DeviceEventFn callback,
+                                      void* udata) {
+    if (!manager || manager->read_only || !callback) {
+        return 0;
+    }
+    unsigned int id = 0;
+    manager_write_lock(manager);
+    if (!manager->events) {
+        manager->events = events_create();
+    }
+    EventHub* hub = manager->events;
+    if (hub && hub->subscription_count == hub->subscription_capacity) {
+        size_t capacity = hub->subscription_capacity ? hub->subscription_capacity * 2 : 4;
+        Subscription* grown = (Subscription*)realloc(hub->subscriptions, capacity * sizeof(Subscription));
+        if (grown) {
+            hub->subscriptions = grown;
+            hub->subscription_capacity = capacity;
+        }
+    }
+    if (hub && hub->subscription_count < hub->subscription_capacity) {
+        // Nothing is queued while nobody listens; drop what was left from earlier subscribers
+        QueuedEvent stale;
+        while (hub->subscription_count == 0 && events_take(hub, &stale)) {
+        }
+        id = ++hub->next_id ? hub->next_id : ++hub->next_id;
+        Subscription* subscription = &hub->subscriptions[hub->subscription_count++];
+        memset(subscription, 0, sizeof(*subscription));
+        subscription->id = id;
+        if (filter) {
+            subscription->filter = *filter;
+        }
+        subscription->callback = callback;
+        subscription->udata = udata;
+    }
+    manager_write_unlock(manager);
+    return id;
+}
+
+bool device_manager_unsubscribe(DeviceManager* manager, unsigned int subscription) {
+    if (!manager || subscription == 0) {
+        return false;
+    }
+    bool removed = false;
+    manager_write_lock(manager);
+    EventHub* hub = manager->events;
+    for (size_t i = 0; hub && i < hub->subscription_count; i++) {
+        if (hub->subscriptions[i].id == subscription) {
+            memmove(&hub->subscriptions[i], &hub->subscriptions[i + 1],
+                    (hub->subscription_count - i - 1) * sizeof(Subscription));
+            hub->subscription_count--;
+            removed = true;
+            break;
+        }
+    }
+    manager_write_unlock(manager);
+    return removed;
+}
+
+size_t device_manager_deliver_events(DeviceManager* manager) {
+    if (!manager) {
+        return 0;
+    }
+    manager_read_lock(manager);
+    EventHub* hub = manager->events;
+    uint64_t idle = 0;
+    if (!hub || !atomic_compare_exchange_acquire_word(&hub->delivering, &idle, 1)) {
+        manager_read_unlock(manager);
+        return 0;
+    }
+    int overflowed = 1;
+    bool overflow = atomic_compare_exchange_int(&hub->overflowed, &overflowed, 0);
+    size_t count = 0;
+    QueuedEvent queued;
+    while (count < EVENT_RING_SIZE && events_take(hub, &queued)) {
+        events_coalesce(hub, &queued, &count);
+    }
+    // Devices still present report their current values, which may be newer than
+    // the queued ones when setters on different threads raced
+    const DeviceStorage* storage = &manager->storage;
+    for (size_t i = 0; i < count; i++) {
+        PendingEvent* pending = &hub->pending[i];
+        hub->table[pending->table_pos] = 0;
+        uint32_t slot = pending->slot;
+        if (slot < storage->high_water && bit_test(SLAB_OF(storage, slot)->live_bits, SLAB_INDEX(slot)) &&
+            SLOT_FIELD(storage, slot, generations) == pending->generation) {
+            pending->event.state = slot_state(storage, slot);
+            pending->event.attribute = slot_attribute(storage, slot);
+        }
+    }
+    // Callbacks run unlocked on a copy of the subscriber list, so they may use the manager
+    size_t subscribers = count || overflow ? hub->subscription_count : 0;
+    Subscription* subscriptions = subscribers ? (Subscription*)malloc(subscribers * sizeof(Subscription)) : NULL;
+    if (subscriptions) {
+        memcpy(subscriptions, hub->subscriptions, subscribers * sizeof(Subscription));
+    }
+    manager_read_unlock(manager);
+
+    for (size_t s = 0; subscriptions && s < subscribers; s++) {
+        size_t matched = 0;
+        if (overflow) {
+            DeviceEvent lost = {DEVICE_EVENT_BIT(DEVICE_EVENT_OVERFLOW), -1, DEVICE_LIGHT, false, 0};
+            hub->matched[matched++] = lost;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (event_matches(&subscriptions[s].filter, &hub->pending[i].event)) {
+                hub->matched[matched++] = hub->pending[i].event;
+            }
+        }
+        if (matched > 0) {
+            subscriptions[s].callback(hub->matched, matched, subscriptions[s].udata);
+        }
+    }
+    free(subscriptions);
+    atomic_store_release_word(&hub->delivering, 0);
+    return count;
+}
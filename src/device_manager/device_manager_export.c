@@ -0,0 +1,296 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "device_manager_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Records are formatted into one buffer that goes to the sink whenever it cannot
+// take another worst-case record, so sinks see a few large writes per export.
+#define EXPORT_BUFFER_SIZE (256U * 1024U)
+// Longest record: a JSON line whose name is all \u00XX escapes, plus the numbers
+#define EXPORT_RECORD_MAX (NAME_LEN * 6 + 128)
+
+typedef struct ExportBuffer {
+    char* data;
+    size_t used;
+    DeviceSinkFn sink;
+    void* udata;
+    bool failed;
+} ExportBuffer;
+
+static void export_flush(ExportBuffer* buffer) {
+    if (buffer->used > 0 && !buffer->failed) {
+        buffer->failed = !buffer->sink(buffer->data, buffer->used, buffer->udata);
+    }
+    buffer->used = 0;
+}
+
+static char* put_text(char* out, const char* text, size_t length) {
+    memcpy(out, text, length);
+    return out + length;
+}
+
+#define PUT_LITERAL(out, literal) put_text((out), (literal), sizeof(literal) - 1)
+
+// Two digits per step from a 00..99 table; the unsigned negation also covers INT_MIN
+static const char digit_pairs[201] = "00010203040506070809"
+                                     "10111213141516171819"
+                                     "20212223242526272829"
+                                     "30313233343536373839"
+                                     "40414243444546474849"
+                                     "50515253545556575859"
+                                     "60616263646566676869"
+                                     "70717273747576777879"
+                                     "80818283848586878889"
+                                     "90919293949596979899";
+
+static char* put_int(char* out, int value) {
+    unsigned magnitude = value < 0 ? 0U - (unsigned)value : (unsigned)value;
+    if (value < 0) {
+        *out++ = '-';
+    }
+    char digits[10];
+    char* end = digits + sizeof(digits);
+    char* start = end;
+    while (magnitude >= 100) {
+        unsigned pair = (magnitude % 100) * 2;
+        magnitude /= 100;
+        *--start = digit_pairs[pair + 1];
+        *--start = digit_pairs[pair];
+    }
+    if (magnitude >= 10) {
+        *--start = digit_pairs[magnitude * 2 + 1];
+        *--start = digit_pairs[magnitude * 2];
+    } else {
+        *--start = (char)('0' + magnitude);
+    }
+    return put_text(out, start, (size_t)(end - start));
+}
+
+static char* put_version(char* out, uint64_t value) {
+    char digits[20];
+    char* end = digits + sizeof(digits);
+    char* start = end;
+    do {
+        *--start = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    return put_text(out, start, (size_t)(end - start));
+}
+
+// Quoted only when the name holds a separator, quote or line break (RFC 4180)
+static char* put_csv_name(char* out, const char* name, size_t length) {
+    if (strcspn(name, ",\"\r\n") == length) {
+        return put_text(out, name, length);
+    }
+    *out++ = '"';
+    for (const char* c = name; *c; c++) {
+        if (*c == '"') {
+            *out++ = '"';
+        }
+        *out++ = *c;
+    }
+    *out++ = '"';
+    return out;
+}
+
+static char* put_json_name(char* out, const char* name) {
+    static const char hex[] = "0123456789abcdef";
+    *out++ = '"';
+    for (const unsigned char* c = (const unsigned char*)name; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            *out++ = '\\';
+            *out++ = (char)*c;
+        } else if (*c < 0x20) {
+            out = PUT_LITERAL(out, "\\u00");
+            *out++ = hex[*c >> 4];
+            *out++ = hex[*c & 0xF];
+        } else {
+            *out++ = (char)*c;
+        }
+    }
+    *out++ = '"';
+    return out;
+}
+
+// Names come with their stored length, so plain copies skip the strlen
+static char* put_device(char* out, DeviceFormat format, int ident, const char* name, size_t name_length, int type,
+                        bool state, int attribute) {
+    switch (format) {
+    case DEVICE_FORMAT_TEXT:
+        out = PUT_LITERAL(out, "Device ID: ");
+        out = put_int(out, ident);
+        out = PUT_LITERAL(out, ", Name: ");
+        out = put_text(out, name, name_length);
+        out = PUT_LITERAL(out, ", Type: ");
+        out = put_int(out, type);
+        out = state ? PUT_LITERAL(out, ", State: ON, Attribute: ") : PUT_LITERAL(out, ", State: OFF, Attribute: ");
+        out = put_int(out, attribute);
+        break;
+    case DEVICE_FORMAT_CSV:
+        out = put_int(out, ident);
+        *out++ = ',';
+        out = put_csv_name(out, name, name_length);
+        *out++ = ',';
+        out = put_int(out, type);
+        *out++ = ',';
+        *out++ = state ? '1' : '0';
+        *out++ = ',';
+        out = put_int(out, attribute);
+        break;
+    case DEVICE_FORMAT_JSONL:
+        out = PUT_LITERAL(out, "{\"id\":");
+        out = put_int(out, ident);
+        out = PUT_LITERAL(out, ",\"name\":");
+        out = put_json_name(out, name);
+        out = PUT_LITERAL(out, ",\"type\":");
+        out = put_int(out, type);
+        out = state ? PUT_LITERAL(out, ",\"state\":true") : PUT_LITERAL(out, ",\"state\":false");
+        out = PUT_LITERAL(out, ",\"attribute\":");
+        out = put_int(out, attribute);
+        *out++ = '}';
+        break;
+    case DEVICE_FORMAT_SNAPSHOT:
+        out = put_int(out, ident);
+        *out++ = ' ';
+        out = name_escape(out, name, name_length);
+        *out++ = ' ';
+        out = put_int(out, type);
+        *out++ = ' ';
+        *out++ = state ? '1' : '0';
+        *out++ = ' ';
+        out = put_int(out, attribute);
+        break;
+    }
+    *out++ = '\n';
+    return out;
+}
+
+// Devices go out oldest first among those sharing an id or name, so loading the
+// output back finds the same device first for every id and name
+bool manager_write_devices(const DeviceManager* manager, DeviceSinkFn sink, void* udata, DeviceFormat format) {
+    const DeviceStorage* storage = &manager->storage;
+    size_t count = 0;
+    uint32_t* order = storage_age_order(storage, &count);
+    ExportBuffer buffer = {order ? (char*)malloc(EXPORT_BUFFER_SIZE) : NULL, 0, sink, udata, false};
+    if (!buffer.data) {
+        free(order);
+        return false;
+    }
+    if (format == DEVICE_FORMAT_CSV) {
+        static const char header[] = "id,name,type,state,attribute\n";
+        memcpy(buffer.data, header, sizeof(header) - 1);
+        buffer.used = sizeof(header) - 1;
+    }
+    for (size_t i = 0; i < count && !buffer.failed; i++) {
+        uint32_t slot = order[i];
+        if (EXPORT_BUFFER_SIZE - buffer.used < EXPORT_RECORD_MAX) {
+            export_flush(&buffer);
+        }
+        char* end = put_device(buffer.data + buffer.used, format, SLOT_FIELD(storage, slot, ids),
+                               slot_name(storage, slot), slot_name_length(storage, slot),
+                               SLOT_FIELD(storage, slot, types), slot_state(storage, slot),
+                               slot_attribute(storage, slot));
+        buffer.used = (size_t)(end - buffer.data);
+    }
+    export_flush(&buffer);
+    free(buffer.data);
+    free(order);
+    return !buffer.failed;
+}
+
+bool device_manager_write_devices(DeviceManager* manager, DeviceSinkFn sink, void* udata, DeviceFormat format) {
+    if (!manager || !sink || (unsigned)format > DEVICE_FORMAT_SNAPSHOT) {
+        return false;
+    }
+    manager_read_lock(manager);
+    bool written = manager_write_devices(manager, sink, udata, format);
+    manager_read_unlock(manager);
+    return written;
+}
+
+// A delta is a header line, the removals ("- id name") and then the devices added or
+// changed since `since` ("+ " and a snapshot record). Only bitset words whose newest
+// version is past `since` are scanned, so the cost follows the churn, not the fleet.
+static bool write_changes(const DeviceManager* manager, uint64_t since, uint64_t version, bool full,
+                          ExportBuffer* buffer) {
+    char* out = PUT_LITERAL(buffer->data, "DMDELTA 2 ");
+    out = put_version(out, since);
+    *out++ = ' ';
+    out = put_version(out, version);
+    out = full ? PUT_LITERAL(out, " 1\n") : PUT_LITERAL(out, " 0\n");
+    buffer->used = (size_t)(out - buffer->data);
+
+    const DeviceTombstones* tombstones = &manager->tombstones;
+    for (size_t i = 0; !full && i < tombstones->count; i++) {
+        const DeviceTombstone* tombstone = &tombstones->entries[(tombstones->head + i) % tombstones->capacity];
+        if (tombstone->version <= since) {
+            continue;
+        }
+        if (EXPORT_BUFFER_SIZE - buffer->used < EXPORT_RECORD_MAX) {
+            export_flush(buffer);
+        }
+        out = PUT_LITERAL(buffer->data + buffer->used, "- ");
+        out = put_int(out, tombstone->ident);
+        *out++ = ' ';
+        out = name_escape(out, tombstone->name, strlen(tombstone->name));
+        *out++ = '\n';
+        buffer->used = (size_t)(out - buffer->data);
+    }
+
+    const DeviceStorage* storage = &manager->storage;
+    uint32_t words = (storage->high_water + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    for (uint32_t word = 0; word < words && !buffer->failed; word++) {
+        const DeviceSlab* slab = storage->slabs[word / SLAB_WORDS];
+        if (!full && slab->word_versions[word % SLAB_WORDS] <= since) {
+            continue;
+        }
+        for (uint64_t bits = slab->live_bits[word % SLAB_WORDS]; bits; bits &= bits - 1) {
+            uint32_t slot = word * BITS_PER_WORD + lowest_bit(bits);
+            uint32_t index = SLAB_INDEX(slot);
+            if (!full && slab->versions[index] <= since) {
+                continue;
+            }
+            if (EXPORT_BUFFER_SIZE - buffer->used < EXPORT_RECORD_MAX) {
+                export_flush(buffer);
+            }
+            out = PUT_LITERAL(buffer->data + buffer->used, "+ ");
+            out = put_device(out, DEVICE_FORMAT_SNAPSHOT, slab->ids[index], slot_name(storage, slot),
+                             slot_name_length(storage, slot), slab->types[index], slot_state(storage, slot),
+                             slot_attribute(storage, slot));
+            buffer->used = (size_t)(out - buffer->data);
+        }
+    }
+    export_flush(buffer);
+    return !buffer->failed;
+}
+
+bool device_manager_export_changes_since(DeviceManager* manager, uint64_t since, DeviceSinkFn sink, void* udata,
+                                         uint64_t* version) {
+    if (!manager || !sink) {
+        return false;
+    }
+    ExportBuffer buffer = {(char*)malloc(EXPORT_BUFFER_SIZE), 0, sink, udata, false};
+    if (!buffer.data) {
+        return false;
+    }
+    // Held exclusively so no setter is between taking its version and storing its value
+    manager_write_lock(manager);
+    uint64_t current = manager->version;
+    // Removals older than the horizon were forgotten; a since from the future belongs
+    // to another manager. Either way only the whole fleet is a correct answer.
+    bool full = since == 0 || since < manager->tombstones.horizon || since > current;
+    bool written = write_changes(manager, since, current, full, &buffer);
+    manager_write_unlock(manager);
+    free(buffer.data);
+    if (written && version) {
+        *version = current;
+    }
+    return written;
+}
+
+bool device_manager_file_sink(const char* data, size_t size, void* udata) {
+    return fwrite(data, 1, size, (FILE*)udata) == size;
+}
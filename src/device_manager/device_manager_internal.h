@@ -0,0 +1,496 @@
+#ifndef DEVICE_MANAGER_INTERNAL_H
+#define DEVICE_MANAGER_INTERNAL_H
+
+// Layout shared by the device manager translation units; not part of the public API
+#include "device_manager.h"
+#include <stdint.h>
+#include <stdio.h>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
+#define NAME_LEN DEVICE_NAME_MAX
+#define DEVICE_TYPE_COUNT 3
+
+// Device storage is allocated a slab at a time; each slab holds SLAB_SLOTS devices
+#define SLAB_SHIFT 10
+#define SLAB_SLOTS (1U << SLAB_SHIFT)
+#define BITS_PER_WORD 64
+#define SLAB_WORDS (SLAB_SLOTS / BITS_PER_WORD)
+#define NO_SLOT UINT32_MAX
+
+// Names live in the manager's name arena, in 64 KiB chunks addressed by a 32-bit
+// reference (chunk << NAME_CHUNK_SHIFT | offset). Each name takes a block of its
+// length byte, its bytes and a terminator, rounded up to NAME_ALIGN.
+#define NAME_CHUNK_SHIFT 16
+#define NAME_CHUNK_SIZE (1U << NAME_CHUNK_SHIFT)
+#define NAME_ALIGN 4U
+#define NAME_BLOCK_SIZE(length) (((uint32_t)(length) + 2U + NAME_ALIGN - 1U) & ~(NAME_ALIGN - 1U))
+#define NAME_CLASSES (NAME_BLOCK_SIZE(NAME_LEN - 1) / NAME_ALIGN + 1)
+#define NO_NAME UINT32_MAX
+
+// Opaque structures
+// Devices live column-wise inside slabs: a slot number selects the slab and the
+// position in every column below. The hot columns (ids, states, attributes,
+// types) can be scanned without pulling names into cache.
+typedef struct DeviceSlab {
+    int ids[SLAB_SLOTS];
+    int attributes[SLAB_SLOTS]; // Generic attribute (e.g., brightness, temperature)
+    uint32_t id_next[SLAB_SLOTS]; // Older slot sharing the same id; next free slot when dead
+    uint32_t name_next[SLAB_SLOTS]; // Older slot sharing the same name
+    uint32_t generations[SLAB_SLOTS]; // Bumped each time the slot takes a new device; 0 = never used
+    uint64_t versions[SLAB_SLOTS]; // Manager version of the slot's latest add or change
+    uint64_t word_versions[SLAB_WORDS]; // Newest version in each bitset word, to skip unchanged words
+    uint64_t state_bits[SLAB_WORDS]; // ON/OFF, one bit per slot
+    uint64_t live_bits[SLAB_WORDS]; // Slots currently holding a device
+    uint64_t type_bits[DEVICE_TYPE_COUNT][SLAB_WORDS]; // Live slots of each type
+    uint8_t types[SLAB_SLOTS];
+    uint32_t name_refs[SLAB_SLOTS]; // Name arena block; devices sharing a name share the block
+    // Holders besides the first (snapshots, see device_manager_snapshot); a shared
+    // slab is never written again. Only accessed atomically, and never copied.
+    int shares;
+} DeviceSlab;
+
+typedef struct NameChunk {
+    unsigned char bytes[NAME_CHUNK_SIZE];
+    int shares; // As DeviceSlab::shares: a shared chunk is copied before any write
+} NameChunk;
+
+// Append-only chunks plus one free list per block size (NAME_ALIGN units); a free
+// block holds the reference of the next one in its first bytes
+typedef struct DeviceNames {
+    NameChunk** chunks;
+    uint32_t chunk_count;
+    uint32_t chunk_capacity;
+    uint32_t used; // Bytes taken in the last chunk
+    uint32_t free_lists[NAME_CLASSES];
+} DeviceNames;
+
+typedef struct DeviceStorage {
+    DeviceSlab** slabs;
+    uint32_t slab_count;
+    uint32_t slab_capacity; // Entries in the slabs directory
+    uint32_t high_water; // Slots at or above this have never been used
+    uint32_t free_head;
+    unsigned char* arena; // Caller-owned memory slabs are carved from, or NULL for the heap
+    size_t arena_size;
+    size_t arena_used;
+    void* mapping; // Binary snapshot the loaded slabs and name chunks live in, or NULL
+    size_t mapping_size;
+    bool atomic_values; // State words and attributes are only accessed atomically
+    DeviceNames names; // Always on the heap (or in the mapping), even with an arena
+} DeviceStorage;
+
+// Slab holding a slot, and the slot's position inside it
+#define SLAB_OF(storage, slot) ((storage)->slabs[(slot) >> SLAB_SHIFT])
+#define SLAB_INDEX(slot) ((slot) & (SLAB_SLOTS - 1))
+#define SLOT_FIELD(storage, slot, field) (SLAB_OF(storage, slot)->field[SLAB_INDEX(slot)])
+
+// Length byte of a name block; the terminated name follows it
+static inline const unsigned char* name_block(const DeviceStorage* storage, uint32_t ref) {
+    return storage->names.chunks[ref >> NAME_CHUNK_SHIFT]->bytes + (ref & (NAME_CHUNK_SIZE - 1));
+}
+
+static inline const char* slot_name(const DeviceStorage* storage, uint32_t slot) {
+    return (const char*)name_block(storage, SLOT_FIELD(storage, slot, name_refs)) + 1;
+}
+
+static inline size_t slot_name_length(const DeviceStorage* storage, uint32_t slot) {
+    return *name_block(storage, SLOT_FIELD(storage, slot, name_refs));
+}
+
+// Open-addressing slot of the id index; points at the newest device with that id.
+// The id itself is read from the slab's ids column.
+typedef struct IdSlot {
+    uint32_t slot; // NO_SLOT when unused
+} IdSlot;
+
+// Open-addressing slot of the name index; points at the newest device with that name.
+// Like the id index it holds no key; a byte of the name hash is kept beside it (see name_tags).
+typedef struct NameSlot {
+    uint32_t slot; // NO_SLOT when unused
+} NameSlot;
+
+// Attribute kernels work on the attributes column in bitset-word (64 slot) units
+typedef struct AttributeTotals {
+    int min;
+    int max;
+    int64_t sum;
+} AttributeTotals;
+
+typedef struct AttributeKernels {
+    // Bit i is set when min <= attributes[i] <= max
+    uint64_t (*range_mask)(const int* attributes, int min, int max);
+    // Folds the attributes selected by masks[0..words) into totals
+    void (*accumulate)(const int* attributes, const uint64_t* masks, uint32_t words, AttributeTotals* totals);
+} AttributeKernels;
+
+// Best kernel set for this CPU, honouring the DEVICE_MANAGER_SIMD override
+const AttributeKernels* attribute_kernels_select(void);
+
+// Worker threads for fleet-wide operations. A job is split into chunks numbered
+// [0, chunks); fn runs once per chunk on some worker (0 is the calling thread), with
+// idle workers stealing chunks from busy ones. Jobs on one pool run one at a time.
+typedef struct WorkerPool WorkerPool;
+typedef void (*PoolChunkFn)(void* context, uint32_t chunk, size_t worker);
+
+WorkerPool* pool_create(size_t workers);
+void pool_destroy(WorkerPool* pool);
+// Workers including the calling thread; 1 for a NULL pool
+size_t pool_workers(const WorkerPool* pool);
+// One worker per online CPU
+size_t pool_default_workers(void);
+// Runs fn over every chunk and returns once all are done; NULL runs them on the caller
+bool pool_parallel_for(WorkerPool* pool, uint32_t chunks, PoolChunkFn fn, void* context);
+
+typedef struct DeviceJournal DeviceJournal;
+typedef struct DeviceLocks DeviceLocks;
+typedef struct EventHub EventHub;
+typedef struct DeviceSaver DeviceSaver;
+
+// A removed device, remembered so deltas can carry the removal
+typedef struct DeviceTombstone {
+    uint64_t version;
+    int ident;
+    char* name;
+} DeviceTombstone;
+
+// Ring of the most recent removals, oldest first. Once full the oldest are dropped
+// and horizon moves up to their version: deltas from before it must be full ones.
+typedef struct DeviceTombstones {
+    DeviceTombstone* entries;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    uint64_t horizon;
+} DeviceTombstones;
+
+struct DeviceManager {
+    DeviceStorage storage;
+    DeviceJournal* journal; // NULL unless journaling is enabled
+    DeviceLocks* locks; // NULL unless created by device_manager_create_concurrent
+    const AttributeKernels* kernels;
+    WorkerPool* pool; // NULL runs fleet-wide operations on the calling thread
+    EventHub* events; // NULL until the first subscription
+    DeviceSaver* saver; // NULL until the first device_manager_save_async
+    uint64_t version; // Bumped by every add, remove and change; see device_manager_version
+    bool read_only; // A snapshot; see device_manager_snapshot
+    uint64_t indexed; // Snapshots build their indexes on the first keyed lookup
+    DeviceTombstones tombstones; // Recent removals, for delta export
+    int count;
+    int type_counts[DEVICE_TYPE_COUNT];
+    IdSlot* id_slots;
+    size_t id_capacity; // Power of two
+    size_t id_used;
+    NameSlot* name_slots;
+    size_t name_capacity; // Power of two
+    size_t name_used;
+};
+
+// Bitset helpers
+static inline bool bit_test(const uint64_t* bits, uint32_t slot) {
+    return (bits[slot / BITS_PER_WORD] >> (slot % BITS_PER_WORD)) & 1U;
+}
+
+static inline void bit_assign(uint64_t* bits, uint32_t slot, bool value) {
+    uint64_t mask = (uint64_t)1 << (slot % BITS_PER_WORD);
+    if (value) {
+        bits[slot / BITS_PER_WORD] |= mask;
+    } else {
+        bits[slot / BITS_PER_WORD] &= ~mask;
+    }
+}
+
+static inline uint32_t popcount_word(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (uint32_t)__builtin_popcountll(word);
+#else
+    uint32_t count = 0;
+    for (; word; word &= word - 1) {
+        count++;
+    }
+    return count;
+#endif
+}
+
+static inline uint32_t lowest_bit(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+    return (uint32_t)__builtin_ctzll(word);
+#else
+    uint32_t bit = 0;
+    while (!(word & 1U)) {
+        word >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+// Relaxed atomics on plain columns: enough for untorn values, no ordering implied
+#if defined(__GNUC__) || defined(__clang__)
+static inline int atomic_load_int(const int* value) {
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+static inline void atomic_store_int(int* value, int desired) {
+    __atomic_store_n(value, desired, __ATOMIC_RELAXED);
+}
+static inline int atomic_fetch_add_int(int* value, int delta) {
+    return __atomic_fetch_add(value, delta, __ATOMIC_RELAXED);
+}
+static inline bool atomic_compare_exchange_int(int* value, int* expected, int desired) {
+    return __atomic_compare_exchange_n(value, expected, desired, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+// Reference counts: whoever drops the last reference sees every earlier holder's accesses,
+// as does whoever loads the count with acquire and finds the others gone
+static inline int atomic_fetch_add_acq_rel_int(int* value, int delta) {
+    return __atomic_fetch_add(value, delta, __ATOMIC_ACQ_REL);
+}
+static inline int atomic_load_acquire_int(const int* value) {
+    return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+static inline uint64_t atomic_load_word(const uint64_t* word) {
+    return __atomic_load_n(word, __ATOMIC_RELAXED);
+}
+static inline void atomic_or_word(uint64_t* word, uint64_t mask) {
+    __atomic_fetch_or(word, mask, __ATOMIC_RELAXED);
+}
+static inline void atomic_and_word(uint64_t* word, uint64_t mask) {
+    __atomic_fetch_and(word, mask, __ATOMIC_RELAXED);
+}
+static inline bool atomic_compare_exchange_word(uint64_t* word, uint64_t* expected, uint64_t desired) {
+    return __atomic_compare_exchange_n(word, expected, desired, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+static inline uint64_t atomic_fetch_add_word(uint64_t* word, uint64_t delta) {
+    return __atomic_fetch_add(word, delta, __ATOMIC_RELAXED);
+}
+// Publication of data written before the store to threads that load the word
+static inline uint64_t atomic_load_acquire_word(const uint64_t* word) {
+    return __atomic_load_n(word, __ATOMIC_ACQUIRE);
+}
+static inline void atomic_store_release_word(uint64_t* word, uint64_t value) {
+    __atomic_store_n(word, value, __ATOMIC_RELEASE);
+}
+static inline bool atomic_compare_exchange_acquire_word(uint64_t* word, uint64_t* expected, uint64_t desired) {
+    return __atomic_compare_exchange_n(word, expected, desired, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+#elif defined(_MSC_VER)
+// int and long are both 32 bits on Windows
+static inline int atomic_load_int(const int* value) {
+    return *(const volatile int*)value;
+}
+static inline void atomic_store_int(int* value, int desired) {
+    *(volatile int*)value = desired;
+}
+static inline int atomic_fetch_add_int(int* value, int delta) {
+    return (int)_InterlockedExchangeAdd((volatile long*)value, delta);
+}
+static inline int atomic_fetch_add_acq_rel_int(int* value, int delta) {
+    return atomic_fetch_add_int(value, delta);
+}
+static inline int atomic_load_acquire_int(const int* value) {
+    return (int)_InterlockedCompareExchange((volatile long*)value, 0, 0);
+}
+static inline bool atomic_compare_exchange_int(int* value, int* expected, int desired) {
+    int previous = (int)_InterlockedCompareExchange((volatile long*)value, desired, *expected);
+    bool exchanged = previous == *expected;
+    *expected = previous;
+    return exchanged;
+}
+static inline uint64_t atomic_load_word(const uint64_t* word) {
+    return *(const volatile uint64_t*)word;
+}
+static inline void atomic_or_word(uint64_t* word, uint64_t mask) {
+    _InterlockedOr64((volatile __int64*)word, (__int64)mask);
+}
+static inline void atomic_and_word(uint64_t* word, uint64_t mask) {
+    _InterlockedAnd64((volatile __int64*)word, (__int64)mask);
+}
+static inline bool atomic_compare_exchange_word(uint64_t* word, uint64_t* expected, uint64_t desired) {
+    uint64_t previous =
+        (uint64_t)_InterlockedCompareExchange64((volatile __int64*)word, (__int64)desired, (__int64)*expected);
+    bool exchanged = previous == *expected;
+    *expected = previous;
+    return exchanged;
+}
+static inline uint64_t atomic_fetch_add_word(uint64_t* word, uint64_t delta) {
+    return (uint64_t)_InterlockedExchangeAdd64((volatile __int64*)word, (__int64)delta);
+}
+// Interlocked operations are full barriers on every Windows target
+static inline uint64_t atomic_load_acquire_word(const uint64_t* word) {
+    return (uint64_t)_InterlockedCompareExchange64((volatile __int64*)word, 0, 0);
+}
+static inline void atomic_store_release_word(uint64_t* word, uint64_t value) {
+    _InterlockedExchange64((volatile __int64*)word, (__int64)value);
+}
+static inline bool atomic_compare_exchange_acquire_word(uint64_t* word, uint64_t* expected, uint64_t desired) {
+    return atomic_compare_exchange_word(word, expected, desired);
+}
+#else
+#error "device manager needs GCC/Clang __atomic builtins or MSVC interlocked intrinsics"
+#endif
+
+// Value accessors for any path that can run alongside setters on a concurrent manager
+static inline bool slot_state(const DeviceStorage* storage, uint32_t slot) {
+    const uint64_t* word = &SLAB_OF(storage, slot)->state_bits[SLAB_INDEX(slot) / BITS_PER_WORD];
+    uint64_t bits = storage->atomic_values ? atomic_load_word(word) : *word;
+    return (bits >> (slot % BITS_PER_WORD)) & 1U;
+}
+
+static inline void slot_set_state(DeviceStorage* storage, uint32_t slot, bool state) {
+    DeviceSlab* slab = SLAB_OF(storage, slot);
+    if (!storage->atomic_values) {
+        bit_assign(slab->state_bits, SLAB_INDEX(slot), state);
+        return;
+    }
+    // Neighbouring devices share the word, so the bit is flipped with an RMW
+    uint64_t* word = &slab->state_bits[SLAB_INDEX(slot) / BITS_PER_WORD];
+    uint64_t mask = (uint64_t)1 << (slot % BITS_PER_WORD);
+    if (state) {
+        atomic_or_word(word, mask);
+    } else {
+        atomic_and_word(word, ~mask);
+    }
+}
+
+static inline int slot_attribute(const DeviceStorage* storage, uint32_t slot) {
+    const int* attribute = &SLOT_FIELD(storage, slot, attributes);
+    return storage->atomic_values ? atomic_load_int(attribute) : *attribute;
+}
+
+static inline void slot_set_attribute(DeviceStorage* storage, uint32_t slot, int value) {
+    int* attribute = &SLOT_FIELD(storage, slot, attributes);
+    if (storage->atomic_values) {
+        atomic_store_int(attribute, value);
+    } else {
+        *attribute = value;
+    }
+}
+
+// Raises *word to at least value
+static inline void atomic_max_word(uint64_t* word, uint64_t value) {
+    uint64_t current = atomic_load_word(word);
+    while (current < value && !atomic_compare_exchange_word(word, &current, value)) {
+    }
+}
+
+// Records that a slot changed in `version`. Setters racing on one slot or word may
+// finish out of order, so both only ever move forward.
+static inline void slot_touch(DeviceStorage* storage, uint32_t slot, uint64_t version) {
+    DeviceSlab* slab = SLAB_OF(storage, slot);
+    uint32_t index = SLAB_INDEX(slot);
+    if (storage->atomic_values) {
+        atomic_max_word(&slab->versions[index], version);
+        atomic_max_word(&slab->word_versions[index / BITS_PER_WORD], version);
+        return;
+    }
+    slab->versions[index] = version;
+    if (slab->word_versions[index / BITS_PER_WORD] < version) {
+        slab->word_versions[index / BITS_PER_WORD] = version;
+    }
+}
+
+// Streams every device to sink; callers hold the structure lock
+bool manager_write_devices(const DeviceManager* manager, DeviceSinkFn sink, void* udata, DeviceFormat format);
+// Live slots ordered so each device follows the older devices sharing its id or name,
+// otherwise in slot order; adding them in this order rebuilds the same id and name
+// chains. Slot order alone is not age order, as freed slots are reused. NULL when out
+// of memory or when the chain links are damaged; the caller frees the result.
+uint32_t* storage_age_order(const DeviceStorage* storage, size_t* count);
+// Rebuilds the counts and indexes of storage adopted from a binary snapshot from the
+// chain links, type bitsets and free list stored in its slabs, which are checked but
+// never written; false when any of them is damaged or out of memory
+bool manager_reindex(DeviceManager* manager);
+// Unmaps the binary snapshot backing the first slabs, if any
+void storage_release_mapping(DeviceStorage* storage);
+// Whether a file's first bytes open a binary or a compressed snapshot
+#define SNAPSHOT_SNIFF_LEN 8
+bool snapshot_is_binary(const unsigned char* head, size_t size);
+bool snapshot_is_compressed(const unsigned char* head, size_t size);
+// Gives a manager no other thread has seen yet the locks of device_manager_create_concurrent
+bool manager_make_concurrent(DeviceManager* manager);
+
+// Name arena. Callers hold the structure lock exclusively, except for names_share
+// (shared is enough). names_store returns NO_NAME when out of memory; names_free
+// takes the last reference to a block.
+void names_init(DeviceNames* names);
+uint32_t names_store(DeviceStorage* storage, const char* name, size_t length);
+void names_free(DeviceStorage* storage, uint32_t ref);
+// Gives view its own references to every chunk, as device_manager_snapshot does for slabs
+bool names_share(const DeviceStorage* storage, DeviceStorage* view);
+void names_release(DeviceStorage* storage);
+size_t names_memory(const DeviceStorage* storage);
+// Names in the space-separated text records (snapshots and deltas) percent-encode
+// space, control bytes, '%' and DEL as %XX. name_escape writes at most three bytes
+// per name byte and returns the end. name_unescape decodes into out, which may be
+// field itself, and returns the decoded length; '%' without two hex digits, and
+// %00, stay as they are.
+char* name_escape(char* out, const char* name, size_t length);
+size_t name_unescape(char* out, const char* field, size_t length);
+
+// Locking of concurrent managers (no-ops otherwise). The journal lock nests inside
+// the structure lock; neither is re-acquired by its holder.
+void manager_read_lock(const DeviceManager* manager);
+void manager_read_unlock(const DeviceManager* manager);
+void manager_write_lock(const DeviceManager* manager);
+void manager_write_unlock(const DeviceManager* manager);
+void manager_journal_lock(const DeviceManager* manager);
+void manager_journal_unlock(const DeviceManager* manager);
+
+// Next manager version. Fleet-wide operations and batches take one version for all
+// their changes. Safe from any thread holding the structure lock.
+static inline uint64_t manager_next_version(DeviceManager* manager) {
+    return atomic_fetch_add_word(&manager->version, 1) + 1;
+}
+// Remembers a removed device for delta export; callers hold the structure lock exclusively
+void delta_record_removal(DeviceManager* manager, int ident, const char* name, uint64_t version);
+void delta_free(DeviceManager* manager);
+// Delta replay: makes the manager hold spec's device with spec's values, adding it,
+// updating it in place or replacing it (type changed) as needed; touches it either way
+bool manager_upsert(DeviceManager* manager, const DeviceSpec* spec);
+// Sets a value on the newest device with update's id or, given a name, with that id
+// and name; journal replay uses the name to reach a shadowed device
+bool manager_update(DeviceManager* manager, const DeviceUpdate* update, const char* name);
+// Removes every device last touched at or before version
+void manager_prune(DeviceManager* manager, uint64_t version);
+
+// Change notification. events_publish queues one change to a device whose slot still
+// holds it; it is lock-free and safe from any thread holding the structure lock.
+// Callers check manager->events first so managers without subscribers pay nothing.
+void events_publish(DeviceManager* manager, DeviceEventKind kind, uint32_t slot);
+void events_free(EventHub* events);
+
+// Write-ahead log records
+typedef enum {
+    JOURNAL_ADD = 1,
+    JOURNAL_REMOVE,
+    JOURNAL_SET_STATE,
+    JOURNAL_SET_ATTRIBUTE
+} JournalOp;
+
+// Appends one record for a change that has already been applied to the manager.
+// Callers hold the journal lock, or the structure lock exclusively. Returns true
+// once compaction is due; the caller then drops its locks and calls journal_compact_due.
+bool journal_append(DeviceManager* manager, JournalOp op, int ident, const char* name, DeviceType type, bool state,
+                    int value);
+// Compacts the log if it is still due; takes the structure lock itself
+void journal_compact_due(DeviceManager* manager);
+// Replays "<filename>.wal" onto a manager freshly loaded from the snapshot it extends
+bool journal_replay(DeviceManager* manager, const char* filename);
+
+// Writes out any saves still queued, then stops the background thread
+void saver_free(DeviceSaver* saver);
+
+// File helpers shared by everything that writes files beside their target and then
+// renames them into place. A rename leaves readers of the old file (such as a binary
+// snapshot mapping it) intact.
+bool file_sync(FILE* file);
+bool file_replace(const char* from, const char* to);
+// Returns a malloc'ed copy of path with suffix appended
+char* path_with_suffix(const char* path, const char* suffix);
+
+// Byte-at-a-time FNV-1a, which hashes the same bytes the same on every host
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+uint64_t fnv1a64(uint64_t hash, const void* data, size_t size);
+
+#endif // DEVICE_MANAGER_INTERNAL_H
@@ -0,0 +1,339 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "device_manager_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// The log starts with a header naming the snapshot it extends (by checksum), so a
+// crash between writing a new snapshot and resetting the log can never replay
+// stale records on top of the newer snapshot. Each record is a fixed 16-byte
+// header plus the device name for add/remove (and for changes to a shadowed
+// device), checksummed to detect torn tails.
+#define JOURNAL_MAGIC "DMWAL\r\n"
+#define JOURNAL_MAGIC_LEN 8
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_SIZE 24
+#define JOURNAL_RECORD_SIZE 16
+#define JOURNAL_SUFFIX ".wal"
+#define JOURNAL_TEMP_SUFFIX ".tmp"
+
+struct DeviceJournal {
+    FILE* file;
+    char* snapshot_path;
+    char* journal_path;
+    size_t sync_every;
+    size_t compact_every;
+    size_t unsynced; // Records written since the last fsync
+    size_t records; // Records since the last compaction
+    bool failed; // A write or sync failed since the last successful compaction
+};
+
+uint64_t fnv1a64(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint32_t record_checksum(const unsigned char* record, const char* name, size_t name_len) {
+    uint64_t hash = fnv1a64(FNV_OFFSET_BASIS, record, JOURNAL_RECORD_SIZE - sizeof(uint32_t));
+    hash = fnv1a64(hash, name, name_len);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// Checksum of a whole file; identifies the snapshot a log was started against
+static bool file_checksum(const char* path, uint64_t* checksum) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return false;
+    }
+    unsigned char buffer[BUFSIZ];
+    uint64_t hash = FNV_OFFSET_BASIS;
+    size_t read = 0;
+    while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        hash = fnv1a64(hash, buffer, read);
+    }
+    bool ok = !ferror(file);
+    fclose(file);
+    *checksum = hash;
+    return ok;
+}
+
+bool file_sync(FILE* file) {
+    if (fflush(file) != 0) {
+        return false;
+    }
+#if defined(_WIN32)
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+bool file_replace(const char* from, const char* to) {
+#if defined(_WIN32)
+    remove(to);
+#endif
+    return rename(from, to) == 0;
+}
+
+char* path_with_suffix(const char* path, const char* suffix) {
+    size_t length = strlen(path);
+    size_t suffix_length = strlen(suffix);
+    char* joined = (char*)malloc(length + suffix_length + 1);
+    if (joined) {
+        memcpy(joined, path, length);
+        memcpy(joined + length, suffix, suffix_length + 1);
+    }
+    return joined;
+}
+
+// Writes an empty log bound to the snapshot checksum, synced to disk
+static FILE* journal_create(const char* path, uint64_t base) {
+    FILE* file = fopen(path, "wb");
+    if (!file) {
+        return NULL;
+    }
+    unsigned char header[JOURNAL_HEADER_SIZE] = {0};
+    uint32_t version = JOURNAL_VERSION;
+    memcpy(header, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN);
+    memcpy(header + JOURNAL_MAGIC_LEN, &version, sizeof(version));
+    memcpy(header + JOURNAL_HEADER_SIZE - sizeof(base), &base, sizeof(base));
+    if (fwrite(header, sizeof(header), 1, file) != 1 || !file_sync(file)) {
+        fclose(file);
+        remove(path);
+        return NULL;
+    }
+    return file;
+}
+
+// Group commit: one fsync covers every record written since the previous one.
+// Callers hold the journal lock.
+static bool journal_flush(DeviceJournal* journal) {
+    if (journal->unsynced > 0) {
+        journal->failed = !file_sync(journal->file) || journal->failed;
+        journal->unsynced = 0;
+    }
+    return !journal->failed;
+}
+
+// Folds the current state into a new snapshot and starts an empty log for it.
+// Both files are written beside their targets and renamed into place, snapshot
+// first; until the log is replaced its header still names the old snapshot.
+// Callers hold the structure lock exclusively.
+static bool journal_rotate(DeviceManager* manager) {
+    DeviceJournal* journal = manager->journal;
+    char* snapshot_temp = path_with_suffix(journal->snapshot_path, JOURNAL_TEMP_SUFFIX);
+    char* journal_temp = path_with_suffix(journal->journal_path, JOURNAL_TEMP_SUFFIX);
+    bool ok = snapshot_temp && journal_temp;
+
+    FILE* snapshot = ok ? fopen(snapshot_temp, "w") : NULL;
+    ok = snapshot && manager_write_devices(manager, device_manager_file_sink, snapshot, DEVICE_FORMAT_SNAPSHOT) && file_sync(snapshot);
+    if (snapshot) {
+        ok = fclose(snapshot) == 0 && ok;
+    }
+    uint64_t base = 0;
+    ok = ok && file_checksum(snapshot_temp, &base);
+    FILE* log = ok ? journal_create(journal_temp, base) : NULL;
+    ok = log && file_replace(snapshot_temp, journal->snapshot_path) && file_replace(journal_temp, journal->journal_path);
+
+    if (ok) {
+        if (journal->file) {
+            fclose(journal->file);
+        }
+        journal->file = log;
+        journal->unsynced = 0;
+        journal->records = 0;
+        journal->failed = false;
+    } else if (log) {
+        fclose(log);
+    }
+    if (snapshot_temp) {
+        remove(snapshot_temp);
+    }
+    if (journal_temp) {
+        remove(journal_temp);
+    }
+    free(snapshot_temp);
+    free(journal_temp);
+    return ok;
+}
+
+bool device_manager_enable_journal(DeviceManager* manager, const char* filename, size_t sync_every,
+                                   size_t compact_every) {
+    if (!manager || manager->read_only || !filename || filename[0] == '\0') {
+        return false;
+    }
+    manager_write_lock(manager);
+    DeviceJournal* journal = manager->journal ? NULL : (DeviceJournal*)calloc(1, sizeof(DeviceJournal));
+    if (!journal) {
+        manager_write_unlock(manager);
+        return false;
+    }
+    journal->snapshot_path = path_with_suffix(filename, "");
+    journal->journal_path = path_with_suffix(filename, JOURNAL_SUFFIX);
+    journal->sync_every = sync_every ? sync_every : 1;
+    journal->compact_every = compact_every;
+    manager->journal = journal;
+
+    // The log always extends a snapshot of the state it was enabled on
+    bool enabled = journal->snapshot_path && journal->journal_path && journal_rotate(manager);
+    if (!enabled) {
+        manager->journal = NULL;
+        free(journal->snapshot_path);
+        free(journal->journal_path);
+        free(journal);
+    }
+    manager_write_unlock(manager);
+    return enabled;
+}
+
+bool device_manager_journal_sync(DeviceManager* manager) {
+    if (!manager) {
+        return false;
+    }
+    // Shared is enough to keep the journal from being disabled underneath us
+    manager_read_lock(manager);
+    bool synced = false;
+    if (manager->journal) {
+        manager_journal_lock(manager);
+        synced = journal_flush(manager->journal);
+        manager_journal_unlock(manager);
+    }
+    manager_read_unlock(manager);
+    return synced;
+}
+
+bool device_manager_journal_compact(DeviceManager* manager) {
+    if (!manager) {
+        return false;
+    }
+    manager_write_lock(manager);
+    bool compacted = manager->journal && journal_rotate(manager);
+    manager_write_unlock(manager);
+    return compacted;
+}
+
+void journal_compact_due(DeviceManager* manager) {
+    manager_write_lock(manager);
+    // Another writer may have compacted, or disabled the journal, in between
+    DeviceJournal* journal = manager->journal;
+    if (journal && journal->compact_every && journal->records >= journal->compact_every) {
+        journal_rotate(manager);
+    }
+    manager_write_unlock(manager);
+}
+
+void device_manager_disable_journal(DeviceManager* manager) {
+    if (!manager) {
+        return;
+    }
+    manager_write_lock(manager);
+    DeviceJournal* journal = manager->journal;
+    if (journal) {
+        journal_flush(journal);
+        fclose(journal->file);
+        free(journal->snapshot_path);
+        free(journal->journal_path);
+        free(journal);
+        manager->journal = NULL;
+    }
+    manager_write_unlock(manager);
+}
+
+bool journal_append(DeviceManager* manager, JournalOp op, int ident, const char* name, DeviceType type, bool state,
+                    int value) {
+    DeviceJournal* journal = manager->journal;
+    size_t name_len = name ? strlen(name) : 0;
+    unsigned char record[JOURNAL_RECORD_SIZE] = {0};
+    int32_t fields[2] = {ident, value};
+    record[0] = (unsigned char)op;
+    record[1] = (unsigned char)name_len;
+    record[2] = (unsigned char)type;
+    record[3] = (unsigned char)state;
+    memcpy(record + 4, fields, sizeof(fields));
+    uint32_t checksum = record_checksum(record, name, name_len);
+    memcpy(record + JOURNAL_RECORD_SIZE - sizeof(checksum), &checksum, sizeof(checksum));
+
+    if (fwrite(record, sizeof(record), 1, journal->file) != 1 ||
+        (name_len && fwrite(name, name_len, 1, journal->file) != 1)) {
+        journal->failed = true;
+    }
+    journal->records++;
+    if (++journal->unsynced >= journal->sync_every) {
+        journal_flush(journal);
+    }
+    return journal->compact_every && journal->records >= journal->compact_every;
+}
+
+bool journal_replay(DeviceManager* manager, const char* filename) {
+    char* journal_path = path_with_suffix(filename, JOURNAL_SUFFIX);
+    FILE* file = journal_path ? fopen(journal_path, "rb") : NULL;
+    free(journal_path);
+    if (!file) {
+        return false;
+    }
+    unsigned char header[JOURNAL_HEADER_SIZE];
+    uint32_t version = 0;
+    uint64_t base = 0;
+    uint64_t snapshot = 0;
+    bool ok = fread(header, sizeof(header), 1, file) == 1 && memcmp(header, JOURNAL_MAGIC, JOURNAL_MAGIC_LEN) == 0;
+    if (ok) {
+        memcpy(&version, header + JOURNAL_MAGIC_LEN, sizeof(version));
+        memcpy(&base, header + JOURNAL_HEADER_SIZE - sizeof(base), sizeof(base));
+    }
+    // A log left over from before the latest compaction is already folded into the snapshot
+    ok = ok && version == JOURNAL_VERSION && file_checksum(filename, &snapshot) && snapshot == base;
+
+    unsigned char record[JOURNAL_RECORD_SIZE];
+    char name[NAME_LEN];
+    while (ok && fread(record, sizeof(record), 1, file) == 1) {
+        size_t name_len = record[1];
+        uint32_t checksum = 0;
+        int32_t fields[2];
+        memcpy(&checksum, record + JOURNAL_RECORD_SIZE - sizeof(checksum), sizeof(checksum));
+        memcpy(fields, record + 4, sizeof(fields));
+        if (name_len >= NAME_LEN || (name_len && fread(name, name_len, 1, file) != 1)) {
+            break; // Torn tail
+        }
+        name[name_len] = '\0';
+        if (record_checksum(record, name, name_len) != checksum) {
+            break;
+        }
+        switch ((JournalOp)record[0]) {
+        case JOURNAL_ADD: {
+            DeviceSpec spec = {name, (DeviceType)record[2], fields[0], record[3] != 0, fields[1]};
+            device_manager_add_devices(manager, &spec, 1, NULL);
+            break;
+        }
+        case JOURNAL_REMOVE:
+            device_manager_remove_device(manager, fields[0], name);
+            break;
+        case JOURNAL_SET_STATE: {
+            DeviceUpdate update = {fields[0], DEVICE_UPDATE_STATE, record[3] != 0};
+            manager_update(manager, &update, name_len ? name : NULL);
+            break;
+        }
+        case JOURNAL_SET_ATTRIBUTE: {
+            DeviceUpdate update = {fields[0], DEVICE_UPDATE_ATTRIBUTE, fields[1]};
+            manager_update(manager, &update, name_len ? name : NULL);
+            break;
+        }
+        default:
+            ok = false;
+            break;
+        }
+    }
+    fclose(file);
+    return ok;
+}
@@ -0,0 +1,180 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "device_manager_internal.h"
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// x86 kernels are compiled per function with target attributes, so the library
+// itself needs no -m flags and runs on any x86-64; the best kernel set the CPU
+// supports is picked at runtime. Other targets use the scalar kernels.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define ATTRIBUTE_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+// Scalar
+static uint64_t scalar_range_mask(const int* attributes, int min, int max) {
+    uint64_t mask = 0;
+    for (uint32_t i = 0; i < BITS_PER_WORD; i++) {
+        mask |= (uint64_t)(attributes[i] >= min && attributes[i] <= max) << i;
+    }
+    return mask;
+}
+
+static void scalar_accumulate(const int* attributes, const uint64_t* masks, uint32_t words, AttributeTotals* totals) {
+    for (uint32_t word = 0; word < words; word++) {
+        for (uint64_t mask = masks[word]; mask; mask &= mask - 1) {
+            int value = attributes[word * BITS_PER_WORD + lowest_bit(mask)];
+            totals->min = value < totals->min ? value : totals->min;
+            totals->max = value > totals->max ? value : totals->max;
+            totals->sum += value;
+        }
+    }
+}
+
+// Vector accumulation costs the same however few slots are selected, while the scalar
+// loop only visits selected ones; below the cutoff (selected per 64 slots) it is faster
+static bool sparse_selection(const uint64_t* masks, uint32_t words, uint32_t cutoff) {
+    uint32_t selected = 0;
+    for (uint32_t word = 0; word < words; word++) {
+        selected += popcount_word(masks[word]);
+    }
+    return selected < words * cutoff;
+}
+
+static const AttributeKernels scalar_kernels = {scalar_range_mask, scalar_accumulate};
+
+#if defined(ATTRIBUTE_KERNELS_X86)
+
+// SSE2: four attributes per vector. SSE2 has no 32-bit min/max or sign extension,
+// so both are built from compares.
+__attribute__((target("sse2"))) static __m128i sse2_select(__m128i mask, __m128i yes, __m128i no) {
+    return _mm_or_si128(_mm_and_si128(mask, yes), _mm_andnot_si128(mask, no));
+}
+
+__attribute__((target("sse2"))) static uint64_t sse2_range_mask(const int* attributes, int min, int max) {
+    __m128i low = _mm_set1_epi32(min);
+    __m128i high = _mm_set1_epi32(max);
+    uint64_t outside = 0;
+    for (uint32_t i = 0; i < BITS_PER_WORD; i += 4) {
+        __m128i values = _mm_loadu_si128((const __m128i*)(const void*)(attributes + i));
+        __m128i out = _mm_or_si128(_mm_cmplt_epi32(values, low), _mm_cmpgt_epi32(values, high));
+        outside |= (uint64_t)(unsigned)_mm_movemask_ps(_mm_castsi128_ps(out)) << i;
+    }
+    return ~outside;
+}
+
+// Lane masks for each 4-bit slice of a selection mask
+static const int32_t sse2_lane_masks[16][4] = {
+    {0, 0, 0, 0},   {-1, 0, 0, 0},   {0, -1, 0, 0},   {-1, -1, 0, 0},   {0, 0, -1, 0},   {-1, 0, -1, 0},
+    {0, -1, -1, 0}, {-1, -1, -1, 0}, {0, 0, 0, -1},   {-1, 0, 0, -1},   {0, -1, 0, -1},  {-1, -1, 0, -1},
+    {0, 0, -1, -1}, {-1, 0, -1, -1}, {0, -1, -1, -1}, {-1, -1, -1, -1}};
+
+// Lanes are selected without branching; vector totals are reduced once per call
+__attribute__((target("sse2"))) static void sse2_accumulate(const int* attributes, const uint64_t* masks,
+                                                            uint32_t words, AttributeTotals* totals) {
+    if (sparse_selection(masks, words, 40)) {
+        scalar_accumulate(attributes, masks, words, totals);
+        return;
+    }
+    __m128i mins = _mm_set1_epi32(INT_MAX);
+    __m128i maxs = _mm_set1_epi32(INT_MIN);
+    __m128i sums = _mm_setzero_si128(); // Two 64-bit lanes
+    for (uint32_t i = 0; i < words * BITS_PER_WORD; i += 4) {
+        uint64_t nibble = (masks[i / BITS_PER_WORD] >> (i % BITS_PER_WORD)) & 0xF;
+        __m128i values = _mm_loadu_si128((const __m128i*)(const void*)(attributes + i));
+        __m128i selected = _mm_loadu_si128((const __m128i*)(const void*)sse2_lane_masks[nibble]);
+        __m128i low = sse2_select(selected, values, _mm_set1_epi32(INT_MAX));
+        __m128i high = sse2_select(selected, values, _mm_set1_epi32(INT_MIN));
+        mins = sse2_select(_mm_cmplt_epi32(low, mins), low, mins);
+        maxs = sse2_select(_mm_cmpgt_epi32(high, maxs), high, maxs);
+        __m128i kept = _mm_and_si128(selected, values);
+        __m128i sign = _mm_cmplt_epi32(kept, _mm_setzero_si128());
+        sums = _mm_add_epi64(sums, _mm_unpacklo_epi32(kept, sign));
+        sums = _mm_add_epi64(sums, _mm_unpackhi_epi32(kept, sign));
+    }
+    int lane_mins[4];
+    int lane_maxs[4];
+    long long lane_sums[2];
+    _mm_storeu_si128((__m128i*)(void*)lane_mins, mins);
+    _mm_storeu_si128((__m128i*)(void*)lane_maxs, maxs);
+    _mm_storeu_si128((__m128i*)(void*)lane_sums, sums);
+    for (int lane = 0; lane < 4; lane++) {
+        totals->min = lane_mins[lane] < totals->min ? lane_mins[lane] : totals->min;
+        totals->max = lane_maxs[lane] > totals->max ? lane_maxs[lane] : totals->max;
+    }
+    totals->sum += lane_sums[0] + lane_sums[1];
+}
+
+static const AttributeKernels sse2_kernels = {sse2_range_mask, sse2_accumulate};
+
+// AVX2: eight attributes per vector
+__attribute__((target("avx2"))) static uint64_t avx2_range_mask(const int* attributes, int min, int max) {
+    __m256i low = _mm256_set1_epi32(min);
+    __m256i high = _mm256_set1_epi32(max);
+    uint64_t outside = 0;
+    for (uint32_t i = 0; i < BITS_PER_WORD; i += 8) {
+        __m256i values = _mm256_loadu_si256((const __m256i*)(const void*)(attributes + i));
+        __m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(low, values), _mm256_cmpgt_epi32(values, high));
+        outside |= (uint64_t)(unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(out)) << i;
+    }
+    return ~outside;
+}
+
+__attribute__((target("avx2"))) static void avx2_accumulate(const int* attributes, const uint64_t* masks,
+                                                            uint32_t words, AttributeTotals* totals) {
+    if (sparse_selection(masks, words, 24)) {
+        scalar_accumulate(attributes, masks, words, totals);
+        return;
+    }
+    const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    __m256i mins = _mm256_set1_epi32(INT_MAX);
+    __m256i maxs = _mm256_set1_epi32(INT_MIN);
+    __m256i sums = _mm256_setzero_si256(); // Four 64-bit lanes
+    for (uint32_t i = 0; i < words * BITS_PER_WORD; i += 8) {
+        int byte = (int)((masks[i / BITS_PER_WORD] >> (i % BITS_PER_WORD)) & 0xFF);
+        __m256i values = _mm256_loadu_si256((const __m256i*)(const void*)(attributes + i));
+        __m256i selected = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(byte), lane_bits), lane_bits);
+        mins = _mm256_min_epi32(mins, _mm256_blendv_epi8(_mm256_set1_epi32(INT_MAX), values, selected));
+        maxs = _mm256_max_epi32(maxs, _mm256_blendv_epi8(_mm256_set1_epi32(INT_MIN), values, selected));
+        __m256i kept = _mm256_and_si256(selected, values);
+        sums = _mm256_add_epi64(sums, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(kept)));
+        sums = _mm256_add_epi64(sums, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(kept, 1)));
+    }
+    int lane_mins[8];
+    int lane_maxs[8];
+    long long lane_sums[4];
+    _mm256_storeu_si256((__m256i*)(void*)lane_mins, mins);
+    _mm256_storeu_si256((__m256i*)(void*)lane_maxs, maxs);
+    _mm256_storeu_si256((__m256i*)(void*)lane_sums, sums);
+    for (int lane = 0; lane < 8; lane++) {
+        totals->min = lane_mins[lane] < totals->min ? lane_mins[lane] : totals->min;
+        totals->max = lane_maxs[lane] > totals->max ? lane_maxs[lane] : totals->max;
+    }
+    totals->sum += lane_sums[0] + lane_sums[1] + lane_sums[2] + lane_sums[3];
+}
+
+static const AttributeKernels avx2_kernels = {avx2_range_mask, avx2_accumulate};
+
+#endif
+
+// DEVICE_MANAGER_SIMD=scalar|sse2|avx2 caps the kernel set, e.g. for benchmarking
+const AttributeKernels* attribute_kernels_select(void) {
+    const char* forced = getenv("DEVICE_MANAGER_SIMD");
+    if (forced && strcmp(forced, "scalar") == 0) {
+        return &scalar_kernels;
+    }
+#if defined(ATTRIBUTE_KERNELS_X86)
+    __builtin_cpu_init();
+    if ((!forced || strcmp(forced, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        return &avx2_kernels;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return &sse2_kernels;
+    }
+#endif
+    return &scalar_kernels;
+}
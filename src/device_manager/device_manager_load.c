@@ -0,0 +1,325 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "device_manager_internal.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Text snapshots are split into about this many bytes per chunk, a few chunks per
+// worker so idle workers have something to steal
+#define LOAD_CHUNK_MIN_BYTES (256U << 10)
+#define LOAD_CHUNKS_PER_WORKER 4
+#define LOAD_SPECS_MIN_CAPACITY 1024
+
+typedef struct LoadError {
+    size_t line; // Within the chunk, from 0
+    const char* message;
+} LoadError;
+
+// What one chunk of the file parsed into. Names point into the file buffer, each
+// decoded and terminated in place.
+typedef struct LoadChunk {
+    char* begin;
+    char* end;
+    size_t lines;
+    DeviceSpec* specs;
+    size_t count;
+    size_t capacity;
+    LoadError* errors;
+    size_t error_count;
+    size_t error_capacity;
+    bool failed; // Out of memory
+} LoadChunk;
+
+// One "id name type state attribute" line, consumed field by field
+typedef struct LoadLine {
+    char* at;
+    char* end;
+} LoadLine;
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static char* field_end(const LoadLine* line) {
+    char* at = line->at;
+    while (at < line->end && !is_blank(*at)) {
+        at++;
+    }
+    return at;
+}
+
+static void skip_blanks(LoadLine* line) {
+    while (line->at < line->end && is_blank(*line->at)) {
+        line->at++;
+    }
+}
+
+static bool scan_int(LoadLine* line, int* value) {
+    skip_blanks(line);
+    char* end = field_end(line);
+    char* at = line->at;
+    bool negative = at < end && *at == '-';
+    at += negative;
+    if (at == end) {
+        return false;
+    }
+    long long magnitude = 0;
+    for (; at < end; at++) {
+        if (*at < '0' || *at > '9' || magnitude > (long long)INT_MAX + 1) {
+            return false;
+        }
+        magnitude = magnitude * 10 + (*at - '0');
+    }
+    magnitude = negative ? -magnitude : magnitude;
+    if (magnitude < INT_MIN || magnitude > INT_MAX) {
+        return false;
+    }
+    *value = (int)magnitude;
+    line->at = end;
+    return true;
+}
+
+// Returns the problem with the line, or NULL once spec holds it
+static const char* scan_device(LoadLine* line, DeviceSpec* spec) {
+    int ident = 0;
+    int type = 0;
+    int state = 0;
+    int attribute = 0;
+    if (!scan_int(line, &ident)) {
+        return "expected an integer id";
+    }
+    if (ident < 0) {
+        return "negative id";
+    }
+    skip_blanks(line);
+    char* name = line->at;
+    char* field_stop = field_end(line);
+    if (name == field_stop) {
+        return "missing name";
+    }
+    if (field_stop == line->end) {
+        return "missing type";
+    }
+    // Decoded in place; the name is never longer than its encoding
+    char* name_end = name + name_unescape(name, name, (size_t)(field_stop - name));
+    if ((size_t)(name_end - name) >= NAME_LEN) {
+        return "name too long";
+    }
+    line->at = field_stop + 1;
+    if (!scan_int(line, &type) || type < 0 || type >= DEVICE_TYPE_COUNT) {
+        return "expected a device type";
+    }
+    if (!scan_int(line, &state) || (state != 0 && state != 1)) {
+        return "expected state 0 or 1";
+    }
+    if (!scan_int(line, &attribute)) {
+        return "expected an integer attribute";
+    }
+    skip_blanks(line);
+    if (line->at != line->end) {
+        return "unexpected text after the attribute";
+    }
+    *name_end = '\0';
+    spec->name = name;
+    spec->type = (DeviceType)type;
+    spec->ident = ident;
+    spec->state = state != 0;
+    spec->attribute = attribute;
+    return NULL;
+}
+
+static bool chunk_add_error(LoadChunk* chunk, size_t line, const char* message) {
+    if (chunk->error_count == chunk->error_capacity) {
+        size_t capacity = chunk->error_capacity ? chunk->error_capacity * 2 : 16;
+        LoadError* errors = (LoadError*)realloc(chunk->errors, capacity * sizeof(LoadError));
+        if (!errors) {
+            return false;
+        }
+        chunk->errors = errors;
+        chunk->error_capacity = capacity;
+    }
+    chunk->errors[chunk->error_count++] = (LoadError){line, message};
+    return true;
+}
+
+static DeviceSpec* chunk_next_spec(LoadChunk* chunk) {
+    if (chunk->count == chunk->capacity) {
+        size_t capacity = chunk->capacity ? chunk->capacity * 2 : LOAD_SPECS_MIN_CAPACITY;
+        DeviceSpec* specs = (DeviceSpec*)realloc(chunk->specs, capacity * sizeof(DeviceSpec));
+        if (!specs) {
+            return NULL;
+        }
+        chunk->specs = specs;
+        chunk->capacity = capacity;
+    }
+    return &chunk->specs[chunk->count];
+}
+
+static void parse_chunk(void* context, uint32_t index, size_t worker) {
+    (void)worker;
+    LoadChunk* chunk = &((LoadChunk*)context)[index];
+    for (char* at = chunk->begin; at < chunk->end && !chunk->failed; chunk->lines++) {
+        char* newline = (char*)memchr(at, '\n', (size_t)(chunk->end - at));
+        LoadLine line = {at, newline ? newline : chunk->end};
+        at = line.end + 1;
+        if (line.end > line.at && line.end[-1] == '\r') {
+            line.end--;
+        }
+        skip_blanks(&line);
+        if (line.at == line.end) {
+            continue;
+        }
+        DeviceSpec* spec = chunk_next_spec(chunk);
+        const char* problem = spec ? scan_device(&line, spec) : NULL;
+        if (!spec || (problem && !chunk_add_error(chunk, chunk->lines, problem))) {
+            chunk->failed = true;
+        } else if (!problem) {
+            chunk->count++;
+        }
+    }
+}
+
+#if defined(_WIN32)
+
+// No mmap here: the file is read into heap memory instead
+static char* load_map(const char* filename, size_t* size) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        return NULL;
+    }
+    long length = 0;
+    char* data = NULL;
+    if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+        data = (char*)malloc((size_t)length + 1);
+    }
+    if (data && length > 0 && fread(data, (size_t)length, 1, file) != 1) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = (size_t)length;
+    return data;
+}
+
+static void load_unmap(char* data, size_t size) {
+    (void)size;
+    free(data);
+}
+
+#else
+
+// Mapped privately and writable, so names can be terminated in place; only the
+// pages holding them are copied. An empty file maps to a placeholder.
+static char* load_map(const char* filename, size_t* size) {
+    static char empty[1];
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    char* data = NULL;
+    if (fstat(fd, &info) == 0) {
+        *size = (size_t)info.st_size;
+        void* mapping = *size ? mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : empty;
+        data = mapping == MAP_FAILED ? NULL : (char*)mapping;
+    }
+    close(fd);
+    return data;
+}
+
+static void load_unmap(char* data, size_t size) {
+    if (size) {
+        munmap(data, size);
+    }
+}
+
+#endif
+
+// Chunk boundaries fall just past a newline, so every line belongs to one chunk
+static LoadChunk* split_chunks(char* data, size_t size, size_t workers, uint32_t* chunk_count) {
+    size_t count = size / LOAD_CHUNK_MIN_BYTES;
+    count = count > workers * LOAD_CHUNKS_PER_WORKER ? workers * LOAD_CHUNKS_PER_WORKER : count;
+    count = count ? count : 1;
+    LoadChunk* chunks = (LoadChunk*)calloc(count, sizeof(LoadChunk));
+    if (!chunks) {
+        return NULL;
+    }
+    char* begin = data;
+    for (size_t i = 0; i < count; i++) {
+        char* end = data + size;
+        if (i + 1 < count) {
+            char* target = data + size * (i + 1) / count;
+            target = target < begin ? begin : target;
+            char* newline = (char*)memchr(target, '\n', (size_t)(data + size - target));
+            end = newline ? newline + 1 : data + size;
+        }
+        chunks[i].begin = begin;
+        chunks[i].end = end;
+        begin = end;
+    }
+    *chunk_count = (uint32_t)count;
+    return chunks;
+}
+
+DeviceManager* device_manager_load_parallel(const char* filename, size_t threads, DeviceLoadErrorFn on_error,
+                                            void* udata) {
+    size_t size = 0;
+    char* data = filename ? load_map(filename, &size) : NULL;
+    if (!data) {
+        return NULL;
+    }
+    if (threads == 0) {
+        threads = pool_default_workers();
+    }
+    DeviceManager* manager = device_manager_create();
+    WorkerPool* pool = threads > 1 ? pool_create(threads) : NULL;
+    uint32_t chunk_count = 0;
+    LoadChunk* chunks = manager && (threads <= 1 || pool) ? split_chunks(data, size, threads, &chunk_count) : NULL;
+    bool parsed = chunks && pool_parallel_for(pool, chunk_count, parse_chunk, chunks);
+    pool_destroy(pool);
+
+    // Records go in chunk by chunk, in file order, after one reservation for them all
+    size_t total = 0;
+    for (uint32_t i = 0; parsed && i < chunk_count; i++) {
+        parsed = !chunks[i].failed;
+        total += chunks[i].count;
+    }
+    parsed = parsed && device_manager_reserve(manager, total);
+    size_t lines = 0;
+    for (uint32_t i = 0; parsed && i < chunk_count; i++) {
+        parsed = device_manager_add_devices(manager, chunks[i].specs, chunks[i].count, NULL) == chunks[i].count;
+        for (size_t e = 0; parsed && on_error && e < chunks[i].error_count; e++) {
+            on_error(lines + chunks[i].errors[e].line + 1, chunks[i].errors[e].message, udata);
+        }
+        lines += chunks[i].lines;
+    }
+    for (uint32_t i = 0; chunks && i < chunk_count; i++) {
+        free(chunks[i].specs);
+        free(chunks[i].errors);
+    }
+    free(chunks);
+    load_unmap(data, size);
+    if (!parsed) {
+        device_manager_destroy(manager);
+        return NULL;
+    }
+
+    // Changes journaled since the snapshot was written are applied on top of it
+    journal_replay(manager, filename);
+    return manager;
+}
+
+DeviceManager* device_manager_load(const char* filename) {
+    return device_manager_load_parallel(filename, 1, NULL, NULL);
+}
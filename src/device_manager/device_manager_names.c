@@ -0,0 +1,196 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "device_manager_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Chunk directory starts small and doubles; references have 16 bits for the chunk
+#define NAME_DIRECTORY_MIN_CAPACITY 4
+#define NAME_CHUNK_LIMIT (1U << (32 - NAME_CHUNK_SHIFT))
+
+void names_init(DeviceNames* names) {
+    memset(names, 0, sizeof(*names));
+    for (uint32_t i = 0; i < NAME_CLASSES; i++) {
+        names->free_lists[i] = NO_NAME;
+    }
+}
+
+// Chunks inside the binary snapshot mapping belong to it; the rest came from the heap
+static bool chunk_on_heap(const DeviceStorage* storage, const NameChunk* chunk) {
+    uintptr_t address = (uintptr_t)chunk;
+    uintptr_t mapping = (uintptr_t)storage->mapping;
+    return !(storage->mapping && address >= mapping && address < mapping + storage->mapping_size);
+}
+
+static void chunk_release(const DeviceStorage* storage, NameChunk* chunk) {
+    if (atomic_fetch_add_acq_rel_int(&chunk->shares, -1) == 0 && chunk_on_heap(storage, chunk)) {
+        free(chunk);
+    }
+}
+
+// Copy-on-write like storage_unshare: the manager copies a chunk a snapshot still
+// holds before writing to it, even past the bytes the snapshot can reach
+static NameChunk* chunk_writable(DeviceStorage* storage, uint32_t index) {
+    NameChunk** entry = &storage->names.chunks[index];
+    if (atomic_load_acquire_int(&(*entry)->shares) == 0) {
+        return *entry;
+    }
+    NameChunk* copy = (NameChunk*)malloc(sizeof(NameChunk));
+    if (!copy) {
+        return NULL;
+    }
+    memcpy(copy->bytes, (*entry)->bytes, sizeof(copy->bytes));
+    copy->shares = 0;
+    chunk_release(storage, *entry);
+    *entry = copy;
+    return copy;
+}
+
+static bool names_add_chunk(DeviceNames* names) {
+    if (names->chunk_count == NAME_CHUNK_LIMIT) {
+        return false;
+    }
+    if (names->chunk_count == names->chunk_capacity) {
+        uint32_t capacity = names->chunk_capacity ? names->chunk_capacity * 2 : NAME_DIRECTORY_MIN_CAPACITY;
+        NameChunk** chunks = (NameChunk**)realloc((void*)names->chunks, capacity * sizeof(NameChunk*));
+        if (!chunks) {
+            return false;
+        }
+        names->chunks = chunks;
+        names->chunk_capacity = capacity;
+    }
+    // Zeroed so binary snapshots never carry stale heap bytes
+    NameChunk* chunk = (NameChunk*)calloc(1, sizeof(NameChunk));
+    if (!chunk) {
+        return false;
+    }
+    names->chunks[names->chunk_count++] = chunk;
+    names->used = 0;
+    return true;
+}
+
+// Reuses a freed block of the same size when there is one, else appends
+uint32_t names_store(DeviceStorage* storage, const char* name, size_t length) {
+    DeviceNames* names = &storage->names;
+    uint32_t size = NAME_BLOCK_SIZE(length);
+    uint32_t* free_list = &names->free_lists[size / NAME_ALIGN];
+    uint32_t ref = *free_list;
+    if (ref == NO_NAME && (names->chunk_count == 0 || names->used + size > NAME_CHUNK_SIZE) &&
+        !names_add_chunk(names)) {
+        return NO_NAME;
+    }
+    uint32_t chunk_index = ref != NO_NAME ? ref >> NAME_CHUNK_SHIFT : names->chunk_count - 1;
+    NameChunk* chunk = chunk_writable(storage, chunk_index);
+    if (!chunk) {
+        return NO_NAME;
+    }
+    unsigned char* block = NULL;
+    if (ref != NO_NAME) {
+        block = chunk->bytes + (ref & (NAME_CHUNK_SIZE - 1));
+        memcpy(free_list, block, sizeof(uint32_t));
+    } else {
+        ref = chunk_index << NAME_CHUNK_SHIFT | names->used;
+        block = chunk->bytes + names->used;
+        names->used += size;
+    }
+    block[0] = (unsigned char)length;
+    memcpy(block + 1, name, length);
+    memset(block + 1 + length, 0, size - 1 - length);
+    return ref;
+}
+
+// A block whose chunk cannot be copied is left unused rather than failing the removal
+void names_free(DeviceStorage* storage, uint32_t ref) {
+    DeviceNames* names = &storage->names;
+    uint32_t size = NAME_BLOCK_SIZE(*name_block(storage, ref));
+    NameChunk* chunk = chunk_writable(storage, ref >> NAME_CHUNK_SHIFT);
+    if (!chunk) {
+        return;
+    }
+    memcpy(chunk->bytes + (ref & (NAME_CHUNK_SIZE - 1)), &names->free_lists[size / NAME_ALIGN], sizeof(uint32_t));
+    names->free_lists[size / NAME_ALIGN] = ref;
+}
+
+bool names_share(const DeviceStorage* storage, DeviceStorage* view) {
+    const DeviceNames* names = &storage->names;
+    names_init(&view->names);
+    if (names->chunk_count == 0) {
+        return true;
+    }
+    NameChunk** chunks = (NameChunk**)malloc(names->chunk_count * sizeof(NameChunk*));
+    if (!chunks) {
+        return false;
+    }
+    for (uint32_t i = 0; i < names->chunk_count; i++) {
+        atomic_fetch_add_int(&names->chunks[i]->shares, 1);
+        chunks[i] = names->chunks[i];
+    }
+    view->names.chunks = chunks;
+    view->names.chunk_count = names->chunk_count;
+    view->names.chunk_capacity = names->chunk_count;
+    view->names.used = names->used;
+    return true;
+}
+
+void names_release(DeviceStorage* storage) {
+    DeviceNames* names = &storage->names;
+    for (uint32_t i = 0; i < names->chunk_count; i++) {
+        chunk_release(storage, names->chunks[i]);
+    }
+    free((void*)names->chunks);
+    names_init(names);
+}
+
+size_t names_memory(const DeviceStorage* storage) {
+    return (size_t)storage->names.chunk_count * sizeof(NameChunk) +
+           (size_t)storage->names.chunk_capacity * sizeof(NameChunk*);
+}
+
+static bool name_byte_escaped(unsigned char c) {
+    return c <= ' ' || c == '%' || c == 0x7F;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+char* name_escape(char* out, const char* name, size_t length) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)name[i];
+        if (name_byte_escaped(c)) {
+            *out++ = '%';
+            *out++ = hex[c >> 4];
+            *out++ = hex[c & 0xF];
+        } else {
+            *out++ = (char)c;
+        }
+    }
+    return out;
+}
+
+size_t name_unescape(char* out, const char* field, size_t length) {
+    size_t used = 0;
+    for (size_t i = 0; i < length; i++) {
+        int high = field[i] == '%' && i + 2 < length ? hex_value(field[i + 1]) : -1;
+        int low = high >= 0 ? hex_value(field[i + 2]) : -1;
+        if (low >= 0 && (high | low) != 0) {
+            out[used++] = (char)(high << 4 | low);
+            i += 2;
+        } else {
+            out[used++] = field[i];
+        }
+    }
+    return used;
+}
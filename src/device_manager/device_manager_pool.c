@@ -0,0 +1,239 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "device_manager_internal.h"
+#include <stdlib.h>
+
+#if !defined(_MSC_VER)
+#include <pthread.h>
+#define WORKER_POOL_THREADS 1
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// Work is handed out as chunk ranges, one per worker, packed as (next << 32 | end)
+// so owners and thieves can both claim chunks with a single compare-exchange:
+// the owner takes from the front, thieves take from the back.
+#define RANGE_PACK(next, end) (((uint64_t)(next) << 32) | (uint64_t)(end))
+#define RANGE_NEXT(range) ((uint32_t)((range) >> 32))
+#define RANGE_END(range) ((uint32_t)(range))
+
+typedef struct PoolJob {
+    PoolChunkFn fn;
+    void* context;
+    uint64_t* ranges; // One per worker
+} PoolJob;
+
+struct WorkerPool {
+    size_t workers; // Including the calling thread
+#if defined(WORKER_POOL_THREADS)
+    pthread_t* threads;
+    pthread_mutex_t run_lock; // One job at a time
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation; // Bumped for every job
+    size_t pending; // Helper threads still running the current job
+    bool stopping;
+    const PoolJob* job;
+#endif
+};
+
+typedef struct PoolThread {
+    WorkerPool* pool;
+    size_t worker;
+} PoolThread;
+
+static bool claim_range(uint64_t* range, bool from_front, uint32_t* chunk) {
+    uint64_t current = atomic_load_word(range);
+    while (RANGE_NEXT(current) < RANGE_END(current)) {
+        uint32_t next = RANGE_NEXT(current);
+        uint32_t end = RANGE_END(current);
+        uint64_t claimed = from_front ? RANGE_PACK(next + 1, end) : RANGE_PACK(next, end - 1);
+        if (atomic_compare_exchange_word(range, &current, claimed)) {
+            *chunk = from_front ? next : end - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drains the worker's own range, then steals from the others until all are empty
+static void run_job(const PoolJob* job, size_t workers, size_t worker) {
+    uint32_t chunk = 0;
+    while (claim_range(&job->ranges[worker], true, &chunk)) {
+        job->fn(job->context, chunk, worker);
+    }
+    for (size_t offset = 1; offset < workers; offset++) {
+        uint64_t* victim = &job->ranges[(worker + offset) % workers];
+        while (claim_range(victim, false, &chunk)) {
+            job->fn(job->context, chunk, worker);
+        }
+    }
+}
+
+#if defined(WORKER_POOL_THREADS)
+
+static void* pool_thread_main(void* arg) {
+    PoolThread* thread = (PoolThread*)arg;
+    WorkerPool* pool = thread->pool;
+    size_t worker = thread->worker;
+    free(thread);
+    uint64_t seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->stopping && pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stopping) {
+            break;
+        }
+        seen = pool->generation;
+        const PoolJob* job = pool->job;
+        pthread_mutex_unlock(&pool->lock);
+        run_job(job, pool->workers, worker);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0) {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void pool_stop(WorkerPool* pool, size_t started) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+}
+
+WorkerPool* pool_create(size_t workers) {
+    WorkerPool* pool = (WorkerPool*)calloc(1, sizeof(WorkerPool));
+    if (!pool) {
+        return NULL;
+    }
+    pool->workers = workers ? workers : 1;
+    pool->threads = (pthread_t*)calloc(pool->workers, sizeof(pthread_t));
+    if (!pool->threads) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    // The calling thread is worker 0; helpers are 1..workers-1
+    size_t started = 0;
+    for (size_t worker = 1; worker < pool->workers; worker++) {
+        PoolThread* thread = (PoolThread*)malloc(sizeof(PoolThread));
+        if (thread) {
+            thread->pool = pool;
+            thread->worker = worker;
+        }
+        if (!thread || pthread_create(&pool->threads[started], NULL, pool_thread_main, thread) != 0) {
+            free(thread);
+            pool_stop(pool, started);
+            pool->workers = 0;
+            pool_destroy(pool);
+            return NULL;
+        }
+        started++;
+    }
+    return pool;
+}
+
+void pool_destroy(WorkerPool* pool) {
+    if (!pool) {
+        return;
+    }
+    if (pool->workers > 1) {
+        pool_stop(pool, pool->workers - 1);
+    }
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool);
+}
+
+#else
+
+WorkerPool* pool_create(size_t workers) {
+    (void)workers;
+    // No threads on this platform: every job runs on the calling thread
+    WorkerPool* pool = (WorkerPool*)calloc(1, sizeof(WorkerPool));
+    if (pool) {
+        pool->workers = 1;
+    }
+    return pool;
+}
+
+void pool_destroy(WorkerPool* pool) {
+    free(pool);
+}
+
+#endif
+
+size_t pool_default_workers(void) {
+#if defined(_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (size_t)info.dwNumberOfProcessors : 1;
+#else
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (size_t)online : 1;
+#endif
+}
+
+size_t pool_workers(const WorkerPool* pool) {
+    return pool ? pool->workers : 1;
+}
+
+bool pool_parallel_for(WorkerPool* pool, uint32_t chunks, PoolChunkFn fn, void* context) {
+    size_t workers = pool_workers(pool);
+    PoolJob job = {fn, context, (uint64_t*)malloc(workers * sizeof(uint64_t))};
+    if (!job.ranges) {
+        return false;
+    }
+    // Contiguous equal shares keep each worker on its own slabs unless it runs dry
+    for (size_t worker = 0; worker < workers; worker++) {
+        job.ranges[worker] = RANGE_PACK(chunks * worker / workers, chunks * (worker + 1) / workers);
+    }
+#if defined(WORKER_POOL_THREADS)
+    if (workers > 1) {
+        pthread_mutex_lock(&pool->run_lock);
+        pthread_mutex_lock(&pool->lock);
+        pool->job = &job;
+        pool->pending = workers - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+
+        run_job(&job, workers, 0);
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending > 0) {
+            pthread_cond_wait(&pool->done, &pool->lock);
+        }
+        pool->job = NULL;
+        pthread_mutex_unlock(&pool->lock);
+        pthread_mutex_unlock(&pool->run_lock);
+        free(job.ranges);
+        return true;
+    }
+#endif
+    run_job(&job, workers, 0);
+    free(job.ranges);
+    return true;
+}
@@ -0,0 +1,450 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "device_manager_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+// The manifest is one line: magic, format version, shard count, shard format
+#define REGISTRY_MAGIC "DMREGISTRY"
+#define REGISTRY_VERSION 1
+#define REGISTRY_MAX_SHARDS 65536U
+#define REGISTRY_TEMP_SUFFIX ".tmp"
+
+// Serializes loading a shard; only taken until the shard is loaded
+#if defined(_WIN32)
+typedef SRWLOCK LoadLock;
+
+static bool load_lock_init(LoadLock* lock) {
+    InitializeSRWLock(lock);
+    return true;
+}
+static void load_lock_destroy(LoadLock* lock) {
+    (void)lock;
+}
+static void load_lock(LoadLock* lock) {
+    AcquireSRWLockExclusive(lock);
+}
+static void load_unlock(LoadLock* lock) {
+    ReleaseSRWLockExclusive(lock);
+}
+#else
+typedef pthread_mutex_t LoadLock;
+
+static bool load_lock_init(LoadLock* lock) {
+    return pthread_mutex_init(lock, NULL) == 0;
+}
+static void load_lock_destroy(LoadLock* lock) {
+    pthread_mutex_destroy(lock);
+}
+static void load_lock(LoadLock* lock) {
+    pthread_mutex_lock(lock);
+}
+static void load_unlock(LoadLock* lock) {
+    pthread_mutex_unlock(lock);
+}
+#endif
+
+typedef struct RegistryShard {
+    DeviceManager* manager; // Written once under the load lock, before loaded is released
+    uint64_t loaded;
+    LoadLock lock;
+} RegistryShard;
+
+struct DeviceRegistry {
+    RegistryShard* shards;
+    size_t shard_count;
+    WorkerPool* pool; // NULL fans out on the calling thread
+    char* source; // Manifest unloaded shards come from; NULL for a new registry
+    DeviceShardFormat source_format; // Format the manifest names; shard files may differ
+};
+
+// "<path>.<index>" plus an optional suffix
+static char* shard_path(const char* path, size_t index, const char* suffix) {
+    size_t length = strlen(path) + strlen(suffix) + 24;
+    char* joined = (char*)malloc(length);
+    if (joined) {
+        snprintf(joined, length, "%s.%zu%s", path, index, suffix);
+    }
+    return joined;
+}
+
+static DeviceRegistry* registry_create(size_t shard_count, size_t threads) {
+    if (shard_count == 0 || shard_count > REGISTRY_MAX_SHARDS) {
+        return NULL;
+    }
+    if (threads == 0) {
+        threads = pool_default_workers();
+    }
+    // More workers than shards would have nothing to do
+    threads = threads < shard_count ? threads : shard_count;
+    DeviceRegistry* registry = (DeviceRegistry*)calloc(1, sizeof(DeviceRegistry));
+    if (!registry) {
+        return NULL;
+    }
+    registry->shards = (RegistryShard*)calloc(shard_count, sizeof(RegistryShard));
+    registry->pool = threads > 1 ? pool_create(threads) : NULL;
+    if (!registry->shards || (threads > 1 && !registry->pool)) {
+        device_registry_destroy(registry);
+        return NULL;
+    }
+    for (; registry->shard_count < shard_count; registry->shard_count++) {
+        if (!load_lock_init(&registry->shards[registry->shard_count].lock)) {
+            device_registry_destroy(registry);
+            return NULL;
+        }
+    }
+    return registry;
+}
+
+DeviceRegistry* device_registry_create(size_t shard_count, size_t threads) {
+    return registry_create(shard_count, threads);
+}
+
+void device_registry_destroy(DeviceRegistry* registry) {
+    if (!registry) {
+        return;
+    }
+    for (size_t i = 0; i < registry->shard_count; i++) {
+        device_manager_destroy(registry->shards[i].manager);
+        load_lock_destroy(&registry->shards[i].lock);
+    }
+    free(registry->shards);
+    pool_destroy(registry->pool);
+    free(registry->source);
+    free(registry);
+}
+
+size_t device_registry_shard_count(DeviceRegistry* registry) {
+    return registry ? registry->shard_count : 0;
+}
+
+// Multiplicative hash, mapped onto [0, shards) by the high bits of a widening multiply
+static size_t shard_index(const DeviceRegistry* registry, int ident) {
+    uint32_t hash = (uint32_t)ident * 0x9E3779B1U;
+    hash ^= hash >> 16;
+    return (size_t)(((uint64_t)hash * registry->shard_count) >> 32);
+}
+
+size_t device_registry_shard_of(DeviceRegistry* registry, int ident) {
+    return registry ? shard_index(registry, ident) : 0;
+}
+
+// Shard files are told apart by their first bytes, not by the manifest: a save that
+// switches formats in place and fails part way leaves shards of both behind
+static DeviceShardFormat shard_file_format(const char* path) {
+    unsigned char head[SNAPSHOT_SNIFF_LEN];
+    size_t size = 0;
+    FILE* file = fopen(path, "rb");
+    if (file) {
+        size = fread(head, 1, sizeof(head), file);
+        fclose(file);
+    }
+    if (snapshot_is_binary(head, size)) {
+        return DEVICE_SHARD_BINARY;
+    }
+    return snapshot_is_compressed(head, size) ? DEVICE_SHARD_COMPRESSED : DEVICE_SHARD_TEXT;
+}
+
+static DeviceManager* shard_load(const DeviceRegistry* registry, size_t index) {
+    if (!registry->source) {
+        return device_manager_create_concurrent();
+    }
+    char* path = shard_path(registry->source, index, "");
+    if (!path) {
+        return NULL;
+    }
+    DeviceManager* manager = NULL;
+    switch (shard_file_format(path)) {
+    case DEVICE_SHARD_TEXT:
+        manager = device_manager_load(path);
+        break;
+    case DEVICE_SHARD_BINARY:
+        manager = device_manager_load_binary(path);
+        break;
+    case DEVICE_SHARD_COMPRESSED:
+        manager = device_manager_load_compressed(path);
+        break;
+    }
+    free(path);
+    if (manager && !manager_make_concurrent(manager)) {
+        device_manager_destroy(manager);
+        return NULL;
+    }
+    return manager;
+}
+
+// Double-checked: once loaded, a shard costs one acquire load to reach. A failed
+// load is retried by the next caller.
+static DeviceManager* shard_get(DeviceRegistry* registry, size_t index) {
+    RegistryShard* shard = &registry->shards[index];
+    if (atomic_load_acquire_word(&shard->loaded)) {
+        return shard->manager;
+    }
+    load_lock(&shard->lock);
+    if (!atomic_load_word(&shard->loaded)) {
+        shard->manager = shard_load(registry, index);
+        if (shard->manager) {
+            atomic_store_release_word(&shard->loaded, 1);
+        }
+    }
+    DeviceManager* manager = shard->manager;
+    load_unlock(&shard->lock);
+    return manager;
+}
+
+DeviceManager* device_registry_shard(DeviceRegistry* registry, size_t index) {
+    return registry && index < registry->shard_count ? shard_get(registry, index) : NULL;
+}
+
+size_t device_registry_loaded_shards(DeviceRegistry* registry) {
+    size_t loaded = 0;
+    for (size_t i = 0; registry && i < registry->shard_count; i++) {
+        loaded += atomic_load_acquire_word(&registry->shards[i].loaded) != 0;
+    }
+    return loaded;
+}
+
+static DeviceManager* shard_for(DeviceRegistry* registry, int ident) {
+    return registry ? shard_get(registry, shard_index(registry, ident)) : NULL;
+}
+
+bool device_registry_add_device(DeviceRegistry* registry, const char* name, DeviceType type, int ident) {
+    DeviceManager* shard = shard_for(registry, ident);
+    return shard && device_manager_add_device(shard, name, type, ident);
+}
+
+bool device_registry_remove_device(DeviceRegistry* registry, int ident, const char* name) {
+    DeviceManager* shard = shard_for(registry, ident);
+    return shard && device_manager_remove_device(shard, ident, name);
+}
+
+bool device_registry_set_device_state(DeviceRegistry* registry, int ident, bool state) {
+    DeviceManager* shard = shard_for(registry, ident);
+    return shard && device_manager_set_device_state(shard, ident, state);
+}
+
+bool device_registry_set_device_attribute(DeviceRegistry* registry, int ident, int value) {
+    DeviceManager* shard = shard_for(registry, ident);
+    return shard && device_manager_set_device_attribute(shard, ident, value);
+}
+
+int device_registry_get_device_attribute(DeviceRegistry* registry, int ident) {
+    DeviceManager* shard = shard_for(registry, ident);
+    return shard ? device_manager_get_device_attribute(shard, ident) : 0;
+}
+
+// Fan-out: one pool chunk per shard, each writing only its own entry of the results
+typedef struct RegistryCount {
+    DeviceRegistry* registry;
+    int type; // -1 counts every device
+    size_t* counts;
+} RegistryCount;
+
+static void count_shard(void* context, uint32_t chunk, size_t worker) {
+    (void)worker;
+    RegistryCount* job = (RegistryCount*)context;
+    DeviceManager* shard = shard_get(job->registry, chunk);
+    int count = 0;
+    if (shard) {
+        count = job->type < 0 ? device_manager_get_device_count(shard)
+                              : device_manager_count_by_type(shard, (DeviceType)job->type);
+    }
+    job->counts[chunk] = (size_t)count;
+}
+
+static size_t registry_count(DeviceRegistry* registry, int type) {
+    if (!registry) {
+        return 0;
+    }
+    RegistryCount job = {registry, type, (size_t*)calloc(registry->shard_count, sizeof(size_t))};
+    size_t total = 0;
+    if (job.counts && pool_parallel_for(registry->pool, (uint32_t)registry->shard_count, count_shard, &job)) {
+        for (size_t i = 0; i < registry->shard_count; i++) {
+            total += job.counts[i];
+        }
+    }
+    free(job.counts);
+    return total;
+}
+
+size_t device_registry_get_device_count(DeviceRegistry* registry) {
+    return registry_count(registry, -1);
+}
+
+size_t device_registry_count_by_type(DeviceRegistry* registry, DeviceType type) {
+    if ((unsigned)type >= DEVICE_TYPE_COUNT) {
+        return 0;
+    }
+    return registry_count(registry, (int)type);
+}
+
+typedef struct RegistryQuery {
+    DeviceRegistry* registry;
+    const DeviceFilter* filter;
+    int* out_ids;
+    size_t* offsets; // Where each shard's ids go; offsets[shards] is the space used
+    size_t* totals; // Matches per shard, counted by the first pass and again by the second
+} RegistryQuery;
+
+static void query_shard(void* context, uint32_t chunk, size_t worker) {
+    (void)worker;
+    RegistryQuery* job = (RegistryQuery*)context;
+    DeviceManager* shard = shard_get(job->registry, chunk);
+    size_t cap = job->offsets ? job->offsets[chunk + 1] - job->offsets[chunk] : 0;
+    int* out_ids = cap ? job->out_ids + job->offsets[chunk] : NULL;
+    job->totals[chunk] = shard ? device_manager_query(shard, job->filter, out_ids, cap) : 0;
+}
+
+// Two passes: count per shard, then fill each shard's slice of out_ids. Shards that
+// shrank in between leave gaps, which are closed afterwards.
+size_t device_registry_query(DeviceRegistry* registry, const DeviceFilter* filter, int* out_ids, size_t cap) {
+    if (!registry) {
+        return 0;
+    }
+    size_t shards = registry->shard_count;
+    RegistryQuery job = {registry, filter, out_ids, NULL, (size_t*)calloc(shards, sizeof(size_t))};
+    if (!job.totals || !pool_parallel_for(registry->pool, (uint32_t)shards, query_shard, &job)) {
+        free(job.totals);
+        return 0;
+    }
+    size_t total = 0;
+    for (size_t i = 0; i < shards; i++) {
+        total += job.totals[i];
+    }
+    if (!out_ids || cap == 0 || total == 0) {
+        free(job.totals);
+        return total;
+    }
+
+    job.offsets = (size_t*)malloc((shards + 1) * sizeof(size_t));
+    if (!job.offsets) {
+        free(job.totals);
+        return 0;
+    }
+    job.offsets[0] = 0;
+    for (size_t i = 0; i < shards; i++) {
+        size_t room = cap - job.offsets[i];
+        job.offsets[i + 1] = job.offsets[i] + (job.totals[i] < room ? job.totals[i] : room);
+    }
+    if (!pool_parallel_for(registry->pool, (uint32_t)shards, query_shard, &job)) {
+        total = 0;
+    } else {
+        total = 0;
+        size_t stored = 0;
+        for (size_t i = 0; i < shards; i++) {
+            size_t slice = job.offsets[i + 1] - job.offsets[i];
+            size_t filled = job.totals[i] < slice ? job.totals[i] : slice;
+            if (stored != job.offsets[i]) {
+                memmove(out_ids + stored, out_ids + job.offsets[i], filled * sizeof(int));
+            }
+            stored += filled;
+            total += job.totals[i];
+        }
+    }
+    free(job.offsets);
+    free(job.totals);
+    return total;
+}
+
+typedef struct RegistrySave {
+    DeviceRegistry* registry;
+    const char* path;
+    DeviceShardFormat format;
+    bool on_disk; // Unloaded shards are already stored at path in this format
+    int failures;
+} RegistrySave;
+
+static void save_shard(void* context, uint32_t chunk, size_t worker) {
+    (void)worker;
+    RegistrySave* job = (RegistrySave*)context;
+    if (job->on_disk && !atomic_load_acquire_word(&job->registry->shards[chunk].loaded)) {
+        return;
+    }
+    DeviceManager* shard = shard_get(job->registry, chunk);
+    char* target = shard_path(job->path, chunk, "");
+    char* temp = shard_path(job->path, chunk, REGISTRY_TEMP_SUFFIX);
+    bool saved = shard && target && temp;
+    if (saved) {
+        switch (job->format) {
+        case DEVICE_SHARD_TEXT:
+            saved = device_manager_save(shard, temp);
+            break;
+        case DEVICE_SHARD_BINARY:
+            saved = device_manager_save_binary(shard, temp);
+            break;
+        case DEVICE_SHARD_COMPRESSED:
+            saved = device_manager_save_compressed(shard, temp);
+            break;
+        }
+        saved = saved && file_replace(temp, target);
+    }
+    free(target);
+    free(temp);
+    if (!saved) {
+        atomic_fetch_add_int(&job->failures, 1);
+    }
+}
+
+bool device_registry_save(DeviceRegistry* registry, const char* path, DeviceShardFormat format) {
+    if (!registry || !path || (unsigned)format > DEVICE_SHARD_COMPRESSED) {
+        return false;
+    }
+    bool same_place = registry->source && strcmp(registry->source, path) == 0;
+    RegistrySave job = {registry, path, format, same_place && registry->source_format == format, 0};
+    if (!pool_parallel_for(registry->pool, (uint32_t)registry->shard_count, save_shard, &job) ||
+        atomic_load_int(&job.failures) != 0) {
+        return false;
+    }
+
+    // The manifest goes last, so a reader never finds one naming missing shards. Each
+    // shard is replaced whole, and loads detect its format, so a failure part way
+    // leaves every shard readable, some in the new format and some in the old.
+    char* temp = path_with_suffix(path, REGISTRY_TEMP_SUFFIX);
+    FILE* file = temp ? fopen(temp, "w") : NULL;
+    bool written = file && fprintf(file, "%s %d %zu %d\n", REGISTRY_MAGIC, REGISTRY_VERSION,
+                                   registry->shard_count, (int)format) > 0;
+    written = file && fclose(file) == 0 && written && file_replace(temp, path);
+    free(temp);
+    if (written && same_place) {
+        // Every shard now on disk is in the new format
+        registry->source_format = format;
+    }
+    return written;
+}
+
+DeviceRegistry* device_registry_open(const char* path, size_t threads) {
+    FILE* file = path ? fopen(path, "r") : NULL;
+    if (!file) {
+        return NULL;
+    }
+    char magic[sizeof(REGISTRY_MAGIC)];
+    int version = 0;
+    size_t shard_count = 0;
+    int format = -1;
+    int fields = fscanf(file, "%10s %d %zu %d", magic, &version, &shard_count, &format);
+    fclose(file);
+    if (fields != 4 || strcmp(magic, REGISTRY_MAGIC) != 0 || version != REGISTRY_VERSION ||
+        format < DEVICE_SHARD_TEXT || format > DEVICE_SHARD_COMPRESSED) {
+        return NULL;
+    }
+    DeviceRegistry* registry = registry_create(shard_count, threads);
+    if (!registry) {
+        return NULL;
+    }
+    registry->source = path_with_suffix(path, "");
+    registry->source_format = (DeviceShardFormat)format;
+    if (!registry->source) {
+        device_registry_destroy(registry);
+        return NULL;
+    }
+    return registry;
+}
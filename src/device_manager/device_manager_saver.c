@@ -0,0 +1,258 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "device_manager_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_MSC_VER)
+#include <pthread.h>
+#define DEVICE_SAVER_THREAD 1
+#endif
+
+#define SAVER_TEMP_SUFFIX ".tmp"
+
+// Everyone waiting on one save; requests for a file that is still queued join it
+typedef struct SaveWaiter {
+    DeviceSaveFn on_done;
+    void* udata;
+    struct SaveWaiter* next;
+} SaveWaiter;
+
+typedef struct SaveJob {
+    char* filename;
+    DeviceManager* snapshot; // Newest requested state of the file
+    SaveWaiter* waiters; // Oldest first
+    SaveWaiter** waiters_tail;
+    struct SaveJob* next;
+} SaveJob;
+
+// Saves queue up in request order and are written one at a time by a single
+// background thread, started with the first request
+struct DeviceSaver {
+    SaveJob* queue;
+#if defined(DEVICE_SAVER_THREAD)
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // Work queued or stopping
+    pthread_cond_t idle; // Queue drained with nothing being written
+    bool writing;
+    bool stopping;
+#endif
+};
+
+static void job_free(SaveJob* job) {
+    while (job->waiters) {
+        SaveWaiter* next = job->waiters->next;
+        free(job->waiters);
+        job->waiters = next;
+    }
+    device_manager_destroy(job->snapshot);
+    free(job->filename);
+    free(job);
+}
+
+// Same steps as a journal compaction: write beside the target, sync, rename over it
+static bool save_snapshot(DeviceManager* snapshot, const char* filename) {
+    char* temp = path_with_suffix(filename, SAVER_TEMP_SUFFIX);
+    FILE* file = temp ? fopen(temp, "w") : NULL;
+    bool saved = file && device_manager_write_devices(snapshot, device_manager_file_sink, file,
+                                                      DEVICE_FORMAT_SNAPSHOT) &&
+                 file_sync(file);
+    saved = file && fclose(file) == 0 && saved && file_replace(temp, filename);
+    if (file && !saved) {
+        remove(temp);
+    }
+    free(temp);
+    return saved;
+}
+
+static void job_run(SaveJob* job) {
+    bool saved = save_snapshot(job->snapshot, job->filename);
+    for (const SaveWaiter* waiter = job->waiters; waiter; waiter = waiter->next) {
+        if (waiter->on_done) {
+            waiter->on_done(job->filename, saved, waiter->udata);
+        }
+    }
+    job_free(job);
+}
+
+// Queues the snapshot, or swaps it into a queued save of the same file. Takes
+// ownership of the snapshot either way; false only when out of memory.
+static bool saver_queue(DeviceSaver* saver, const char* filename, DeviceManager* snapshot, DeviceSaveFn on_done,
+                        void* udata) {
+    SaveWaiter* waiter = (SaveWaiter*)malloc(sizeof(SaveWaiter));
+    if (!waiter) {
+        device_manager_destroy(snapshot);
+        return false;
+    }
+    *waiter = (SaveWaiter){on_done, udata, NULL};
+    SaveJob** link = &saver->queue;
+    while (*link && strcmp((*link)->filename, filename) != 0) {
+        link = &(*link)->next;
+    }
+    SaveJob* job = *link;
+    if (job) {
+        DeviceManager* superseded = job->snapshot;
+        job->snapshot = snapshot;
+        snapshot = superseded;
+    } else {
+        job = (SaveJob*)calloc(1, sizeof(SaveJob));
+        char* copy = job ? path_with_suffix(filename, "") : NULL;
+        if (!copy) {
+            free(job);
+            free(waiter);
+            device_manager_destroy(snapshot);
+            return false;
+        }
+        job->filename = copy;
+        job->snapshot = snapshot;
+        job->waiters_tail = &job->waiters;
+        *link = job;
+        snapshot = NULL;
+    }
+    *job->waiters_tail = waiter;
+    job->waiters_tail = &waiter->next;
+    device_manager_destroy(snapshot);
+    return true;
+}
+
+#if defined(DEVICE_SAVER_THREAD)
+
+static void* saver_main(void* arg) {
+    DeviceSaver* saver = (DeviceSaver*)arg;
+    pthread_mutex_lock(&saver->lock);
+    for (;;) {
+        while (!saver->queue && !saver->stopping) {
+            pthread_cond_wait(&saver->wake, &saver->lock);
+        }
+        SaveJob* job = saver->queue;
+        if (!job) {
+            break;
+        }
+        saver->queue = job->next;
+        saver->writing = true;
+        pthread_mutex_unlock(&saver->lock);
+        job_run(job);
+        pthread_mutex_lock(&saver->lock);
+        saver->writing = false;
+        if (!saver->queue) {
+            pthread_cond_broadcast(&saver->idle);
+        }
+    }
+    pthread_mutex_unlock(&saver->lock);
+    return NULL;
+}
+
+static DeviceSaver* saver_create(void) {
+    DeviceSaver* saver = (DeviceSaver*)calloc(1, sizeof(DeviceSaver));
+    if (!saver) {
+        return NULL;
+    }
+    bool locked = pthread_mutex_init(&saver->lock, NULL) == 0;
+    bool woken = locked && pthread_cond_init(&saver->wake, NULL) == 0;
+    bool idled = woken && pthread_cond_init(&saver->idle, NULL) == 0;
+    if (idled && pthread_create(&saver->thread, NULL, saver_main, saver) == 0) {
+        return saver;
+    }
+    if (idled) {
+        pthread_cond_destroy(&saver->idle);
+    }
+    if (woken) {
+        pthread_cond_destroy(&saver->wake);
+    }
+    if (locked) {
+        pthread_mutex_destroy(&saver->lock);
+    }
+    free(saver);
+    return NULL;
+}
+
+static bool saver_submit(DeviceSaver* saver, const char* filename, DeviceManager* snapshot, DeviceSaveFn on_done,
+                         void* udata) {
+    pthread_mutex_lock(&saver->lock);
+    bool queued = saver_queue(saver, filename, snapshot, on_done, udata);
+    pthread_cond_signal(&saver->wake);
+    pthread_mutex_unlock(&saver->lock);
+    return queued;
+}
+
+static void saver_wait(DeviceSaver* saver) {
+    pthread_mutex_lock(&saver->lock);
+    while (saver->queue || saver->writing) {
+        pthread_cond_wait(&saver->idle, &saver->lock);
+    }
+    pthread_mutex_unlock(&saver->lock);
+}
+
+// Queued saves are still written; the thread exits once the queue is empty
+void saver_free(DeviceSaver* saver) {
+    if (!saver) {
+        return;
+    }
+    pthread_mutex_lock(&saver->lock);
+    saver->stopping = true;
+    pthread_cond_signal(&saver->wake);
+    pthread_mutex_unlock(&saver->lock);
+    pthread_join(saver->thread, NULL);
+    pthread_cond_destroy(&saver->idle);
+    pthread_cond_destroy(&saver->wake);
+    pthread_mutex_destroy(&saver->lock);
+    free(saver);
+}
+
+#else
+
+// No threads on this platform: every save is written before the request returns
+static DeviceSaver* saver_create(void) {
+    return (DeviceSaver*)calloc(1, sizeof(DeviceSaver));
+}
+
+static bool saver_submit(DeviceSaver* saver, const char* filename, DeviceManager* snapshot, DeviceSaveFn on_done,
+                         void* udata) {
+    bool queued = saver_queue(saver, filename, snapshot, on_done, udata);
+    if (queued) {
+        SaveJob* job = saver->queue;
+        saver->queue = NULL;
+        job_run(job);
+    }
+    return queued;
+}
+
+static void saver_wait(DeviceSaver* saver) {
+    (void)saver;
+}
+
+void saver_free(DeviceSaver* saver) {
+    free(saver);
+}
+
+#endif
+
+bool device_manager_save_async(DeviceManager* manager, const char* filename, DeviceSaveFn on_done, void* udata) {
+    if (!manager || manager->read_only || !filename) {
+        return false;
+    }
+    // The thread starts with the first request; the manager lock settles racing ones
+    manager_write_lock(manager);
+    if (!manager->saver) {
+        manager->saver = saver_create();
+    }
+    DeviceSaver* saver = manager->saver;
+    manager_write_unlock(manager);
+    DeviceManager* snapshot = saver ? device_manager_snapshot(manager) : NULL;
+    return snapshot && saver_submit(saver, filename, snapshot, on_done, udata);
+}
+
+void device_manager_wait_saves(DeviceManager* manager) {
+    if (!manager) {
+        return;
+    }
+    manager_write_lock(manager);
+    DeviceSaver* saver = manager->saver;
+    manager_write_unlock(manager);
+    if (saver) {
+        saver_wait(saver);
+    }
+}
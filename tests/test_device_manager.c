@@ -1,6 +1,17 @@
+#if !defined(_WIN32)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "unity.h"
 #include "device_manager.h"
+#include <limits.h>
 #include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#endif
 
 
 void setUp(void) {
@@ -435,11 +446,37 @@ void test_device_manager_save_with_null_filename(void)
 }
 void test_device_manager_save_with_null_manager(void)
 {
+    FILE* file = fopen("testfile.txt", "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fputs("1 Kept 0 1 5\n", file);
+    fclose(file);
+
     // Attempt to save with a null manager
     bool result = device_manager_save(NULL, "testfile.txt");
 
-    // Check that the function returns false
+    // Check that the function returns false and leaves the file alone
     TEST_ASSERT_FALSE(result);
+    DeviceManager* loaded = device_manager_load("testfile.txt");
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(1, device_manager_get_device_count(loaded));
+    device_manager_destroy(loaded);
+    remove("testfile.txt");
+}
+
+void test_device_manager_save_reports_write_errors(void)
+{
+#if defined(__linux__)
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_TRUE(device_manager_add_device(manager, "Test Device", DEVICE_LIGHT, 1));
+
+    // Every write to /dev/full fails with ENOSPC
+    TEST_ASSERT_FALSE(device_manager_save(manager, "/dev/full"));
+
+    device_manager_destroy(manager);
+#else
+    TEST_IGNORE_MESSAGE("needs /dev/full");
+#endif
 }
 
 void test_device_manager_save_with_empty_filename(void)
@@ -519,6 +556,2102 @@ void test_device_manager_load_no_valid_entries(void)
 }
 
 
+void test_device_manager_lookup_many_devices(void)
+{
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+
+    // Add enough devices to force the id index to grow several times
+    char name[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(name, sizeof(name), "Device %d", i);
+        TEST_ASSERT_TRUE(device_manager_add_device(manager, name, DEVICE_LIGHT, i));
+        TEST_ASSERT_TRUE(device_manager_set_device_attribute(manager, i, i * 2));
+    }
+    TEST_ASSERT_EQUAL_INT(5000, device_manager_get_device_count(manager));
+
+    // Every device must still be reachable by id
+    for (int i = 0; i < 5000; i++) {
+        TEST_ASSERT_EQUAL_INT(i * 2, device_manager_get_device_attribute(manager, i));
+    }
+
+    // Remove every even device and check the odd ones survive the index compaction
+    for (int i = 0; i < 5000; i += 2) {
+        snprintf(name, sizeof(name), "Device %d", i);
+        TEST_ASSERT_TRUE(device_manager_remove_device(manager, i, name));
+    }
+    TEST_ASSERT_EQUAL_INT(2500, device_manager_get_device_count(manager));
+    for (int i = 0; i < 5000; i++) {
+        TEST_ASSERT_EQUAL(i % 2 != 0, device_manager_set_device_state(manager, i, true));
+    }
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_set_device_state_same_id_targets_newest(void)
+{
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+
+    device_manager_add_device(manager, "Older", DEVICE_LIGHT, 7);
+    device_manager_add_device(manager, "Newer", DEVICE_CAMERA, 7);
+
+    // Id-only calls address the most recently added device, as the list head did
+    TEST_ASSERT_TRUE(device_manager_set_device_state(manager, 7, true));
+    TEST_ASSERT_TRUE(device_manager_get_device_state(manager, 7, "Newer"));
+    TEST_ASSERT_FALSE(device_manager_get_device_state(manager, 7, "Older"));
+
+    // Once the newer one is removed the older one takes over the id
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 7, "Newer"));
+    TEST_ASSERT_TRUE(device_manager_set_device_attribute(manager, 7, 55));
+    TEST_ASSERT_EQUAL_INT(55, device_manager_get_device_attribute(manager, 7));
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 7, "Older"));
+    TEST_ASSERT_FALSE(device_manager_set_device_state(manager, 7, true));
+
+    device_manager_destroy(manager);
+}
+
+
+void test_get_device_id_many_devices(void)
+{
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+
+    char name[32];
+    for (int i = 0; i < 3000; i++) {
+        snprintf(name, sizeof(name), "Sensor-%d", i);
+        TEST_ASSERT_TRUE(device_manager_add_device(manager, name, DEVICE_THERMOSTAT, i + 100));
+    }
+
+    // Every name resolves to its own id, unknown names miss
+    for (int i = 0; i < 3000; i++) {
+        snprintf(name, sizeof(name), "Sensor-%d", i);
+        TEST_ASSERT_EQUAL_INT(i + 100, get_device_id(manager, name));
+        TEST_ASSERT_EQUAL_STRING(name, device_manager_get_device_name(manager, i + 100, name));
+        TEST_ASSERT_NULL(device_manager_get_device_name(manager, i + 101, name));
+    }
+    TEST_ASSERT_EQUAL_INT(-1, get_device_id(manager, "Sensor-3000"));
+
+    // Removed names must disappear from the name index
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 150, "Sensor-50"));
+    TEST_ASSERT_EQUAL_INT(-1, get_device_id(manager, "Sensor-50"));
+    TEST_ASSERT_EQUAL_INT(151, get_device_id(manager, "Sensor-51"));
+
+    device_manager_destroy(manager);
+}
+
+void test_get_device_id_duplicate_names(void)
+{
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+
+    device_manager_add_device(manager, "Lamp", DEVICE_LIGHT, 1);
+    device_manager_add_device(manager, "Lamp", DEVICE_LIGHT, 2);
+
+    // The newest device with the name wins, the older one is still addressable with its id
+    TEST_ASSERT_EQUAL_INT(2, get_device_id(manager, "Lamp"));
+    TEST_ASSERT_EQUAL_STRING("Lamp", device_manager_get_device_name(manager, 1, "Lamp"));
+
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 2, "Lamp"));
+    TEST_ASSERT_EQUAL_INT(1, get_device_id(manager, "Lamp"));
+    TEST_ASSERT_FALSE(device_manager_remove_device(manager, 2, "Lamp"));
+
+    device_manager_destroy(manager);
+}
+
+
+void test_device_manager_add_device_with_invalid_type(void)
+{
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+
+    // Types outside the enum cannot be stored in the packed type column
+    TEST_ASSERT_FALSE(device_manager_add_device(manager, "Bad Type", (DeviceType)42, 1));
+    TEST_ASSERT_EQUAL_INT(0, device_manager_get_device_count(manager));
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_reused_slot_starts_clean(void)
+{
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+
+    device_manager_add_device(manager, "Old Camera", DEVICE_CAMERA, 1);
+    device_manager_set_device_state(manager, 1, true);
+    device_manager_set_device_attribute(manager, 1, 99);
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 1, "Old Camera"));
+
+    // The freed storage is recycled; the new device must not inherit any of the old values
+    TEST_ASSERT_TRUE(device_manager_add_device(manager, "New Light", DEVICE_LIGHT, 2));
+    TEST_ASSERT_FALSE(device_manager_get_device_state(manager, 2, "New Light"));
+    TEST_ASSERT_EQUAL_INT(0, device_manager_get_device_attribute(manager, 2));
+    TEST_ASSERT_EQUAL_INT(DEVICE_LIGHT, device_manager_get_device_type(manager, 2, "New Light"));
+    TEST_ASSERT_NULL(device_manager_get_device_name(manager, 1, "Old Camera"));
+    TEST_ASSERT_EQUAL_INT(1, device_manager_get_device_count(manager));
+
+    device_manager_destroy(manager);
+}
+
+
+void test_device_manager_create_with_arena(void)
+{
+    // Size the caller buffer for exactly one slab worth of devices
+    size_t size = device_manager_arena_size(1);
+    void* buffer = malloc(size);
+    TEST_ASSERT_NOT_NULL(buffer);
+
+    DeviceManager* manager = device_manager_create_with_arena(buffer, size);
+    TEST_ASSERT_NOT_NULL(manager);
+
+    // Fill the arena until it refuses more devices
+    char name[32];
+    int added = 0;
+    while (added < 100000) {
+        snprintf(name, sizeof(name), "Arena %d", added);
+        if (!device_manager_add_device(manager, name, DEVICE_LIGHT, added)) {
+            break;
+        }
+        added++;
+    }
+    TEST_ASSERT_GREATER_THAN(0, added);
+    TEST_ASSERT_LESS_THAN(100000, added);
+    TEST_ASSERT_EQUAL_INT(added, device_manager_get_device_count(manager));
+
+    // Removing a device frees a slot that the next add reuses without growing
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 0, "Arena 0"));
+    TEST_ASSERT_TRUE(device_manager_add_device(manager, "Replacement", DEVICE_CAMERA, 0));
+    TEST_ASSERT_FALSE(device_manager_add_device(manager, "Overflow", DEVICE_CAMERA, added));
+
+    device_manager_destroy(manager);
+    free(buffer);
+}
+
+void test_device_manager_create_with_arena_invalid_buffer(void)
+{
+    TEST_ASSERT_NULL(device_manager_create_with_arena(NULL, 1024));
+    TEST_ASSERT_EQUAL_INT(0, device_manager_arena_size(0));
+}
+
+
+void test_device_manager_apply_batch(void)
+{
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+
+    device_manager_add_device(manager, "Light", DEVICE_LIGHT, 1);
+    device_manager_add_device(manager, "Thermostat", DEVICE_THERMOSTAT, 2);
+
+    // Ops for the same id are applied in submission order, unknown ids are reported
+    DeviceUpdate ops[] = {
+        {2, DEVICE_UPDATE_ATTRIBUTE, 68},
+        {1, DEVICE_UPDATE_STATE, 1},
+        {9, DEVICE_UPDATE_STATE, 1},
+        {2, DEVICE_UPDATE_ATTRIBUTE, 72},
+        {2, DEVICE_UPDATE_STATE, 1},
+    };
+    bool results[5] = {false};
+    size_t applied = device_manager_apply_batch(manager, ops, 5, results);
+
+    TEST_ASSERT_EQUAL_INT(4, applied);
+    TEST_ASSERT_TRUE(results[0]);
+    TEST_ASSERT_TRUE(results[1]);
+    TEST_ASSERT_FALSE(results[2]);
+    TEST_ASSERT_TRUE(results[3]);
+    TEST_ASSERT_TRUE(results[4]);
+    TEST_ASSERT_EQUAL_INT(72, device_manager_get_device_attribute(manager, 2));
+    TEST_ASSERT_TRUE(device_manager_get_device_state(manager, 1, "Light"));
+    TEST_ASSERT_TRUE(device_manager_get_device_state(manager, 2, "Thermostat"));
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_apply_batch_without_results(void)
+{
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+
+    char name[32];
+    DeviceUpdate ops[1000];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "Bulb %d", i);
+        device_manager_add_device(manager, name, DEVICE_LIGHT, i);
+        ops[i].ident = 999 - i;
+        ops[i].kind = DEVICE_UPDATE_ATTRIBUTE;
+        ops[i].value = i;
+    }
+
+    TEST_ASSERT_EQUAL_INT(1000, device_manager_apply_batch(manager, ops, 1000, NULL));
+    TEST_ASSERT_EQUAL_INT(999, device_manager_get_device_attribute(manager, 0));
+    TEST_ASSERT_EQUAL_INT(0, device_manager_get_device_attribute(manager, 999));
+    TEST_ASSERT_EQUAL_INT(0, device_manager_apply_batch(manager, NULL, 3, NULL));
+
+    device_manager_destroy(manager);
+}
+
+
+void test_device_manager_add_devices(void)
+{
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_TRUE(device_manager_add_device(manager, "Existing", DEVICE_LIGHT, 5));
+
+    DeviceSpec specs[] = {
+        {"Porch Light", DEVICE_LIGHT, 1, true, 80},
+        {"Hall Thermostat", DEVICE_THERMOSTAT, 2, false, 70},
+        {"", DEVICE_CAMERA, 3, false, 0},
+        {"Garage Camera", DEVICE_CAMERA, 5, true, 0},
+        {"Porch Light 2", DEVICE_LIGHT, 1, false, 10},
+    };
+    DeviceAddResult results[5];
+    size_t added = device_manager_add_devices(manager, specs, 5, results);
+
+    // Invalid specs are skipped, ids already present (in the manager or the batch) are flagged
+    TEST_ASSERT_EQUAL_INT(4, added);
+    TEST_ASSERT_EQUAL_INT(DEVICE_ADD_OK, results[0]);
+    TEST_ASSERT_EQUAL_INT(DEVICE_ADD_OK, results[1]);
+    TEST_ASSERT_EQUAL_INT(DEVICE_ADD_INVALID, results[2]);
+    TEST_ASSERT_EQUAL_INT(DEVICE_ADD_DUPLICATE_ID, results[3]);
+    TEST_ASSERT_EQUAL_INT(DEVICE_ADD_DUPLICATE_ID, results[4]);
+    TEST_ASSERT_EQUAL_INT(5, device_manager_get_device_count(manager));
+
+    // State and attribute come straight from the spec
+    TEST_ASSERT_TRUE(device_manager_get_device_state(manager, 1, "Porch Light"));
+    TEST_ASSERT_EQUAL_INT(70, device_manager_get_device_attribute(manager, 2));
+    TEST_ASSERT_EQUAL_INT(10, device_manager_get_device_attribute(manager, 1));
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_reserve_then_add(void)
+{
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_TRUE(device_manager_reserve(manager, 10000));
+
+    char name[32];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "Reserved %d", i);
+        TEST_ASSERT_TRUE(device_manager_add_device(manager, name, DEVICE_THERMOSTAT, i));
+    }
+    TEST_ASSERT_EQUAL_INT(10000, device_manager_get_device_count(manager));
+    TEST_ASSERT_EQUAL_INT(9999, get_device_id(manager, "Reserved 9999"));
+
+    // Reserving less than what is stored is a no-op
+    TEST_ASSERT_TRUE(device_manager_reserve(manager, 10));
+    TEST_ASSERT_FALSE(device_manager_reserve(NULL, 10));
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_save_and_load_round_trip(void)
+{
+    const char* filename = "test_round_trip.txt";
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+
+    char name[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(name, sizeof(name), "Device_%d", i);
+        device_manager_add_device(manager, name, (DeviceType)(i % 3), i);
+        device_manager_set_device_state(manager, i, i % 2 == 0);
+        device_manager_set_device_attribute(manager, i, i * 3);
+    }
+    TEST_ASSERT_TRUE(device_manager_save(manager, filename));
+    device_manager_destroy(manager);
+
+    // The loader inserts in chunks; every record must come back with its state and attribute
+    manager = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_EQUAL_INT(5000, device_manager_get_device_count(manager));
+    for (int i = 0; i < 5000; i++) {
+        snprintf(name, sizeof(name), "Device_%d", i);
+        TEST_ASSERT_EQUAL_INT(i % 3, device_manager_get_device_type(manager, i, name));
+        TEST_ASSERT_EQUAL(i % 2 == 0, device_manager_get_device_state(manager, i, name));
+        TEST_ASSERT_EQUAL_INT(i * 3, device_manager_get_device_attribute(manager, i));
+    }
+
+    device_manager_destroy(manager);
+    remove(filename);
+}
+
+
+typedef struct LoadErrors {
+    size_t lines[8];
+    size_t count;
+} LoadErrors;
+
+static void collect_load_error(size_t line, const char* message, void* udata)
+{
+    LoadErrors* errors = (LoadErrors*)udata;
+    TEST_ASSERT_NOT_NULL(message);
+    if (errors->count < 8) {
+        errors->lines[errors->count] = line;
+    }
+    errors->count++;
+}
+
+void test_device_manager_load_parallel(void)
+{
+    // Large enough to be split across several chunks, with bad lines scattered through it
+    const char* filename = "test_load_parallel.txt";
+    FILE* file = fopen(filename, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    static const char* const bad[] = {"12 name-only", "-1 negative 0 0 0", "x bad-id 0 0 0", "13 bad-type 9 0 0",
+                                      "14 bad-state 0 2 5", "15 trailing 0 1 5 extra"};
+    size_t expected_lines[6];
+    size_t line = 0;
+    int good = 0;
+    for (int i = 0; i < 60000; i++) {
+        if (i % 10007 == 5000) {
+            size_t which = (size_t)(i / 10007);
+            fprintf(file, "%s\n", bad[which]);
+            expected_lines[which] = ++line;
+        }
+        if (i == 30000) {
+            fprintf(file, "\n  \r\n");
+            line += 2;
+        }
+        fprintf(file, i % 2 ? "%d Device_%d %d %d %d\r\n" : "%d\tDevice_%d  %d %d %d\n", i, i, i % 3, i % 2, -i);
+        line++;
+        good++;
+    }
+    fprintf(file, "60000 last 2 1 42");
+    fclose(file);
+
+    LoadErrors errors = {{0}, 0};
+    DeviceManager* manager = device_manager_load_parallel(filename, 4, collect_load_error, &errors);
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_EQUAL_INT(good + 1, device_manager_get_device_count(manager));
+    TEST_ASSERT_EQUAL_size_t(6, errors.count);
+    for (size_t i = 0; i < 6; i++) {
+        TEST_ASSERT_EQUAL_size_t(expected_lines[i], errors.lines[i]);
+    }
+    char name[32];
+    for (int i = 0; i < 60000; i += 997) {
+        snprintf(name, sizeof(name), "Device_%d", i);
+        TEST_ASSERT_EQUAL_INT(i % 3, device_manager_get_device_type(manager, i, name));
+        TEST_ASSERT_EQUAL(i % 2 == 1, device_manager_get_device_state(manager, i, name));
+        TEST_ASSERT_EQUAL_INT(-i, device_manager_get_device_attribute(manager, i));
+    }
+    TEST_ASSERT_EQUAL_INT(42, device_manager_get_device_attribute(manager, 60000));
+    TEST_ASSERT_EQUAL_STRING("last", device_manager_get_device_name(manager, 60000, "last"));
+
+    // One thread reads the same file the same way
+    DeviceManager* serial = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(serial);
+    TEST_ASSERT_EQUAL_INT(good + 1, device_manager_get_device_count(serial));
+    device_manager_destroy(serial);
+    device_manager_destroy(manager);
+
+    // Empty and missing files
+    file = fopen(filename, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fclose(file);
+    manager = device_manager_load_parallel(filename, 0, NULL, NULL);
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_EQUAL_INT(0, device_manager_get_device_count(manager));
+    device_manager_destroy(manager);
+    remove(filename);
+    TEST_ASSERT_NULL(device_manager_load_parallel(filename, 2, NULL, NULL));
+}
+
+typedef struct SaveResults {
+    int saved;
+    int failed;
+} SaveResults;
+
+static void count_save(const char* filename, bool saved, void* udata)
+{
+    TEST_ASSERT_NOT_NULL(filename);
+    SaveResults* results = (SaveResults*)udata;
+    if (saved) {
+        results->saved++;
+    } else {
+        results->failed++;
+    }
+}
+
+void test_device_manager_save_async(void)
+{
+    const char* filename = "test_save_async.txt";
+    DeviceManager* manager = device_manager_create();
+    device_manager_add_device(manager, "Lamp", DEVICE_LIGHT, 1);
+    device_manager_set_device_attribute(manager, 1, 10);
+
+    // The file holds the state as of the request, not of the write
+    SaveResults results = {0, 0};
+    TEST_ASSERT_TRUE(device_manager_save_async(manager, filename, count_save, &results));
+    device_manager_set_device_attribute(manager, 1, 20);
+    device_manager_add_device(manager, "Fan", DEVICE_THERMOSTAT, 2);
+    device_manager_wait_saves(manager);
+    TEST_ASSERT_EQUAL_INT(1, results.saved);
+    DeviceManager* loaded = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(1, device_manager_get_device_count(loaded));
+    TEST_ASSERT_EQUAL_INT(10, device_manager_get_device_attribute(loaded, 1));
+    device_manager_destroy(loaded);
+
+    // Failures are reported, and snapshots cannot be saved this way
+    TEST_ASSERT_TRUE(device_manager_save_async(manager, "no_such_dir/devices.txt", count_save, &results));
+    device_manager_wait_saves(manager);
+    TEST_ASSERT_EQUAL_INT(1, results.failed);
+    DeviceManager* snapshot = device_manager_snapshot(manager);
+    TEST_ASSERT_FALSE(device_manager_save_async(snapshot, filename, NULL, NULL));
+    device_manager_destroy(snapshot);
+    TEST_ASSERT_FALSE(device_manager_save_async(NULL, filename, NULL, NULL));
+    TEST_ASSERT_FALSE(device_manager_save_async(manager, NULL, NULL, NULL));
+
+    // A queued save is written before the manager goes away
+    TEST_ASSERT_TRUE(device_manager_save_async(manager, filename, NULL, NULL));
+    device_manager_destroy(manager);
+    loaded = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(2, device_manager_get_device_count(loaded));
+    TEST_ASSERT_EQUAL_INT(20, device_manager_get_device_attribute(loaded, 1));
+    device_manager_destroy(loaded);
+    remove(filename);
+}
+
+void test_device_manager_binary_round_trip(void)
+{
+    const char* filename = "test_round_trip.bin";
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+
+    char name[32];
+    for (int i = 0; i < 3000; i++) {
+        snprintf(name, sizeof(name), "Binary %d", i);
+        device_manager_add_device(manager, name, (DeviceType)(i % 3), i);
+        device_manager_set_device_state(manager, i, i % 5 == 0);
+        device_manager_set_device_attribute(manager, i, -i);
+    }
+    // Leave holes behind; the free list is stored, and so is a snapshot's
+    device_manager_remove_device(manager, 10, "Binary 10");
+    device_manager_remove_device(manager, 20, "Binary 20");
+    DeviceManager* snapshot = device_manager_snapshot(manager);
+    TEST_ASSERT_TRUE(device_manager_save_binary(snapshot, filename));
+    device_manager_destroy(snapshot);
+    device_manager_destroy(manager);
+    manager = device_manager_load_binary(filename);
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_TRUE(device_manager_save_binary(manager, filename));
+    device_manager_destroy(manager);
+
+    manager = device_manager_load_binary(filename);
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_EQUAL_INT(2998, device_manager_get_device_count(manager));
+    TEST_ASSERT_NULL(device_manager_get_device_name(manager, 10, "Binary 10"));
+    TEST_ASSERT_EQUAL_INT(2999, get_device_id(manager, "Binary 2999"));
+    TEST_ASSERT_TRUE(device_manager_get_device_state(manager, 15, "Binary 15"));
+    TEST_ASSERT_EQUAL_INT(DEVICE_CAMERA, device_manager_get_device_type(manager, 2, "Binary 2"));
+    TEST_ASSERT_EQUAL_INT(-1234, device_manager_get_device_attribute(manager, 1234));
+
+    // The mapped storage stays writable, reuses the holes first and can grow past the snapshot
+    TEST_ASSERT_TRUE(device_manager_set_device_attribute(manager, 1234, 7));
+    TEST_ASSERT_EQUAL_INT(7, device_manager_get_device_attribute(manager, 1234));
+    DeviceHandle first;
+    DeviceHandle second;
+    TEST_ASSERT_TRUE(device_manager_add_device_with_handle(manager, "Binary 10", DEVICE_LIGHT, 10, &first));
+    TEST_ASSERT_TRUE(device_manager_add_device_with_handle(manager, "Binary 20", DEVICE_LIGHT, 20, &second));
+    TEST_ASSERT_EQUAL_UINT(30, first.slot + second.slot);
+    TEST_ASSERT_TRUE(first.slot == 10 || first.slot == 20);
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 10, "Binary 10"));
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 20, "Binary 20"));
+    for (int i = 3000; i < 5000; i++) {
+        snprintf(name, sizeof(name), "Binary %d", i);
+        TEST_ASSERT_TRUE(device_manager_add_device(manager, name, DEVICE_LIGHT, i));
+    }
+    TEST_ASSERT_EQUAL_INT(4998, device_manager_get_device_count(manager));
+
+    // Saving over the file the manager is still mapped from leaves the mapping intact
+    TEST_ASSERT_TRUE(device_manager_set_device_attribute(manager, 2999, 42));
+    TEST_ASSERT_TRUE(device_manager_save_binary(manager, filename));
+    TEST_ASSERT_EQUAL_INT(42, device_manager_get_device_attribute(manager, 2999));
+    TEST_ASSERT_EQUAL_INT(7, device_manager_get_device_attribute(manager, 1234));
+    device_manager_destroy(manager);
+    manager = device_manager_load_binary(filename);
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_EQUAL_INT(4998, device_manager_get_device_count(manager));
+    TEST_ASSERT_EQUAL_INT(42, device_manager_get_device_attribute(manager, 2999));
+    TEST_ASSERT_EQUAL_INT(1, get_device_id(manager, "Binary 1"));
+
+    device_manager_destroy(manager);
+    remove(filename);
+}
+
+void test_device_manager_binary_rejects_bad_files(void)
+{
+    const char* filename = "test_bad_snapshot.bin";
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+    device_manager_add_device(manager, "Checksummed", DEVICE_LIGHT, 1);
+    TEST_ASSERT_TRUE(device_manager_save_binary(manager, filename));
+    device_manager_destroy(manager);
+
+    // Flip one byte of the device data
+    FILE* file = fopen(filename, "r+b");
+    TEST_ASSERT_NOT_NULL(file);
+    fseek(file, 100, SEEK_SET);
+    int byte = fgetc(file);
+    fseek(file, 100, SEEK_SET);
+    fputc(byte ^ 0xff, file);
+    fclose(file);
+    TEST_ASSERT_NULL(device_manager_load_binary(filename));
+
+    // Text snapshots and missing files are not binary snapshots
+    file = fopen(filename, "w");
+    TEST_ASSERT_NOT_NULL(file);
+    fprintf(file, "1 Lamp 0 1 50\n");
+    fclose(file);
+    TEST_ASSERT_NULL(device_manager_load_binary(filename));
+    TEST_ASSERT_NULL(device_manager_load_binary("non_existent_file.bin"));
+    TEST_ASSERT_FALSE(device_manager_save_binary(NULL, filename));
+
+    remove(filename);
+}
+
+static long file_size(const char* filename)
+{
+    FILE* file = fopen(filename, "rb");
+    TEST_ASSERT_NOT_NULL(file);
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+void test_device_manager_compressed_round_trip(void)
+{
+    const char* filename = "test_compressed.dmz";
+    const char* text_filename = "test_compressed.txt";
+    DeviceManager* manager = device_manager_create();
+    char name[DEVICE_NAME_MAX];
+    // Added out of id order, with gaps and every kind of attribute
+    for (int i = 9999; i >= 0; i--) {
+        snprintf(name, sizeof(name), "sensor-%05d", i);
+        device_manager_add_device(manager, name, (DeviceType)(i % 3), i * 3);
+        device_manager_set_device_state(manager, i * 3, i % 5 == 0);
+        device_manager_set_device_attribute(manager, i * 3, i % 2 ? -i : i * 1000);
+    }
+    device_manager_set_device_attribute(manager, 0, INT_MIN);
+    device_manager_set_device_attribute(manager, 3, INT_MAX);
+    char long_name[DEVICE_NAME_MAX];
+    memset(long_name, 'z', sizeof(long_name) - 1);
+    long_name[sizeof(long_name) - 1] = '\0';
+    device_manager_add_device(manager, long_name, DEVICE_CAMERA, INT_MAX);
+    // Of two devices with one id, the newer must still be found first after loading
+    device_manager_add_device(manager, "older", DEVICE_LIGHT, 30001);
+    device_manager_add_device(manager, "newer", DEVICE_CAMERA, 30001);
+    device_manager_set_device_attribute(manager, 30001, 7);
+    TEST_ASSERT_TRUE(device_manager_save_compressed(manager, filename));
+    TEST_ASSERT_TRUE(device_manager_save(manager, text_filename));
+    TEST_ASSERT_TRUE(file_size(filename) * 3 < file_size(text_filename));
+    device_manager_destroy(manager);
+
+    manager = device_manager_load_compressed(filename);
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_EQUAL_INT(10003, device_manager_get_device_count(manager));
+    for (int i = 0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "sensor-%05d", i);
+        TEST_ASSERT_EQUAL_INT(i % 3, device_manager_get_device_type(manager, i * 3, name));
+        TEST_ASSERT_EQUAL(i % 5 == 0, device_manager_get_device_state(manager, i * 3, name));
+        if (i > 1) {
+            TEST_ASSERT_EQUAL_INT(i % 2 ? -i : i * 1000, device_manager_get_device_attribute(manager, i * 3));
+        }
+    }
+    TEST_ASSERT_EQUAL_INT(INT_MIN, device_manager_get_device_attribute(manager, 0));
+    TEST_ASSERT_EQUAL_INT(INT_MAX, device_manager_get_device_attribute(manager, 3));
+    TEST_ASSERT_EQUAL_INT(DEVICE_CAMERA, device_manager_get_device_type(manager, INT_MAX, long_name));
+    TEST_ASSERT_EQUAL_INT(7, device_manager_get_device_attribute(manager, 30001));
+    TEST_ASSERT_EQUAL_INT(DEVICE_LIGHT, device_manager_get_device_type(manager, 30001, "older"));
+    device_manager_destroy(manager);
+
+    // Damage anywhere is caught, and other formats are not mistaken for this one
+    FILE* file = fopen(filename, "r+b");
+    TEST_ASSERT_NOT_NULL(file);
+    fseek(file, 1000, SEEK_SET);
+    int byte = fgetc(file);
+    fseek(file, 1000, SEEK_SET);
+    fputc(byte ^ 0x10, file);
+    fclose(file);
+    TEST_ASSERT_NULL(device_manager_load_compressed(filename));
+    TEST_ASSERT_NULL(device_manager_load_compressed(text_filename));
+    TEST_ASSERT_NULL(device_manager_load_compressed("non_existent_file.dmz"));
+
+#if !defined(_WIN32)
+    // A save that cannot finish leaves the previous snapshot in place; a directory
+    // in the way of the temp file makes it fail before anything is written
+    manager = device_manager_create();
+    device_manager_add_device(manager, "kept", DEVICE_LIGHT, 1);
+    TEST_ASSERT_TRUE(device_manager_save_compressed(manager, filename));
+    long saved_size = file_size(filename);
+    char temp[64];
+    snprintf(temp, sizeof(temp), "%s.tmp", filename);
+    TEST_ASSERT_EQUAL_INT(0, mkdir(temp, 0700));
+    device_manager_add_device(manager, "lost", DEVICE_LIGHT, 2);
+    TEST_ASSERT_FALSE(device_manager_save_compressed(manager, filename));
+    remove(temp);
+    device_manager_destroy(manager);
+    TEST_ASSERT_EQUAL(saved_size, file_size(filename));
+    manager = device_manager_load_compressed(filename);
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_EQUAL_INT(1, device_manager_get_device_count(manager));
+    device_manager_destroy(manager);
+#endif
+
+    // An empty manager round-trips too
+    manager = device_manager_create();
+    TEST_ASSERT_TRUE(device_manager_save_compressed(manager, filename));
+    device_manager_destroy(manager);
+    manager = device_manager_load_compressed(filename);
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_EQUAL_INT(0, device_manager_get_device_count(manager));
+    device_manager_destroy(manager);
+
+    remove(filename);
+    remove(text_filename);
+}
+
+void test_device_manager_snapshots_keep_duplicate_order(void)
+{
+    // Freed slots are reused, so the newer of each pair sits in the lower slot
+    DeviceManager* manager = device_manager_create();
+    device_manager_add_device(manager, "x", DEVICE_LIGHT, 5);
+    device_manager_add_device(manager, "y", DEVICE_LIGHT, 6);
+    device_manager_add_device(manager, "old", DEVICE_LIGHT, 9);
+    device_manager_set_device_attribute(manager, 9, 111);
+    device_manager_add_device(manager, "dup", DEVICE_CAMERA, 7);
+    device_manager_remove_device(manager, 5, "x");
+    device_manager_remove_device(manager, 6, "y");
+    device_manager_add_device(manager, "new", DEVICE_LIGHT, 9);
+    device_manager_set_device_attribute(manager, 9, 222);
+    device_manager_add_device(manager, "dup", DEVICE_CAMERA, 8);
+    TEST_ASSERT_EQUAL_INT(222, device_manager_get_device_attribute(manager, 9));
+    TEST_ASSERT_EQUAL_INT(8, get_device_id(manager, "dup"));
+
+    TEST_ASSERT_TRUE(device_manager_save(manager, "test_duplicates.txt"));
+    TEST_ASSERT_TRUE(device_manager_save_binary(manager, "test_duplicates.bin"));
+    TEST_ASSERT_TRUE(device_manager_save_compressed(manager, "test_duplicates.dmz"));
+    device_manager_destroy(manager);
+
+    DeviceManager* loaded[3] = {device_manager_load("test_duplicates.txt"),
+                                device_manager_load_binary("test_duplicates.bin"),
+                                device_manager_load_compressed("test_duplicates.dmz")};
+    for (int i = 0; i < 3; i++) {
+        TEST_ASSERT_NOT_NULL(loaded[i]);
+        TEST_ASSERT_EQUAL_INT(4, device_manager_get_device_count(loaded[i]));
+        TEST_ASSERT_EQUAL_INT(222, device_manager_get_device_attribute(loaded[i], 9));
+        TEST_ASSERT_TRUE(device_manager_remove_device(loaded[i], 9, "new"));
+        TEST_ASSERT_EQUAL_INT(111, device_manager_get_device_attribute(loaded[i], 9));
+    }
+    // Only the compressed format sorts by id, which may reorder devices sharing a name
+    TEST_ASSERT_EQUAL_INT(8, get_device_id(loaded[0], "dup"));
+    TEST_ASSERT_EQUAL_INT(8, get_device_id(loaded[1], "dup"));
+    for (int i = 0; i < 3; i++) {
+        device_manager_destroy(loaded[i]);
+    }
+
+    remove("test_duplicates.txt");
+    remove("test_duplicates.bin");
+    remove("test_duplicates.dmz");
+}
+
+void test_device_manager_binary_empty_manager(void)
+{
+    const char* filename = "test_empty_snapshot.bin";
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_TRUE(device_manager_save_binary(manager, filename));
+    device_manager_destroy(manager);
+
+    manager = device_manager_load_binary(filename);
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_EQUAL_INT(0, device_manager_get_device_count(manager));
+    TEST_ASSERT_TRUE(device_manager_add_device(manager, "First", DEVICE_LIGHT, 1));
+
+    device_manager_destroy(manager);
+    remove(filename);
+}
+
+
+static long read_file(const char* path, char* buffer, long capacity)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return -1;
+    }
+    long size = (long)fread(buffer, 1, (size_t)capacity, file);
+    fclose(file);
+    return size;
+}
+
+static void write_file(const char* path, const char* data, long size)
+{
+    FILE* file = fopen(path, "wb");
+    if (file) {
+        fwrite(data, 1, (size_t)size, file);
+        fclose(file);
+    }
+}
+
+void test_device_manager_journal_replay(void)
+{
+    const char* filename = "test_journal.txt";
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+    device_manager_add_device(manager, "Snapshot_Light", DEVICE_LIGHT, 1);
+    TEST_ASSERT_TRUE(device_manager_enable_journal(manager, filename, 4, 0));
+
+    // Changes after enabling only reach the log, not the snapshot
+    device_manager_add_device(manager, "Journal_Camera", DEVICE_CAMERA, 2);
+    device_manager_add_device(manager, "Journal_Thermostat", DEVICE_THERMOSTAT, 3);
+    device_manager_set_device_state(manager, 1, true);
+    device_manager_set_device_attribute(manager, 3, 68);
+    device_manager_remove_device(manager, 2, "Journal_Camera");
+    TEST_ASSERT_TRUE(device_manager_journal_sync(manager));
+
+    // Loading while the writer is still alive is what a restart after a crash sees
+    DeviceManager* loaded = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(2, device_manager_get_device_count(loaded));
+    TEST_ASSERT_TRUE(device_manager_get_device_state(loaded, 1, "Snapshot_Light"));
+    TEST_ASSERT_EQUAL_INT(68, device_manager_get_device_attribute(loaded, 3));
+    TEST_ASSERT_NULL(device_manager_get_device_name(loaded, 2, "Journal_Camera"));
+    device_manager_destroy(loaded);
+
+    // Compaction folds the log into the snapshot and the result is unchanged
+    TEST_ASSERT_TRUE(device_manager_journal_compact(manager));
+    device_manager_set_device_attribute(manager, 1, 5);
+    device_manager_destroy(manager);
+
+    loaded = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(2, device_manager_get_device_count(loaded));
+    TEST_ASSERT_EQUAL_INT(5, device_manager_get_device_attribute(loaded, 1));
+    TEST_ASSERT_EQUAL_INT(68, device_manager_get_device_attribute(loaded, 3));
+    device_manager_destroy(loaded);
+
+    remove(filename);
+    remove("test_journal.txt.wal");
+}
+
+void test_device_manager_journal_shadowed_ids(void)
+{
+    const char* filename = "test_journal_shadowed.txt";
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_TRUE(device_manager_enable_journal(manager, filename, 1, 0));
+    DeviceHandle old = DEVICE_HANDLE_NULL;
+    TEST_ASSERT_TRUE(device_manager_add_device_with_handle(manager, "old", DEVICE_CAMERA, 9, &old));
+    device_manager_set_device_attribute(manager, 9, 500);
+    device_manager_add_device(manager, "new", DEVICE_LIGHT, 9);
+
+    // Changes reaching the older device by handle or by filter must not replay onto the newer
+    TEST_ASSERT_TRUE(device_manager_set_attribute_by_handle(manager, old, 77));
+    DeviceOp on = {DEVICE_OP_SET_STATE, 1, 0, 0, NULL, NULL};
+    DeviceFilter cameras = {DEVICE_TYPE_BIT(DEVICE_CAMERA), DEVICE_STATE_ANY, false, 0, 0};
+    TEST_ASSERT_EQUAL_size_t(1, device_manager_apply_parallel(manager, &cameras, &on));
+    device_manager_set_device_attribute(manager, 9, 5);
+    TEST_ASSERT_TRUE(device_manager_journal_sync(manager));
+
+    DeviceManager* loaded = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(5, device_manager_get_device_attribute(loaded, 9));
+    TEST_ASSERT_FALSE(device_manager_get_device_state(loaded, 9, "new"));
+    TEST_ASSERT_TRUE(device_manager_get_device_state(loaded, 9, "old"));
+    device_manager_remove_device(loaded, 9, "new");
+    TEST_ASSERT_EQUAL_INT(77, device_manager_get_device_attribute(loaded, 9));
+    device_manager_destroy(loaded);
+
+    device_manager_destroy(manager);
+    remove(filename);
+    remove("test_journal_shadowed.txt.wal");
+}
+
+void test_device_manager_journal_ignores_stale_and_torn_logs(void)
+{
+    const char* filename = "test_journal_stale.txt";
+    const char* journal = "test_journal_stale.txt.wal";
+    static char old_log[4096];
+    static char log[4096];
+
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_TRUE(device_manager_enable_journal(manager, filename, 1, 0));
+    device_manager_add_device(manager, "Once", DEVICE_LIGHT, 1);
+    long old_size = read_file(journal, old_log, sizeof(old_log));
+    TEST_ASSERT_GREATER_THAN(0, old_size);
+
+    // Simulate a crash after the new snapshot landed but before the log was reset
+    TEST_ASSERT_TRUE(device_manager_journal_compact(manager));
+    write_file(journal, old_log, old_size);
+    DeviceManager* loaded = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(1, device_manager_get_device_count(loaded));
+    device_manager_destroy(loaded);
+
+    // A torn record at the tail is dropped, the records before it still apply
+    TEST_ASSERT_TRUE(device_manager_journal_compact(manager));
+    device_manager_set_device_attribute(manager, 1, 42);
+    device_manager_set_device_attribute(manager, 1, 43);
+    long size = read_file(journal, log, sizeof(log));
+    write_file(journal, log, size - 3);
+    loaded = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(42, device_manager_get_device_attribute(loaded, 1));
+    device_manager_destroy(loaded);
+
+    TEST_ASSERT_FALSE(device_manager_enable_journal(manager, filename, 1, 0));
+    device_manager_destroy(manager);
+    remove(filename);
+    remove(journal);
+}
+
+void test_device_manager_journal_auto_compaction(void)
+{
+    const char* filename = "test_journal_compact.txt";
+    DeviceManager* manager = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_TRUE(device_manager_enable_journal(manager, filename, 8, 16));
+
+    char name[32];
+    for (int i = 0; i < 100; i++) {
+        snprintf(name, sizeof(name), "Compact_%d", i);
+        device_manager_add_device(manager, name, DEVICE_LIGHT, i);
+    }
+    device_manager_disable_journal(manager);
+    TEST_ASSERT_FALSE(device_manager_journal_sync(manager));
+
+    DeviceManager* loaded = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(100, device_manager_get_device_count(loaded));
+    device_manager_destroy(loaded);
+
+    device_manager_destroy(manager);
+    remove(filename);
+    remove("test_journal_compact.txt.wal");
+}
+
+
+void test_device_manager_attribute_fetch_add(void)
+{
+    DeviceManager* manager = device_manager_create();
+    device_manager_add_device(manager, "Thermostat", DEVICE_THERMOSTAT, 1);
+    device_manager_set_device_attribute(manager, 1, 20);
+
+    int previous = 0;
+    TEST_ASSERT_TRUE(device_manager_attribute_fetch_add(manager, 1, 5, &previous));
+    TEST_ASSERT_EQUAL_INT(20, previous);
+    TEST_ASSERT_TRUE(device_manager_attribute_fetch_add(manager, 1, -3, NULL));
+    TEST_ASSERT_EQUAL_INT(22, device_manager_get_device_attribute(manager, 1));
+    TEST_ASSERT_FALSE(device_manager_attribute_fetch_add(manager, 2, 1, &previous));
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_attribute_compare_exchange(void)
+{
+    DeviceManager* manager = device_manager_create();
+    device_manager_add_device(manager, "Camera", DEVICE_CAMERA, 1);
+    device_manager_set_device_attribute(manager, 1, 7);
+
+    int expected = 7;
+    TEST_ASSERT_TRUE(device_manager_attribute_compare_exchange(manager, 1, &expected, 9));
+    TEST_ASSERT_EQUAL_INT(9, device_manager_get_device_attribute(manager, 1));
+
+    // A stale expectation fails and reports the current value
+    expected = 7;
+    TEST_ASSERT_FALSE(device_manager_attribute_compare_exchange(manager, 1, &expected, 11));
+    TEST_ASSERT_EQUAL_INT(9, expected);
+    TEST_ASSERT_EQUAL_INT(9, device_manager_get_device_attribute(manager, 1));
+
+    // A missing device leaves the expectation untouched
+    expected = 9;
+    TEST_ASSERT_FALSE(device_manager_attribute_compare_exchange(manager, 2, &expected, 11));
+    TEST_ASSERT_EQUAL_INT(9, expected);
+    TEST_ASSERT_FALSE(device_manager_attribute_compare_exchange(manager, 1, NULL, 11));
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_handles(void)
+{
+    DeviceManager* manager = device_manager_create();
+    DeviceHandle light = DEVICE_HANDLE_NULL;
+    TEST_ASSERT_TRUE(device_manager_add_device_with_handle(manager, "Light", DEVICE_LIGHT, 1, &light));
+    device_manager_add_device(manager, "Camera", DEVICE_CAMERA, 2);
+    DeviceHandle camera = device_manager_lookup(manager, 2);
+    TEST_ASSERT_TRUE(device_manager_handle_valid(manager, light));
+    TEST_ASSERT_TRUE(device_manager_handle_valid(manager, camera));
+
+    TEST_ASSERT_TRUE(device_manager_set_state_by_handle(manager, light, true));
+    TEST_ASSERT_TRUE(device_manager_set_attribute_by_handle(manager, camera, 30));
+    bool state = false;
+    int attribute = 0;
+    TEST_ASSERT_TRUE(device_manager_get_state_by_handle(manager, light, &state));
+    TEST_ASSERT_TRUE(state);
+    TEST_ASSERT_TRUE(device_manager_get_attribute_by_handle(manager, camera, &attribute));
+    TEST_ASSERT_EQUAL_INT(30, attribute);
+    // Handle and id calls see the same device
+    TEST_ASSERT_TRUE(device_manager_get_device_state(manager, 1, "Light"));
+    TEST_ASSERT_EQUAL_INT(30, device_manager_get_device_attribute(manager, 2));
+
+    TEST_ASSERT_FALSE(device_manager_handle_valid(manager, device_manager_lookup(manager, 3)));
+    TEST_ASSERT_FALSE(device_manager_handle_valid(manager, DEVICE_HANDLE_NULL));
+    TEST_ASSERT_FALSE(device_manager_add_device_with_handle(manager, NULL, DEVICE_LIGHT, 3, &light));
+    TEST_ASSERT_FALSE(device_manager_handle_valid(manager, light));
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_stale_handle_after_remove(void)
+{
+    DeviceManager* manager = device_manager_create();
+    device_manager_add_device(manager, "Light", DEVICE_LIGHT, 1);
+    DeviceHandle stale = device_manager_lookup(manager, 1);
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 1, "Light"));
+    TEST_ASSERT_FALSE(device_manager_handle_valid(manager, stale));
+
+    // The freed slot is reused, but the old handle must not reach the new device
+    DeviceHandle fresh = DEVICE_HANDLE_NULL;
+    TEST_ASSERT_TRUE(device_manager_add_device_with_handle(manager, "Thermostat", DEVICE_THERMOSTAT, 1, &fresh));
+    TEST_ASSERT_FALSE(device_manager_handle_valid(manager, stale));
+    TEST_ASSERT_FALSE(device_manager_set_attribute_by_handle(manager, stale, 99));
+    int attribute = -1;
+    TEST_ASSERT_FALSE(device_manager_get_attribute_by_handle(manager, stale, &attribute));
+    TEST_ASSERT_EQUAL_INT(-1, attribute);
+    TEST_ASSERT_TRUE(device_manager_handle_valid(manager, fresh));
+    TEST_ASSERT_EQUAL_INT(0, device_manager_get_device_attribute(manager, 1));
+
+    device_manager_destroy(manager);
+}
+
+static DeviceManager* make_query_fleet(void)
+{
+    DeviceManager* manager = device_manager_create();
+    char name[32];
+    // Spans several bitset words: type cycles by id, every third device is ON
+    for (int i = 0; i < 300; i++) {
+        snprintf(name, sizeof(name), "device-%d", i);
+        device_manager_add_device(manager, name, (DeviceType)(i % 3), i);
+        device_manager_set_device_state(manager, i, i % 3 == 2);
+        device_manager_set_device_attribute(manager, i, i % 100);
+    }
+    return manager;
+}
+
+void test_device_manager_query_by_type_and_state(void)
+{
+    DeviceManager* manager = make_query_fleet();
+    int ids[300];
+
+    DeviceFilter cameras_on = {DEVICE_TYPE_BIT(DEVICE_CAMERA), DEVICE_STATE_ON, false, 0, 0};
+    TEST_ASSERT_EQUAL_size_t(100, device_manager_query(manager, &cameras_on, ids, 300));
+    for (int i = 0; i < 100; i++) {
+        TEST_ASSERT_EQUAL_INT(i * 3 + 2, ids[i]);
+    }
+    DeviceFilter lights_on = {DEVICE_TYPE_BIT(DEVICE_LIGHT), DEVICE_STATE_ON, false, 0, 0};
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_query(manager, &lights_on, ids, 300));
+    DeviceFilter off = {0, DEVICE_STATE_OFF, false, 0, 0};
+    TEST_ASSERT_EQUAL_size_t(200, device_manager_query(manager, &off, NULL, 0));
+    TEST_ASSERT_EQUAL_size_t(300, device_manager_query(manager, NULL, NULL, 0));
+
+    // Truncated output still reports the full match count
+    DeviceFilter two_types = {DEVICE_TYPE_BIT(DEVICE_LIGHT) | DEVICE_TYPE_BIT(DEVICE_THERMOSTAT), DEVICE_STATE_ANY,
+                              false, 0, 0};
+    TEST_ASSERT_EQUAL_size_t(200, device_manager_query(manager, &two_types, ids, 5));
+    TEST_ASSERT_EQUAL_INT(0, ids[0]);
+    TEST_ASSERT_EQUAL_INT(1, ids[1]);
+    TEST_ASSERT_EQUAL_INT(3, ids[2]);
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_query_by_attribute(void)
+{
+    DeviceManager* manager = make_query_fleet();
+    int ids[300];
+
+    DeviceFilter hot = {DEVICE_TYPE_BIT(DEVICE_THERMOSTAT), DEVICE_STATE_ANY, true, 76, 100};
+    size_t matches = device_manager_query(manager, &hot, ids, 300);
+    TEST_ASSERT_EQUAL_size_t(24, matches);
+    for (size_t i = 0; i < matches; i++) {
+        TEST_ASSERT_EQUAL_INT(DEVICE_THERMOSTAT, ids[i] % 3);
+        TEST_ASSERT_TRUE(ids[i] % 100 > 75);
+    }
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_count_by_type(void)
+{
+    DeviceManager* manager = make_query_fleet();
+    TEST_ASSERT_EQUAL_INT(100, device_manager_count_by_type(manager, DEVICE_CAMERA));
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 2, "device-2"));
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 0, "device-0"));
+    TEST_ASSERT_EQUAL_INT(99, device_manager_count_by_type(manager, DEVICE_CAMERA));
+    TEST_ASSERT_EQUAL_INT(99, device_manager_count_by_type(manager, DEVICE_LIGHT));
+    TEST_ASSERT_EQUAL_INT(100, device_manager_count_by_type(manager, DEVICE_THERMOSTAT));
+    TEST_ASSERT_EQUAL_INT(0, device_manager_count_by_type(manager, (DeviceType)7));
+
+    // A reused slot moves to its new type's set
+    device_manager_add_device(manager, "new-camera", DEVICE_CAMERA, 1000);
+    DeviceFilter cameras = {DEVICE_TYPE_BIT(DEVICE_CAMERA), DEVICE_STATE_ANY, false, 0, 0};
+    TEST_ASSERT_EQUAL_size_t(100, device_manager_query(manager, &cameras, NULL, 0));
+    DeviceFilter lights = {DEVICE_TYPE_BIT(DEVICE_LIGHT), DEVICE_STATE_ANY, false, 0, 0};
+    TEST_ASSERT_EQUAL_size_t(99, device_manager_query(manager, &lights, NULL, 0));
+
+    // Loaded snapshots rebuild the sets
+    TEST_ASSERT_TRUE(device_manager_save_binary(manager, "test_query.bin"));
+    DeviceManager* loaded = device_manager_load_binary("test_query.bin");
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(100, device_manager_count_by_type(loaded, DEVICE_CAMERA));
+    TEST_ASSERT_EQUAL_size_t(99, device_manager_query(loaded, &lights, NULL, 0));
+    device_manager_destroy(loaded);
+    remove("test_query.bin");
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_aggregate_attribute(void)
+{
+    DeviceManager* manager = make_query_fleet();
+    // Extremes, negatives and a gap left by a removal must all be handled by the kernels
+    device_manager_set_device_attribute(manager, 1, -40);
+    device_manager_set_device_attribute(manager, 4, 2147483647);
+    device_manager_set_device_attribute(manager, 7, -2147483647 - 1);
+    device_manager_remove_device(manager, 10, "device-10");
+
+    long long sum = 0;
+    size_t count = 0;
+    for (int i = 1; i < 300; i += 3) {
+        if (i != 10) {
+            sum += device_manager_get_device_attribute(manager, i);
+            count++;
+        }
+    }
+    AggregateResult result;
+    TEST_ASSERT_TRUE(device_manager_aggregate_attribute(manager, DEVICE_THERMOSTAT, &result));
+    TEST_ASSERT_EQUAL_size_t(count, result.count);
+    TEST_ASSERT_EQUAL_INT(-2147483647 - 1, result.min);
+    TEST_ASSERT_EQUAL_INT(2147483647, result.max);
+    TEST_ASSERT_TRUE(result.sum == sum);
+    TEST_ASSERT_TRUE(result.mean == (double)sum / (double)count);
+
+    TEST_ASSERT_FALSE(device_manager_aggregate_attribute(manager, (DeviceType)3, &result));
+
+    // A fleet of one type takes the vector path where the CPU has one
+    DeviceManager* dense = device_manager_create();
+    char name[32];
+    sum = 0;
+    for (int i = 0; i < 1500; i++) {
+        int attribute = i % 2 ? i * 1000003 : -i * 999983;
+        snprintf(name, sizeof(name), "thermostat-%d", i);
+        DeviceSpec spec = {name, DEVICE_THERMOSTAT, i, false, attribute};
+        device_manager_add_devices(dense, &spec, 1, NULL);
+        sum += attribute;
+    }
+    device_manager_remove_device(dense, 1499, "thermostat-1499");
+    sum -= 1499 * 1000003;
+    TEST_ASSERT_TRUE(device_manager_aggregate_attribute(dense, DEVICE_THERMOSTAT, &result));
+    TEST_ASSERT_EQUAL_size_t(1499, result.count);
+    TEST_ASSERT_EQUAL_INT(-1498 * 999983, result.min);
+    TEST_ASSERT_EQUAL_INT(1497 * 1000003, result.max);
+    TEST_ASSERT_TRUE(result.sum == sum);
+    device_manager_destroy(dense);
+    DeviceManager* empty = device_manager_create();
+    TEST_ASSERT_TRUE(device_manager_aggregate_attribute(empty, DEVICE_CAMERA, &result));
+    TEST_ASSERT_EQUAL_size_t(0, result.count);
+    TEST_ASSERT_EQUAL_INT(0, result.min);
+    device_manager_destroy(empty);
+    device_manager_destroy(manager);
+}
+
+// Kernel sets are picked from DEVICE_MANAGER_SIMD when a manager is created
+static void force_kernels(const char* kernels)
+{
+#if defined(_WIN32)
+    _putenv_s("DEVICE_MANAGER_SIMD", kernels ? kernels : "");
+#else
+    if (kernels) {
+        setenv("DEVICE_MANAGER_SIMD", kernels, 1);
+    } else {
+        unsetenv("DEVICE_MANAGER_SIMD");
+    }
+#endif
+}
+
+// Thermostats fill the first `selected` slots of every 64, so the selection density
+// falls on either side of the vector kernels' sparse cutoffs
+static DeviceManager* make_kernel_fleet(const char* kernels, int selected)
+{
+    force_kernels(kernels);
+    DeviceManager* manager = device_manager_create();
+    force_kernels(NULL);
+    char name[32];
+    for (int i = 0; i < 2500; i++) {
+        int attribute = (int)((unsigned)i * 2654435761U);
+        if (i % 997 == 5) {
+            attribute = i % 2 ? INT_MAX : INT_MIN;
+        }
+        snprintf(name, sizeof(name), "device-%d", i);
+        DeviceSpec spec = {name, i % 64 < selected ? DEVICE_THERMOSTAT : DEVICE_LIGHT, i, false, attribute};
+        device_manager_add_devices(manager, &spec, 1, NULL);
+    }
+    for (int i = 3; i < 2500; i += 211) {
+        char removed[32];
+        snprintf(removed, sizeof(removed), "device-%d", i);
+        device_manager_remove_device(manager, i, removed);
+    }
+    return manager;
+}
+
+void test_device_manager_attribute_kernels_match_scalar(void)
+{
+    const char* kernels[] = {"sse2", "avx2"};
+    const int densities[] = {64, 48, 32, 8};
+    int expected_ids[2500];
+    int ids[2500];
+    for (size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+        DeviceManager* scalar = make_kernel_fleet("scalar", densities[d]);
+        AggregateResult expected;
+        TEST_ASSERT_TRUE(device_manager_aggregate_attribute(scalar, DEVICE_THERMOSTAT, &expected));
+        TEST_ASSERT_TRUE(expected.count > 0);
+        size_t expected_matches = device_manager_filter_attribute_range(scalar, DEVICE_THERMOSTAT, -1000000000,
+                                                                        1000000000, expected_ids, 2500);
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            DeviceManager* manager = make_kernel_fleet(kernels[k], densities[d]);
+            AggregateResult result;
+            TEST_ASSERT_TRUE(device_manager_aggregate_attribute(manager, DEVICE_THERMOSTAT, &result));
+            TEST_ASSERT_EQUAL_size_t(expected.count, result.count);
+            TEST_ASSERT_EQUAL_INT(expected.min, result.min);
+            TEST_ASSERT_EQUAL_INT(expected.max, result.max);
+            TEST_ASSERT_TRUE(expected.sum == result.sum);
+            size_t matches = device_manager_filter_attribute_range(manager, DEVICE_THERMOSTAT, -1000000000, 1000000000,
+                                                                   ids, 2500);
+            TEST_ASSERT_EQUAL_size_t(expected_matches, matches);
+            TEST_ASSERT_EQUAL_INT_ARRAY(expected_ids, ids, matches);
+            device_manager_destroy(manager);
+        }
+        device_manager_destroy(scalar);
+    }
+}
+
+void test_device_manager_filter_attribute_range(void)
+{
+    DeviceManager* manager = make_query_fleet();
+    int ids[300];
+    size_t matches = device_manager_filter_attribute_range(manager, DEVICE_LIGHT, 10, 19, ids, 300);
+    TEST_ASSERT_EQUAL_size_t(10, matches);
+    for (size_t i = 0; i < matches; i++) {
+        TEST_ASSERT_EQUAL_INT(0, ids[i] % 3);
+        TEST_ASSERT_TRUE(ids[i] % 100 >= 10 && ids[i] % 100 <= 19);
+    }
+    TEST_ASSERT_EQUAL_size_t(100, device_manager_filter_attribute_range(manager, DEVICE_LIGHT, -2147483647 - 1,
+                                                                        2147483647, NULL, 0));
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_filter_attribute_range(manager, DEVICE_LIGHT, 50, 40, ids, 300));
+    device_manager_destroy(manager);
+}
+
+// Three slabs' worth of devices so the worker pool has chunks to share out
+static DeviceManager* make_parallel_fleet(void)
+{
+    DeviceManager* manager = device_manager_create();
+    char name[32];
+    for (int i = 0; i < 3000; i++) {
+        snprintf(name, sizeof(name), "device-%d", i);
+        DeviceSpec spec = {name, (DeviceType)(i % 3), i, i % 2 != 0, i % 100};
+        device_manager_add_devices(manager, &spec, 1, NULL);
+    }
+    return manager;
+}
+
+void test_device_manager_apply_parallel(void)
+{
+    DeviceManager* manager = make_parallel_fleet();
+    TEST_ASSERT_TRUE(device_manager_set_worker_threads(manager, 4));
+
+    // Only devices whose value actually changes are counted
+    DeviceFilter lights = {DEVICE_TYPE_BIT(DEVICE_LIGHT), DEVICE_STATE_ANY, false, 0, 0};
+    DeviceOp off = {DEVICE_OP_SET_STATE, 0, 0, 0, NULL, NULL};
+    TEST_ASSERT_EQUAL_size_t(500, device_manager_apply_parallel(manager, &lights, &off));
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_apply_parallel(manager, &lights, &off));
+    DeviceFilter lights_on = {DEVICE_TYPE_BIT(DEVICE_LIGHT), DEVICE_STATE_ON, false, 0, 0};
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_query(manager, &lights_on, NULL, 0));
+
+    size_t outside = 0;
+    for (int i = 1; i < 3000; i += 3) {
+        outside += i % 100 < 20 || i % 100 > 30;
+    }
+    DeviceFilter thermostats = {DEVICE_TYPE_BIT(DEVICE_THERMOSTAT), DEVICE_STATE_ANY, false, 0, 0};
+    DeviceOp clamp = {DEVICE_OP_CLAMP_ATTRIBUTE, 0, 20, 30, NULL, NULL};
+    TEST_ASSERT_EQUAL_size_t(outside, device_manager_apply_parallel(manager, &thermostats, &clamp));
+    AggregateResult result;
+    TEST_ASSERT_TRUE(device_manager_aggregate_attribute(manager, DEVICE_THERMOSTAT, &result));
+    TEST_ASSERT_EQUAL_INT(20, result.min);
+    TEST_ASSERT_EQUAL_INT(30, result.max);
+
+    // Attribute filters pick devices before the op runs
+    DeviceFilter low_cameras = {DEVICE_TYPE_BIT(DEVICE_CAMERA), DEVICE_STATE_ANY, true, 0, 9};
+    DeviceOp bump = {DEVICE_OP_ADD_ATTRIBUTE, 1000, 0, 0, NULL, NULL};
+    TEST_ASSERT_EQUAL_size_t(100, device_manager_apply_parallel(manager, &low_cameras, &bump));
+    TEST_ASSERT_EQUAL_INT(1002, device_manager_get_device_attribute(manager, 2));
+    TEST_ASSERT_EQUAL_INT(11, device_manager_get_device_attribute(manager, 11));
+    // Lights with attribute 7 (ids 7, 307, ...) are already there
+    DeviceOp set = {DEVICE_OP_SET_ATTRIBUTE, 7, 0, 0, NULL, NULL};
+    TEST_ASSERT_EQUAL_size_t(3000 - 10, device_manager_apply_parallel(manager, NULL, &set));
+
+    DeviceOp bad_clamp = {DEVICE_OP_CLAMP_ATTRIBUTE, 0, 5, 1, NULL, NULL};
+    DeviceOp no_callback = {DEVICE_OP_CALLBACK, 0, 0, 0, NULL, NULL};
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_apply_parallel(manager, NULL, &bad_clamp));
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_apply_parallel(manager, NULL, &no_callback));
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_apply_parallel(manager, NULL, NULL));
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_apply_parallel(NULL, NULL, &set));
+
+    // Back to the calling thread alone
+    TEST_ASSERT_TRUE(device_manager_set_worker_threads(manager, 1));
+    TEST_ASSERT_EQUAL_size_t(3000, device_manager_apply_parallel(manager, NULL, &bump));
+
+    device_manager_destroy(manager);
+}
+
+// Devices are visited concurrently, but each only once, so per-id slots need no locking
+static void record_visit(const DeviceView* device, void* udata)
+{
+    int* visits = (int*)udata;
+    char name[32];
+    snprintf(name, sizeof(name), "device-%d", device->ident);
+    if (strcmp(name, device->name) == 0 && device->type == (DeviceType)(device->ident % 3)) {
+        visits[device->ident]++;
+    }
+}
+
+// Turns ON devices with an odd attribute and halves the attribute of the rest
+static bool halve_or_switch_on(DeviceView* device, void* udata)
+{
+    (void)udata;
+    if (device->attribute % 2 != 0) {
+        device->state = true;
+    } else {
+        device->attribute /= 2;
+    }
+    return true;
+}
+
+void test_device_manager_for_each_parallel(void)
+{
+    DeviceManager* manager = make_parallel_fleet();
+    TEST_ASSERT_TRUE(device_manager_set_worker_threads(manager, 0));
+    device_manager_remove_device(manager, 1500, "device-1500");
+
+    int* visits = (int*)calloc(3000, sizeof(int));
+    TEST_ASSERT_NOT_NULL(visits);
+    TEST_ASSERT_EQUAL_size_t(2999, device_manager_for_each_parallel(manager, NULL, record_visit, visits));
+    for (int i = 0; i < 3000; i++) {
+        TEST_ASSERT_EQUAL_INT(i == 1500 ? 0 : 1, visits[i]);
+    }
+    DeviceFilter on = {0, DEVICE_STATE_ON, false, 0, 0};
+    TEST_ASSERT_EQUAL_size_t(1500, device_manager_for_each_parallel(manager, &on, record_visit, visits));
+    TEST_ASSERT_EQUAL_INT(2, visits[1]);
+    TEST_ASSERT_EQUAL_INT(1, visits[2]);
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_for_each_parallel(manager, NULL, NULL, visits));
+    free(visits);
+
+    // Odd ids have odd attributes and are already ON; even ids change unless their
+    // attribute is 0 (ids 0, 100, ..., less the removed 1500)
+    DeviceOp update = {DEVICE_OP_CALLBACK, 0, 0, 0, halve_or_switch_on, NULL};
+    TEST_ASSERT_EQUAL_size_t(1500 - 1 - 29, device_manager_apply_parallel(manager, NULL, &update));
+    TEST_ASSERT_EQUAL_INT(21, device_manager_get_device_attribute(manager, 42));
+    TEST_ASSERT_TRUE(device_manager_get_device_state(manager, 43, "device-43"));
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_apply_parallel_journaled(void)
+{
+    const char* filename = "test_parallel_journal.txt";
+    DeviceManager* manager = make_parallel_fleet();
+    TEST_ASSERT_TRUE(device_manager_set_worker_threads(manager, 4));
+    TEST_ASSERT_TRUE(device_manager_enable_journal(manager, filename, 64, 2500));
+
+    // The first op crosses the compaction threshold, the second lands in the new log
+    DeviceOp on = {DEVICE_OP_SET_STATE, 1, 0, 0, NULL, NULL};
+    DeviceOp bump = {DEVICE_OP_ADD_ATTRIBUTE, 5, 0, 0, NULL, NULL};
+    TEST_ASSERT_EQUAL_size_t(1500, device_manager_apply_parallel(manager, NULL, &on));
+    DeviceFilter cameras = {DEVICE_TYPE_BIT(DEVICE_CAMERA), DEVICE_STATE_ANY, false, 0, 0};
+    TEST_ASSERT_EQUAL_size_t(1000, device_manager_apply_parallel(manager, &cameras, &bump));
+    TEST_ASSERT_EQUAL_size_t(1000, device_manager_apply_parallel(manager, &cameras, &bump));
+    TEST_ASSERT_TRUE(device_manager_journal_sync(manager));
+    device_manager_destroy(manager);
+
+    DeviceManager* loaded = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    DeviceFilter off = {0, DEVICE_STATE_OFF, false, 0, 0};
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_query(loaded, &off, NULL, 0));
+    TEST_ASSERT_EQUAL_INT(10 + 2 % 100, device_manager_get_device_attribute(loaded, 2));
+    TEST_ASSERT_EQUAL_INT(4 % 100, device_manager_get_device_attribute(loaded, 4));
+    TEST_ASSERT_EQUAL_INT(10 + 2999 % 100, device_manager_get_device_attribute(loaded, 2999));
+    device_manager_destroy(loaded);
+
+    remove(filename);
+    remove("test_parallel_journal.txt.wal");
+}
+
+typedef struct Capture {
+    char data[4096];
+    size_t size;
+    size_t writes;
+    size_t limit; // Writes accepted before the sink fails
+} Capture;
+
+static bool capture_sink(const char* data, size_t size, void* udata)
+{
+    Capture* capture = (Capture*)udata;
+    if (capture->writes++ >= capture->limit || capture->size + size >= sizeof(capture->data)) {
+        return false;
+    }
+    memcpy(capture->data + capture->size, data, size);
+    capture->size += size;
+    capture->data[capture->size] = '\0';
+    return true;
+}
+
+void test_device_manager_write_devices(void)
+{
+    DeviceManager* manager = device_manager_create();
+    device_manager_add_device(manager, "Lamp", DEVICE_LIGHT, 1);
+    device_manager_add_device(manager, "Hall, \"main\"", DEVICE_THERMOSTAT, 2147483647);
+    device_manager_set_device_state(manager, 1, true);
+    device_manager_set_device_attribute(manager, 1, -2147483647 - 1);
+    device_manager_set_device_attribute(manager, 2147483647, 205);
+
+    Capture capture = {{0}, 0, 0, 100};
+    TEST_ASSERT_TRUE(device_manager_write_devices(manager, capture_sink, &capture, DEVICE_FORMAT_TEXT));
+    TEST_ASSERT_EQUAL_STRING("Device ID: 1, Name: Lamp, Type: 0, State: ON, Attribute: -2147483648\n"
+                             "Device ID: 2147483647, Name: Hall, \"main\", Type: 1, State: OFF, Attribute: 205\n",
+                             capture.data);
+    // Small fleets go out in a single write
+    TEST_ASSERT_EQUAL_size_t(1, capture.writes);
+
+    capture.size = 0;
+    TEST_ASSERT_TRUE(device_manager_write_devices(manager, capture_sink, &capture, DEVICE_FORMAT_CSV));
+    TEST_ASSERT_EQUAL_STRING("id,name,type,state,attribute\n"
+                             "1,Lamp,0,1,-2147483648\n"
+                             "2147483647,\"Hall, \"\"main\"\"\",1,0,205\n",
+                             capture.data);
+
+    capture.size = 0;
+    TEST_ASSERT_TRUE(device_manager_write_devices(manager, capture_sink, &capture, DEVICE_FORMAT_JSONL));
+    TEST_ASSERT_EQUAL_STRING("{\"id\":1,\"name\":\"Lamp\",\"type\":0,\"state\":true,\"attribute\":-2147483648}\n"
+                             "{\"id\":2147483647,\"name\":\"Hall, \\\"main\\\"\",\"type\":1,\"state\":false,"
+                             "\"attribute\":205}\n",
+                             capture.data);
+
+    capture.size = 0;
+    TEST_ASSERT_TRUE(device_manager_write_devices(manager, capture_sink, &capture, DEVICE_FORMAT_SNAPSHOT));
+    TEST_ASSERT_EQUAL_STRING("1 Lamp 0 1 -2147483648\n2147483647 Hall,%20\"main\" 1 0 205\n", capture.data);
+
+    // A failing sink stops the export
+    Capture refusing = {{0}, 0, 0, 0};
+    TEST_ASSERT_FALSE(device_manager_write_devices(manager, capture_sink, &refusing, DEVICE_FORMAT_CSV));
+    TEST_ASSERT_FALSE(device_manager_write_devices(manager, capture_sink, &capture, (DeviceFormat)9));
+    TEST_ASSERT_FALSE(device_manager_write_devices(manager, NULL, NULL, DEVICE_FORMAT_TEXT));
+
+    device_manager_destroy(manager);
+}
+
+typedef struct LineCount {
+    size_t lines;
+    size_t writes;
+} LineCount;
+
+static bool count_sink(const char* data, size_t size, void* udata)
+{
+    LineCount* count = (LineCount*)udata;
+    for (size_t i = 0; i < size; i++) {
+        count->lines += data[i] == '\n';
+    }
+    count->writes++;
+    return true;
+}
+
+void test_device_manager_write_devices_large(void)
+{
+    DeviceManager* manager = make_parallel_fleet();
+    char name[32];
+    for (int i = 3000; i < 6000; i++) {
+        snprintf(name, sizeof(name), "device-%d", i);
+        device_manager_add_device(manager, name, DEVICE_CAMERA, i);
+    }
+    device_manager_remove_device(manager, 7, "device-7");
+    // Several buffers' worth; no record is lost between flushes
+    LineCount count = {0, 0};
+    TEST_ASSERT_TRUE(device_manager_write_devices(manager, count_sink, &count, DEVICE_FORMAT_JSONL));
+    TEST_ASSERT_EQUAL_size_t(5999, count.lines);
+    TEST_ASSERT_TRUE(count.writes > 1);
+    count.lines = 0;
+    TEST_ASSERT_TRUE(device_manager_write_devices(manager, count_sink, &count, DEVICE_FORMAT_CSV));
+    TEST_ASSERT_EQUAL_size_t(6000, count.lines);
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_iterator(void)
+{
+    DeviceManager* manager = make_query_fleet();
+    DeviceIterator iterator;
+    DeviceView view;
+    device_manager_iter_begin(manager, &iterator);
+    int expected = 0;
+    while (device_manager_iter_next(&iterator, &view)) {
+        char name[32];
+        snprintf(name, sizeof(name), "device-%d", expected);
+        TEST_ASSERT_EQUAL_INT(expected, view.ident);
+        TEST_ASSERT_EQUAL_STRING(name, view.name);
+        TEST_ASSERT_EQUAL_INT(expected % 3, view.type);
+        TEST_ASSERT_EQUAL(expected % 3 == 2, view.state);
+        TEST_ASSERT_EQUAL_INT(expected % 100, view.attribute);
+        expected++;
+    }
+    TEST_ASSERT_EQUAL_INT(300, expected);
+    // An exhausted cursor stays exhausted
+    TEST_ASSERT_FALSE(device_manager_iter_next(&iterator, &view));
+    device_manager_iter_end(&iterator);
+    TEST_ASSERT_FALSE(device_manager_iter_next(&iterator, &view));
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_iterator_batches_and_removal(void)
+{
+    DeviceManager* manager = make_query_fleet();
+    DeviceIterator iterator;
+    DeviceView views[64];
+    char names[64][DEVICE_NAME_MAX];
+    device_manager_iter_begin(manager, &iterator);
+    TEST_ASSERT_EQUAL_size_t(64, device_manager_iter_next_batch(&iterator, views, names, 64));
+    TEST_ASSERT_EQUAL_INT(63, views[63].ident);
+    TEST_ASSERT_EQUAL_STRING("device-63", views[63].name);
+
+    // Removals on either side of the cursor: returned devices stay returned, later ones vanish
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 64, "device-64"));
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 200, "device-200"));
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 10, "device-10"));
+    // Device 10's slot, the last freed, is reused; it is behind the cursor, so "late" is not seen
+    TEST_ASSERT_TRUE(device_manager_add_device(manager, "late", DEVICE_CAMERA, 1000));
+    size_t total = 64;
+    size_t fetched = 0;
+    while ((fetched = device_manager_iter_next_batch(&iterator, views, names, 64)) > 0) {
+        for (size_t i = 0; i < fetched; i++) {
+            TEST_ASSERT_TRUE(views[i].ident != 64 && views[i].ident != 200 && views[i].ident != 1000);
+        }
+        total += fetched;
+    }
+    TEST_ASSERT_EQUAL_size_t(300 - 2, total);
+    device_manager_iter_end(&iterator);
+
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_iter_next_batch(NULL, views, names, 64));
+    device_manager_destroy(manager);
+}
+
+typedef struct EventLog {
+    DeviceEvent events[8];
+    size_t count;
+    size_t calls;
+} EventLog;
+
+static void log_events(const DeviceEvent* events, size_t count, void* udata)
+{
+    EventLog* log = (EventLog*)udata;
+    for (size_t i = 0; i < count && log->count < 8; i++) {
+        log->events[log->count++] = events[i];
+    }
+    log->calls++;
+}
+
+void test_device_manager_subscribe(void)
+{
+    DeviceManager* manager = device_manager_create();
+    EventLog all = {{{0}}, 0, 0};
+    EventLog thermostats = {{{0}}, 0, 0};
+    DeviceFilter thermostat_filter = {DEVICE_TYPE_BIT(DEVICE_THERMOSTAT), DEVICE_STATE_ANY, false, 0, 0};
+    unsigned int all_id = device_manager_subscribe(manager, NULL, log_events, &all);
+    unsigned int thermostat_id = device_manager_subscribe(manager, &thermostat_filter, log_events, &thermostats);
+    TEST_ASSERT_TRUE(all_id != 0 && thermostat_id != 0 && all_id != thermostat_id);
+
+    // Everything that happened to a device since the last delivery arrives as one event
+    device_manager_add_device(manager, "Lamp", DEVICE_LIGHT, 1);
+    device_manager_set_device_state(manager, 1, true);
+    device_manager_set_device_attribute(manager, 1, 5);
+    device_manager_set_device_attribute(manager, 1, 7);
+    device_manager_add_device(manager, "Hall", DEVICE_THERMOSTAT, 2);
+    TEST_ASSERT_EQUAL_size_t(2, device_manager_deliver_events(manager));
+    TEST_ASSERT_EQUAL_size_t(2, all.count);
+    TEST_ASSERT_EQUAL_size_t(1, all.calls);
+    TEST_ASSERT_EQUAL_UINT(DEVICE_EVENT_BIT(DEVICE_EVENT_ADDED) | DEVICE_EVENT_BIT(DEVICE_EVENT_STATE) |
+                               DEVICE_EVENT_BIT(DEVICE_EVENT_ATTRIBUTE),
+                           all.events[0].changes);
+    TEST_ASSERT_EQUAL_INT(1, all.events[0].ident);
+    TEST_ASSERT_TRUE(all.events[0].state);
+    TEST_ASSERT_EQUAL_INT(7, all.events[0].attribute);
+    TEST_ASSERT_EQUAL_INT(2, all.events[1].ident);
+    TEST_ASSERT_EQUAL_size_t(1, thermostats.count);
+    TEST_ASSERT_EQUAL_INT(DEVICE_THERMOSTAT, thermostats.events[0].type);
+
+    // Nothing changed, nobody is called
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_deliver_events(manager));
+    TEST_ASSERT_EQUAL_size_t(1, all.calls);
+
+    // Removed devices report their last values
+    device_manager_attribute_fetch_add(manager, 2, 3, NULL);
+    device_manager_remove_device(manager, 2, "Hall");
+    TEST_ASSERT_EQUAL_size_t(1, device_manager_deliver_events(manager));
+    TEST_ASSERT_EQUAL_UINT(DEVICE_EVENT_BIT(DEVICE_EVENT_ATTRIBUTE) | DEVICE_EVENT_BIT(DEVICE_EVENT_REMOVED),
+                           all.events[2].changes);
+    TEST_ASSERT_EQUAL_INT(3, all.events[2].attribute);
+    TEST_ASSERT_EQUAL_size_t(2, thermostats.count);
+
+    TEST_ASSERT_TRUE(device_manager_unsubscribe(manager, thermostat_id));
+    TEST_ASSERT_FALSE(device_manager_unsubscribe(manager, thermostat_id));
+    device_manager_add_device(manager, "Hall", DEVICE_THERMOSTAT, 2);
+    TEST_ASSERT_EQUAL_size_t(1, device_manager_deliver_events(manager));
+    TEST_ASSERT_EQUAL_size_t(2, thermostats.count);
+    TEST_ASSERT_EQUAL_size_t(4, all.count);
+
+    TEST_ASSERT_EQUAL_UINT(0, device_manager_subscribe(manager, NULL, NULL, NULL));
+    device_manager_destroy(manager);
+}
+
+typedef struct EventTotals {
+    size_t events;
+    size_t overflows;
+} EventTotals;
+
+static void count_events(const DeviceEvent* events, size_t count, void* udata)
+{
+    EventTotals* totals = (EventTotals*)udata;
+    for (size_t i = 0; i < count; i++) {
+        totals->overflows += (events[i].changes & DEVICE_EVENT_BIT(DEVICE_EVENT_OVERFLOW)) != 0;
+        totals->events += events[i].ident >= 0;
+    }
+}
+
+void test_device_manager_subscribe_overflow(void)
+{
+    DeviceManager* manager = make_parallel_fleet();
+    EventTotals totals = {0, 0};
+    TEST_ASSERT_TRUE(device_manager_subscribe(manager, NULL, count_events, &totals) != 0);
+
+    // More changes than the ring holds between two deliveries
+    for (int value = 1; value <= 6; value++) {
+        DeviceOp set = {DEVICE_OP_SET_ATTRIBUTE, value * 1000, 0, 0, NULL, NULL};
+        device_manager_apply_parallel(manager, NULL, &set);
+    }
+    TEST_ASSERT_EQUAL_size_t(3000, device_manager_deliver_events(manager));
+    TEST_ASSERT_EQUAL_size_t(1, totals.overflows);
+    TEST_ASSERT_EQUAL_size_t(3000, totals.events);
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_deliver_events(manager));
+    TEST_ASSERT_EQUAL_size_t(1, totals.overflows);
+
+    device_manager_destroy(manager);
+}
+
+typedef struct DeltaBuffer {
+    char* data;
+    size_t size;
+} DeltaBuffer;
+
+static bool delta_sink(const char* data, size_t size, void* udata)
+{
+    DeltaBuffer* buffer = (DeltaBuffer*)udata;
+    char* grown = (char*)realloc(buffer->data, buffer->size + size + 1);
+    if (!grown) {
+        return false;
+    }
+    memcpy(grown + buffer->size, data, size);
+    buffer->data = grown;
+    buffer->size += size;
+    buffer->data[buffer->size] = '\0';
+    return true;
+}
+
+void test_device_manager_delta_round_trip(void)
+{
+    DeviceManager* source = device_manager_create();
+    DeviceManager* replica = device_manager_create();
+    device_manager_add_device(source, "Lamp", DEVICE_LIGHT, 1);
+    device_manager_add_device(source, "Fan", DEVICE_THERMOSTAT, 2);
+    device_manager_add_device(source, "Lock", DEVICE_CAMERA, 3);
+    TEST_ASSERT_EQUAL_UINT64(3, device_manager_version(source));
+
+    Capture capture = {{0}, 0, 0, 100};
+    uint64_t version = 0;
+    TEST_ASSERT_TRUE(device_manager_export_changes_since(source, 0, capture_sink, &capture, &version));
+    TEST_ASSERT_EQUAL_UINT64(3, version);
+    TEST_ASSERT_EQUAL_STRING("DMDELTA 2 0 3 1\n+ 1 Lamp 0 0 0\n+ 2 Fan 1 0 0\n+ 3 Lock 2 0 0\n", capture.data);
+    TEST_ASSERT_TRUE(device_manager_apply_changes(replica, capture.data, capture.size));
+    TEST_ASSERT_EQUAL_INT(3, device_manager_get_device_count(replica));
+
+    // Removals come first; the new device reuses the removed one's slot
+    device_manager_set_device_state(source, 1, true);
+    device_manager_remove_device(source, 2, "Fan");
+    device_manager_add_device(source, "Heater", DEVICE_THERMOSTAT, 4);
+    device_manager_set_device_attribute(source, 3, 21);
+    capture.size = 0;
+    TEST_ASSERT_TRUE(device_manager_export_changes_since(source, version, capture_sink, &capture, &version));
+    TEST_ASSERT_EQUAL_UINT64(7, version);
+    TEST_ASSERT_EQUAL_STRING("DMDELTA 2 3 7 0\n- 2 Fan\n+ 1 Lamp 0 1 0\n+ 4 Heater 1 0 0\n+ 3 Lock 2 0 21\n",
+                             capture.data);
+    TEST_ASSERT_TRUE(device_manager_apply_changes(replica, capture.data, capture.size));
+
+    Capture expected = {{0}, 0, 0, 100};
+    TEST_ASSERT_TRUE(device_manager_write_devices(source, capture_sink, &expected, DEVICE_FORMAT_SNAPSHOT));
+    capture.size = 0;
+    TEST_ASSERT_TRUE(device_manager_write_devices(replica, capture_sink, &capture, DEVICE_FORMAT_SNAPSHOT));
+    TEST_ASSERT_EQUAL_STRING(expected.data, capture.data);
+
+    // Nothing changed: only the header
+    capture.size = 0;
+    TEST_ASSERT_TRUE(device_manager_export_changes_since(source, version, capture_sink, &capture, &version));
+    TEST_ASSERT_EQUAL_STRING("DMDELTA 2 7 7 0\n", capture.data);
+
+    // Malformed deltas are rejected
+    TEST_ASSERT_FALSE(device_manager_apply_changes(replica, "garbage\n", 8));
+    TEST_ASSERT_FALSE(device_manager_apply_changes(replica, "DMDELTA 3 0 0 0\n", 16));
+    TEST_ASSERT_FALSE(device_manager_apply_changes(replica, "DMDELTA 1 0 1 0\n+ 9 Bad 7 0 0\n", 30));
+    TEST_ASSERT_FALSE(device_manager_apply_changes(replica, "DMDELTA 1 0 1 0\n+ 9 Bad 0 0\n", 28));
+    TEST_ASSERT_EQUAL_INT(3, device_manager_get_device_count(replica));
+
+    device_manager_destroy(source);
+    device_manager_destroy(replica);
+}
+
+void test_device_manager_delta_names_with_spaces(void)
+{
+    DeviceManager* source = device_manager_create();
+    DeviceManager* replica = device_manager_create();
+    device_manager_add_device(source, "living room", DEVICE_LIGHT, 1);
+    device_manager_add_device(source, "100% \tdone\n", DEVICE_CAMERA, 2);
+    device_manager_add_device(source, "hall", DEVICE_THERMOSTAT, 3);
+
+    Capture capture = {{0}, 0, 0, 100};
+    uint64_t version = 0;
+    TEST_ASSERT_TRUE(device_manager_export_changes_since(source, 0, capture_sink, &capture, &version));
+    TEST_ASSERT_EQUAL_STRING("DMDELTA 2 0 3 1\n+ 1 living%20room 0 0 0\n+ 2 100%25%20%09done%0A 2 0 0\n"
+                             "+ 3 hall 1 0 0\n",
+                             capture.data);
+    TEST_ASSERT_TRUE(device_manager_apply_changes(replica, capture.data, capture.size));
+    TEST_ASSERT_EQUAL_INT(1, get_device_id(replica, "living room"));
+    TEST_ASSERT_EQUAL_INT(2, get_device_id(replica, "100% \tdone\n"));
+
+    // Removals carry the name the same way
+    device_manager_remove_device(source, 1, "living room");
+    device_manager_set_device_attribute(source, 2, 9);
+    capture.size = 0;
+    TEST_ASSERT_TRUE(device_manager_export_changes_since(source, version, capture_sink, &capture, &version));
+    TEST_ASSERT_TRUE(device_manager_apply_changes(replica, capture.data, capture.size));
+    TEST_ASSERT_EQUAL_INT(2, device_manager_get_device_count(replica));
+    TEST_ASSERT_EQUAL_INT(-1, get_device_id(replica, "living room"));
+    TEST_ASSERT_EQUAL_INT(9, device_manager_get_device_attribute(replica, 2));
+
+    // Text snapshots use the same records
+    TEST_ASSERT_TRUE(device_manager_save(source, "test_spaced_names.txt"));
+    DeviceManager* loaded = device_manager_load("test_spaced_names.txt");
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(2, device_manager_get_device_count(loaded));
+    TEST_ASSERT_EQUAL_INT(DEVICE_CAMERA, device_manager_get_device_type(loaded, 2, "100% \tdone\n"));
+    device_manager_destroy(loaded);
+    remove("test_spaced_names.txt");
+
+    // Format 1 deltas took names literally
+    TEST_ASSERT_TRUE(device_manager_apply_changes(replica, "DMDELTA 1 0 1 0\n+ 5 50%20 0 0 0\n", 31));
+    TEST_ASSERT_EQUAL_INT(5, get_device_id(replica, "50%20"));
+
+    device_manager_destroy(source);
+    device_manager_destroy(replica);
+}
+
+void test_device_manager_delta_full_resync(void)
+{
+    const char* filename = "test_delta.bin";
+    DeviceManager* source = make_parallel_fleet();
+    DeviceManager* replica = device_manager_create();
+    device_manager_add_device(replica, "ghost", DEVICE_LIGHT, 9999);
+    device_manager_add_device(replica, "device-4", DEVICE_LIGHT, 4);
+
+    // A full delta replaces whatever the replica held, including device types
+    DeltaBuffer delta = {NULL, 0};
+    uint64_t version = 0;
+    TEST_ASSERT_TRUE(device_manager_export_changes_since(source, 0, delta_sink, &delta, &version));
+    TEST_ASSERT_TRUE(device_manager_apply_changes(replica, delta.data, delta.size));
+    TEST_ASSERT_EQUAL_INT(3000, device_manager_get_device_count(replica));
+    TEST_ASSERT_EQUAL_INT(-1, get_device_id(replica, "ghost"));
+    TEST_ASSERT_EQUAL_INT(DEVICE_THERMOSTAT, device_manager_get_device_type(replica, 4, "device-4"));
+    TEST_ASSERT_EQUAL_INT(99, device_manager_get_device_attribute(replica, 2999));
+
+    // Only the changed devices are sent
+    device_manager_set_device_attribute(source, 10, 500);
+    device_manager_set_device_state(source, 2000, false);
+    delta.size = 0;
+    TEST_ASSERT_TRUE(device_manager_export_changes_since(source, version, delta_sink, &delta, &version));
+    TEST_ASSERT_EQUAL_STRING("DMDELTA 2 3000 3002 0\n+ 10 device-10 1 0 500\n+ 2000 device-2000 2 0 0\n",
+                             delta.data);
+
+    // Versions survive a binary snapshot; removals before it do not
+    TEST_ASSERT_TRUE(device_manager_save_binary(source, filename));
+    device_manager_destroy(source);
+    source = device_manager_load_binary(filename);
+    TEST_ASSERT_NOT_NULL(source);
+    TEST_ASSERT_EQUAL_UINT64(version, device_manager_version(source));
+    delta.size = 0;
+    TEST_ASSERT_TRUE(device_manager_export_changes_since(source, version, delta_sink, &delta, NULL));
+    TEST_ASSERT_EQUAL_STRING("DMDELTA 2 3002 3002 0\n", delta.data);
+    delta.size = 0;
+    TEST_ASSERT_TRUE(device_manager_export_changes_since(source, version - 1, delta_sink, &delta, NULL));
+    TEST_ASSERT_EQUAL_INT(0, strncmp(delta.data, "DMDELTA 2 3001 3002 1\n", 22));
+
+    // Once more removals happen than are remembered, older deltas are full ones
+    for (int i = 0; i < 70000; i++) {
+        device_manager_add_device(source, "churn", DEVICE_LIGHT, 100000);
+        device_manager_remove_device(source, 100000, "churn");
+    }
+    TEST_ASSERT_EQUAL_UINT64(version + 140000, device_manager_version(source));
+    LineCount count = {0, 0};
+    TEST_ASSERT_TRUE(device_manager_export_changes_since(source, version, count_sink, &count, NULL));
+    TEST_ASSERT_EQUAL_size_t(3001, count.lines);
+    count.lines = 0;
+    TEST_ASSERT_TRUE(device_manager_export_changes_since(source, version + 139000, count_sink, &count, NULL));
+    TEST_ASSERT_EQUAL_size_t(501, count.lines);
+
+    free(delta.data);
+    device_manager_destroy(source);
+    device_manager_destroy(replica);
+    remove(filename);
+}
+
+void test_device_manager_snapshot(void)
+{
+    DeviceManager* manager = make_parallel_fleet();
+    DeltaBuffer before = {NULL, 0};
+    TEST_ASSERT_TRUE(device_manager_write_devices(manager, delta_sink, &before, DEVICE_FORMAT_SNAPSHOT));
+    DeviceManager* snapshot = device_manager_snapshot(manager);
+    TEST_ASSERT_NOT_NULL(snapshot);
+
+    // Every kind of change to the manager after the snapshot
+    device_manager_set_device_attribute(manager, 5, 1000);
+    device_manager_set_device_state(manager, 6, true);
+    device_manager_remove_device(manager, 7, "device-7");
+    device_manager_add_device(manager, "late", DEVICE_CAMERA, 5000);
+    device_manager_add_device(manager, "device-8", DEVICE_CAMERA, 8);
+    DeviceOp add = {DEVICE_OP_ADD_ATTRIBUTE, 1, 0, 0, NULL, NULL};
+    TEST_ASSERT_EQUAL_size_t(3001, device_manager_apply_parallel(manager, NULL, &add));
+    TEST_ASSERT_EQUAL_INT(1001, device_manager_get_device_attribute(manager, 5));
+    TEST_ASSERT_EQUAL_INT(3001, device_manager_get_device_count(manager));
+
+    // The snapshot still reads as the manager did when it was taken
+    DeltaBuffer after = {NULL, 0};
+    TEST_ASSERT_TRUE(device_manager_write_devices(snapshot, delta_sink, &after, DEVICE_FORMAT_SNAPSHOT));
+    TEST_ASSERT_EQUAL_size_t(before.size, after.size);
+    TEST_ASSERT_EQUAL_STRING(before.data, after.data);
+    TEST_ASSERT_EQUAL_INT(3000, device_manager_get_device_count(snapshot));
+    TEST_ASSERT_EQUAL_INT(5, device_manager_get_device_attribute(snapshot, 5));
+    TEST_ASSERT_FALSE(device_manager_get_device_state(snapshot, 6, "device-6"));
+    TEST_ASSERT_EQUAL_INT(7, get_device_id(snapshot, "device-7"));
+    TEST_ASSERT_EQUAL_INT(-1, get_device_id(snapshot, "late"));
+    // Of two devices with one id, the newest one is found
+    TEST_ASSERT_EQUAL_INT(DEVICE_CAMERA, device_manager_get_device_type(manager, 8, "device-8"));
+    TEST_ASSERT_EQUAL_INT(8, device_manager_get_device_attribute(snapshot, 8));
+    AggregateResult result;
+    TEST_ASSERT_TRUE(device_manager_aggregate_attribute(snapshot, DEVICE_LIGHT, &result));
+    TEST_ASSERT_EQUAL_INT(0, result.min);
+    TEST_ASSERT_EQUAL_INT(99, result.max);
+
+    // Snapshots are read-only
+    TEST_ASSERT_FALSE(device_manager_set_device_attribute(snapshot, 5, 1));
+    TEST_ASSERT_FALSE(device_manager_add_device(snapshot, "nope", DEVICE_LIGHT, 9000));
+    TEST_ASSERT_FALSE(device_manager_remove_device(snapshot, 5, "device-5"));
+    TEST_ASSERT_EQUAL_size_t(0, device_manager_apply_parallel(snapshot, NULL, &add));
+    TEST_ASSERT_NULL(device_manager_snapshot(snapshot));
+    TEST_ASSERT_EQUAL_INT(5, device_manager_get_device_attribute(snapshot, 5));
+
+    // Either side can go first; the manager keeps working with its copies
+    DeviceManager* second = device_manager_snapshot(manager);
+    device_manager_destroy(snapshot);
+    device_manager_set_device_attribute(manager, 5, 7);
+    TEST_ASSERT_EQUAL_INT(1001, device_manager_get_device_attribute(second, 5));
+    TEST_ASSERT_EQUAL_INT(7, device_manager_get_device_attribute(manager, 5));
+    device_manager_destroy(second);
+    device_manager_set_device_attribute(manager, 5, 8);
+    TEST_ASSERT_EQUAL_INT(8, device_manager_get_device_attribute(manager, 5));
+
+    free(before.data);
+    free(after.data);
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_snapshot_of_mapped_manager(void)
+{
+    const char* filename = "test_snapshot.bin";
+    DeviceManager* manager = make_parallel_fleet();
+    TEST_ASSERT_TRUE(device_manager_save_binary(manager, filename));
+    device_manager_destroy(manager);
+
+    // Mapped slabs are shared like heap ones; the copies come from the heap
+    manager = device_manager_load_binary(filename);
+    TEST_ASSERT_NOT_NULL(manager);
+    DeviceManager* snapshot = device_manager_snapshot(manager);
+    TEST_ASSERT_NOT_NULL(snapshot);
+    device_manager_set_device_attribute(manager, 2500, -1);
+    device_manager_remove_device(manager, 10, "device-10");
+    TEST_ASSERT_EQUAL_INT(0, device_manager_get_device_attribute(snapshot, 2500));
+    TEST_ASSERT_EQUAL_INT(10, get_device_id(snapshot, "device-10"));
+    TEST_ASSERT_EQUAL_INT(-1, device_manager_get_device_attribute(manager, 2500));
+
+    // A snapshot saves like any manager
+    const char* saved = "test_snapshot_saved.bin";
+    TEST_ASSERT_TRUE(device_manager_save_binary(snapshot, saved));
+    device_manager_destroy(snapshot);
+    device_manager_destroy(manager);
+    manager = device_manager_load_binary(saved);
+    TEST_ASSERT_NOT_NULL(manager);
+    TEST_ASSERT_EQUAL_INT(3000, device_manager_get_device_count(manager));
+    TEST_ASSERT_EQUAL_INT(0, device_manager_get_device_attribute(manager, 2500));
+
+    device_manager_destroy(manager);
+    remove(filename);
+    remove(saved);
+}
+
+static DeviceRegistry* make_registry(size_t shards, size_t threads)
+{
+    DeviceRegistry* registry = device_registry_create(shards, threads);
+    TEST_ASSERT_NOT_NULL(registry);
+    char name[32];
+    for (int i = 0; i < 3000; i++) {
+        snprintf(name, sizeof(name), "device-%d", i);
+        TEST_ASSERT_TRUE(device_registry_add_device(registry, name, (DeviceType)(i % 3), i));
+        TEST_ASSERT_TRUE(device_registry_set_device_attribute(registry, i, i % 100));
+    }
+    return registry;
+}
+
+static int compare_ints(const void* a, const void* b)
+{
+    int left = *(const int*)a;
+    int right = *(const int*)b;
+    return (left > right) - (left < right);
+}
+
+void test_device_manager_long_and_shared_names(void)
+{
+    DeviceManager* manager = device_manager_create();
+    char longest[DEVICE_NAME_MAX];
+    memset(longest, 'n', sizeof(longest) - 1);
+    longest[sizeof(longest) - 1] = '\0';
+    char too_long[DEVICE_NAME_MAX + 1];
+    memset(too_long, 'n', sizeof(too_long) - 1);
+    too_long[sizeof(too_long) - 1] = '\0';
+
+    // Names up to DEVICE_NAME_MAX - 1 bytes are kept whole; longer ones are refused
+    TEST_ASSERT_TRUE(device_manager_add_device(manager, longest, DEVICE_LIGHT, 1));
+    TEST_ASSERT_FALSE(device_manager_add_device(manager, too_long, DEVICE_LIGHT, 2));
+    TEST_ASSERT_FALSE(device_manager_add_device(manager, "", DEVICE_LIGHT, 3));
+    TEST_ASSERT_EQUAL_STRING(longest, device_manager_get_device_name(manager, 1, longest));
+    TEST_ASSERT_EQUAL_INT(1, get_device_id(manager, longest));
+
+    // Devices sharing a name share its bytes until the last of them goes
+    size_t before = device_manager_memory_usage(manager);
+    for (int i = 10; i < 20; i++) {
+        TEST_ASSERT_TRUE(device_manager_add_device(manager, "shared", DEVICE_THERMOSTAT, i));
+    }
+    const char* shared = device_manager_get_device_name(manager, 10, "shared");
+    TEST_ASSERT_EQUAL_PTR(shared, device_manager_get_device_name(manager, 19, "shared"));
+    TEST_ASSERT_TRUE(device_manager_memory_usage(manager) >= before);
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 19, "shared"));
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 10, "shared"));
+    TEST_ASSERT_EQUAL_STRING("shared", device_manager_get_device_name(manager, 15, "shared"));
+    for (int i = 11; i < 19; i++) {
+        TEST_ASSERT_TRUE(device_manager_remove_device(manager, i, "shared"));
+    }
+    TEST_ASSERT_EQUAL_INT(-1, get_device_id(manager, "shared"));
+
+    // Freed blocks are reused for names of the same size
+    TEST_ASSERT_TRUE(device_manager_add_device(manager, "reused", DEVICE_THERMOSTAT, 30));
+    TEST_ASSERT_EQUAL_PTR(shared, device_manager_get_device_name(manager, 30, "reused"));
+    TEST_ASSERT_TRUE(device_manager_add_device(manager, "a-longer-name", DEVICE_THERMOSTAT, 31));
+    TEST_ASSERT_EQUAL_STRING("reused", device_manager_get_device_name(manager, 30, "reused"));
+
+    // Names survive snapshots, binary reloads and writes to either side
+    DeviceManager* snapshot = device_manager_snapshot(manager);
+    TEST_ASSERT_NOT_NULL(snapshot);
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 30, "reused"));
+    TEST_ASSERT_TRUE(device_manager_add_device(manager, "ruined", DEVICE_THERMOSTAT, 32));
+    TEST_ASSERT_EQUAL_STRING("reused", device_manager_get_device_name(snapshot, 30, "reused"));
+    TEST_ASSERT_EQUAL_STRING(longest, device_manager_get_device_name(snapshot, 1, longest));
+    TEST_ASSERT_TRUE(device_manager_save_binary(manager, "test_names.bin"));
+    device_manager_destroy(snapshot);
+    device_manager_destroy(manager);
+
+    DeviceManager* loaded = device_manager_load_binary("test_names.bin");
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(3, device_manager_get_device_count(loaded));
+    TEST_ASSERT_EQUAL_STRING(longest, device_manager_get_device_name(loaded, 1, longest));
+    TEST_ASSERT_EQUAL_INT(32, get_device_id(loaded, "ruined"));
+    TEST_ASSERT_EQUAL_INT(-1, get_device_id(loaded, "reused"));
+    TEST_ASSERT_TRUE(device_manager_remove_device(loaded, 31, "a-longer-name"));
+    TEST_ASSERT_TRUE(device_manager_add_device(loaded, "a-longer-one!", DEVICE_THERMOSTAT, 33));
+    TEST_ASSERT_TRUE(device_manager_add_device(loaded, "ruined", DEVICE_CAMERA, 34));
+    TEST_ASSERT_EQUAL_STRING("a-longer-one!", device_manager_get_device_name(loaded, 33, "a-longer-one!"));
+    TEST_ASSERT_EQUAL_STRING("ruined", device_manager_get_device_name(loaded, 34, "ruined"));
+    device_manager_destroy(loaded);
+    remove("test_names.bin");
+}
+
+void test_device_registry_sharding(void)
+{
+    DeviceRegistry* registry = make_registry(8, 4);
+    TEST_ASSERT_EQUAL_size_t(8, device_registry_shard_count(registry));
+    TEST_ASSERT_EQUAL_size_t(8, device_registry_loaded_shards(registry));
+    TEST_ASSERT_EQUAL_size_t(3000, device_registry_get_device_count(registry));
+    TEST_ASSERT_EQUAL_size_t(1000, device_registry_count_by_type(registry, DEVICE_CAMERA));
+
+    // Every device lives in the shard its id hashes to, and the shards share the load
+    size_t total = 0;
+    for (size_t i = 0; i < 8; i++) {
+        DeviceManager* shard = device_registry_shard(registry, i);
+        int count = device_manager_get_device_count(shard);
+        TEST_ASSERT_TRUE(count > 250 && count < 500);
+        total += (size_t)count;
+    }
+    TEST_ASSERT_EQUAL_size_t(3000, total);
+    DeviceManager* shard = device_registry_shard(registry, device_registry_shard_of(registry, 1234));
+    TEST_ASSERT_EQUAL_INT(1234, get_device_id(shard, "device-1234"));
+    TEST_ASSERT_NULL(device_registry_shard(registry, 8));
+
+    TEST_ASSERT_TRUE(device_registry_set_device_state(registry, 7, true));
+    TEST_ASSERT_EQUAL_INT(34, device_registry_get_device_attribute(registry, 34));
+    TEST_ASSERT_TRUE(device_registry_remove_device(registry, 34, "device-34"));
+    TEST_ASSERT_FALSE(device_registry_remove_device(registry, 34, "device-34"));
+    TEST_ASSERT_FALSE(device_registry_set_device_attribute(registry, 34, 1));
+
+    // Queries gather every shard's matches; cap limits what is stored, not the count
+    DeviceFilter filter = {DEVICE_TYPE_BIT(DEVICE_LIGHT), DEVICE_STATE_ANY, true, 0, 9};
+    int ids[200];
+    TEST_ASSERT_EQUAL_size_t(100, device_registry_query(registry, &filter, ids, 200));
+    qsort(ids, 100, sizeof(int), compare_ints);
+    for (int ident = 0, i = 0; ident < 3000; ident++) {
+        if (ident % 3 == 0 && ident % 100 < 10) {
+            TEST_ASSERT_EQUAL_INT(ident, ids[i++]);
+        }
+    }
+    TEST_ASSERT_EQUAL_size_t(100, device_registry_query(registry, &filter, ids, 10));
+    TEST_ASSERT_EQUAL_size_t(2999, device_registry_query(registry, NULL, NULL, 0));
+
+    device_registry_destroy(registry);
+    TEST_ASSERT_NULL(device_registry_create(0, 1));
+}
+
+static void test_device_registry_persistence(DeviceShardFormat format)
+{
+    const char* path = "test_registry";
+    DeviceRegistry* registry = make_registry(4, 1);
+    TEST_ASSERT_TRUE(device_registry_set_device_state(registry, 42, true));
+    TEST_ASSERT_TRUE(device_registry_save(registry, path, format));
+    device_registry_destroy(registry);
+
+    // Opening reads the manifest only; shards load as they are reached
+    registry = device_registry_open(path, 2);
+    TEST_ASSERT_NOT_NULL(registry);
+    TEST_ASSERT_EQUAL_size_t(4, device_registry_shard_count(registry));
+    TEST_ASSERT_EQUAL_size_t(0, device_registry_loaded_shards(registry));
+    TEST_ASSERT_EQUAL_INT(42, device_registry_get_device_attribute(registry, 42));
+    TEST_ASSERT_EQUAL_size_t(1, device_registry_loaded_shards(registry));
+    DeviceManager* shard = device_registry_shard(registry, device_registry_shard_of(registry, 42));
+    TEST_ASSERT_TRUE(device_manager_get_device_state(shard, 42, "device-42"));
+    TEST_ASSERT_TRUE(device_registry_set_device_attribute(registry, 42, -42));
+
+    // Saving in place rewrites only the loaded shard
+    TEST_ASSERT_TRUE(device_registry_save(registry, path, format));
+    TEST_ASSERT_EQUAL_size_t(1, device_registry_loaded_shards(registry));
+    TEST_ASSERT_EQUAL_size_t(3000, device_registry_get_device_count(registry));
+    TEST_ASSERT_EQUAL_size_t(4, device_registry_loaded_shards(registry));
+    device_registry_destroy(registry);
+
+    registry = device_registry_open(path, 1);
+    TEST_ASSERT_NOT_NULL(registry);
+    TEST_ASSERT_EQUAL_INT(-42, device_registry_get_device_attribute(registry, 42));
+    TEST_ASSERT_EQUAL_INT(99, device_registry_get_device_attribute(registry, 2999));
+    TEST_ASSERT_EQUAL_size_t(3000, device_registry_get_device_count(registry));
+    device_registry_destroy(registry);
+
+    remove(path);
+    char shard_file[64];
+    for (int i = 0; i < 4; i++) {
+        snprintf(shard_file, sizeof(shard_file), "%s.%d", path, i);
+        remove(shard_file);
+    }
+    TEST_ASSERT_NULL(device_registry_open(path, 1));
+}
+
+void test_device_registry_text_shards(void)
+{
+    test_device_registry_persistence(DEVICE_SHARD_TEXT);
+}
+
+void test_device_registry_binary_shards(void)
+{
+    test_device_registry_persistence(DEVICE_SHARD_BINARY);
+}
+
+void test_device_registry_compressed_shards(void)
+{
+    test_device_registry_persistence(DEVICE_SHARD_COMPRESSED);
+}
+
+void test_device_registry_format_switch_survives_failure(void)
+{
+#if !defined(_WIN32)
+    const char* path = "test_registry_switch";
+    DeviceRegistry* registry = make_registry(4, 1);
+    TEST_ASSERT_TRUE(device_registry_save(registry, path, DEVICE_SHARD_TEXT));
+    device_registry_destroy(registry);
+
+    // One shard cannot be written, so the switch to binary stops short of the manifest
+    registry = device_registry_open(path, 1);
+    TEST_ASSERT_NOT_NULL(registry);
+    TEST_ASSERT_TRUE(device_registry_set_device_attribute(registry, 42, -42));
+    size_t blocked = (device_registry_shard_of(registry, 42) + 1) % 4;
+    char blocked_temp[64];
+    snprintf(blocked_temp, sizeof(blocked_temp), "%s.%zu.tmp", path, blocked);
+    TEST_ASSERT_EQUAL_INT(0, mkdir(blocked_temp, 0700));
+    TEST_ASSERT_FALSE(device_registry_save(registry, path, DEVICE_SHARD_BINARY));
+    remove(blocked_temp);
+    device_registry_destroy(registry);
+
+    // The manifest still says text, yet the shards written as binary load as binary
+    registry = device_registry_open(path, 1);
+    TEST_ASSERT_NOT_NULL(registry);
+    TEST_ASSERT_EQUAL_size_t(3000, device_registry_get_device_count(registry));
+    TEST_ASSERT_EQUAL_INT(-42, device_registry_get_device_attribute(registry, 42));
+    TEST_ASSERT_TRUE(device_registry_save(registry, path, DEVICE_SHARD_BINARY));
+    device_registry_destroy(registry);
+    registry = device_registry_open(path, 1);
+    TEST_ASSERT_NOT_NULL(registry);
+    TEST_ASSERT_EQUAL_size_t(3000, device_registry_get_device_count(registry));
+    TEST_ASSERT_EQUAL_INT(-42, device_registry_get_device_attribute(registry, 42));
+    device_registry_destroy(registry);
+
+    remove(path);
+    char shard_file[64];
+    for (int i = 0; i < 4; i++) {
+        snprintf(shard_file, sizeof(shard_file), "%s.%d", path, i);
+        remove(shard_file);
+    }
+#else
+    TEST_IGNORE_MESSAGE("needs mkdir");
+#endif
+}
+
 int main(void)
 {
     UNITY_BEGIN();
@@ -546,10 +2679,65 @@ int main(void)
     RUN_TEST(test_device_manager_set_device_attribute_first_device);
     RUN_TEST(test_device_manager_save_with_null_filename);
     RUN_TEST(test_device_manager_save_with_null_manager);
+    RUN_TEST(test_device_manager_save_reports_write_errors);
     RUN_TEST(test_device_manager_save_with_empty_filename);
     RUN_TEST(test_device_manager_save_with_minimum_values);
     RUN_TEST(test_device_manager_load_file_not_opened);
     RUN_TEST(test_device_manager_load_no_valid_entries);
+    RUN_TEST(test_device_manager_lookup_many_devices);
+    RUN_TEST(test_device_manager_set_device_state_same_id_targets_newest);
+    RUN_TEST(test_get_device_id_many_devices);
+    RUN_TEST(test_get_device_id_duplicate_names);
+    RUN_TEST(test_device_manager_add_device_with_invalid_type);
+    RUN_TEST(test_device_manager_reused_slot_starts_clean);
+    RUN_TEST(test_device_manager_create_with_arena);
+    RUN_TEST(test_device_manager_create_with_arena_invalid_buffer);
+    RUN_TEST(test_device_manager_apply_batch);
+    RUN_TEST(test_device_manager_apply_batch_without_results);
+    RUN_TEST(test_device_manager_add_devices);
+    RUN_TEST(test_device_manager_reserve_then_add);
+    RUN_TEST(test_device_manager_save_and_load_round_trip);
+    RUN_TEST(test_device_manager_load_parallel);
+    RUN_TEST(test_device_manager_save_async);
+    RUN_TEST(test_device_manager_binary_round_trip);
+    RUN_TEST(test_device_manager_binary_rejects_bad_files);
+    RUN_TEST(test_device_manager_binary_empty_manager);
+    RUN_TEST(test_device_manager_compressed_round_trip);
+    RUN_TEST(test_device_manager_snapshots_keep_duplicate_order);
+    RUN_TEST(test_device_manager_journal_replay);
+    RUN_TEST(test_device_manager_journal_shadowed_ids);
+    RUN_TEST(test_device_manager_journal_ignores_stale_and_torn_logs);
+    RUN_TEST(test_device_manager_journal_auto_compaction);
+    RUN_TEST(test_device_manager_attribute_fetch_add);
+    RUN_TEST(test_device_manager_attribute_compare_exchange);
+    RUN_TEST(test_device_manager_handles);
+    RUN_TEST(test_device_manager_stale_handle_after_remove);
+    RUN_TEST(test_device_manager_query_by_type_and_state);
+    RUN_TEST(test_device_manager_query_by_attribute);
+    RUN_TEST(test_device_manager_count_by_type);
+    RUN_TEST(test_device_manager_aggregate_attribute);
+    RUN_TEST(test_device_manager_attribute_kernels_match_scalar);
+    RUN_TEST(test_device_manager_filter_attribute_range);
+    RUN_TEST(test_device_manager_apply_parallel);
+    RUN_TEST(test_device_manager_for_each_parallel);
+    RUN_TEST(test_device_manager_apply_parallel_journaled);
+    RUN_TEST(test_device_manager_write_devices);
+    RUN_TEST(test_device_manager_write_devices_large);
+    RUN_TEST(test_device_manager_iterator);
+    RUN_TEST(test_device_manager_iterator_batches_and_removal);
+    RUN_TEST(test_device_manager_subscribe);
+    RUN_TEST(test_device_manager_subscribe_overflow);
+    RUN_TEST(test_device_manager_delta_round_trip);
+    RUN_TEST(test_device_manager_delta_names_with_spaces);
+    RUN_TEST(test_device_manager_delta_full_resync);
+    RUN_TEST(test_device_manager_snapshot);
+    RUN_TEST(test_device_manager_snapshot_of_mapped_manager);
+    RUN_TEST(test_device_manager_long_and_shared_names);
+    RUN_TEST(test_device_registry_sharding);
+    RUN_TEST(test_device_registry_text_shards);
+    RUN_TEST(test_device_registry_binary_shards);
+    RUN_TEST(test_device_registry_compressed_shards);
+    RUN_TEST(test_device_registry_format_switch_survives_failure);
 
     return UNITY_END();
 }
@@ -0,0 +1,696 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "unity.h"
+#include "device_manager.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Run under ENABLE_SANITIZE_THREAD; the checks below only catch lost updates
+#define WRITER_THREADS 4
+#define READER_THREADS 4
+#define DEVICES_PER_WRITER 256
+#define ROUNDS 200
+#define CHURN_BASE 100000
+
+typedef struct Worker {
+    DeviceManager* manager;
+    int index;
+    int failures;
+} Worker;
+
+void setUp(void) {
+
+}
+
+void tearDown(void) {
+
+}
+
+static void add_fleet(DeviceManager* manager) {
+    char name[32];
+    for (int i = 0; i < WRITER_THREADS * DEVICES_PER_WRITER; i++) {
+        snprintf(name, sizeof(name), "device-%d", i);
+        TEST_ASSERT_TRUE(device_manager_add_device(manager, name, (DeviceType)(i % 3), i));
+    }
+}
+
+// Each writer owns a disjoint id range; ranges meet inside shared state words
+static void* writer_main(void* arg) {
+    Worker* worker = (Worker*)arg;
+    int first = worker->index * DEVICES_PER_WRITER;
+    // States go through handles resolved once up front, attributes through ids
+    DeviceHandle handles[DEVICES_PER_WRITER];
+    for (int i = 0; i < DEVICES_PER_WRITER; i++) {
+        handles[i] = device_manager_lookup(worker->manager, first + i);
+    }
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int ident = first; ident < first + DEVICES_PER_WRITER; ident++) {
+            if (!device_manager_set_device_attribute(worker->manager, ident, round) ||
+                !device_manager_set_state_by_handle(worker->manager, handles[ident - first], (round % 2) != 0)) {
+                worker->failures++;
+            }
+        }
+        DeviceUpdate updates[2] = {{first, DEVICE_UPDATE_ATTRIBUTE, round}, {first + 1, DEVICE_UPDATE_STATE, 1}};
+        if (device_manager_apply_batch(worker->manager, updates, 2, NULL) != 2) {
+            worker->failures++;
+        }
+    }
+    return NULL;
+}
+
+static void* reader_main(void* arg) {
+    Worker* worker = (Worker*)arg;
+    char name[32];
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int ident = 0; ident < WRITER_THREADS * DEVICES_PER_WRITER; ident += 7) {
+            int attribute = device_manager_get_device_attribute(worker->manager, ident);
+            snprintf(name, sizeof(name), "device-%d", ident);
+            if (attribute < 0 || attribute >= ROUNDS || get_device_id(worker->manager, name) != ident ||
+                device_manager_get_device_type(worker->manager, ident, name) != (DeviceType)(ident % 3)) {
+                worker->failures++;
+            }
+            device_manager_get_device_state(worker->manager, ident, name);
+        }
+        if (device_manager_get_device_count(worker->manager) < WRITER_THREADS * DEVICES_PER_WRITER) {
+            worker->failures++;
+        }
+        // Cursors walk the fleet while the churn thread adds and removes around them
+        DeviceIterator iterator;
+        DeviceView views[64];
+        char names[64][DEVICE_NAME_MAX];
+        size_t fetched = 0;
+        int fleet = 0;
+        device_manager_iter_begin(worker->manager, &iterator);
+        while ((fetched = device_manager_iter_next_batch(&iterator, views, names, 64)) > 0) {
+            for (size_t i = 0; i < fetched; i++) {
+                fleet += views[i].ident < CHURN_BASE;
+            }
+        }
+        device_manager_iter_end(&iterator);
+        if (fleet != WRITER_THREADS * DEVICES_PER_WRITER) {
+            worker->failures++;
+        }
+        // Fleet-wide scans run against the setters too
+        AggregateResult result;
+        if (!device_manager_aggregate_attribute(worker->manager, DEVICE_LIGHT, &result) || result.min < 0 ||
+            result.max >= ROUNDS ||
+            device_manager_filter_attribute_range(worker->manager, DEVICE_THERMOSTAT, 0, ROUNDS, NULL, 0) <
+                (size_t)(WRITER_THREADS * DEVICES_PER_WRITER / 3)) {
+            worker->failures++;
+        }
+    }
+    return NULL;
+}
+
+// Adds and removes devices outside the fleet, forcing slab and index growth under the readers
+static void* churn_main(void* arg) {
+    Worker* worker = (Worker*)arg;
+    char name[32];
+    for (int round = 0; round < ROUNDS * 4; round++) {
+        int ident = CHURN_BASE + round;
+        snprintf(name, sizeof(name), "churn-%d", ident);
+        if (!device_manager_add_device(worker->manager, name, DEVICE_CAMERA, ident)) {
+            worker->failures++;
+        }
+        if (round % 2 == 0 && !device_manager_remove_device(worker->manager, ident, name)) {
+            worker->failures++;
+        }
+    }
+    return NULL;
+}
+
+static void run_workers(DeviceManager* manager) {
+    pthread_t threads[WRITER_THREADS + READER_THREADS + 1];
+    Worker workers[WRITER_THREADS + READER_THREADS + 1];
+    int started = 0;
+    for (int i = 0; i < WRITER_THREADS + READER_THREADS + 1; i++) {
+        workers[i].manager = manager;
+        workers[i].index = i;
+        workers[i].failures = 0;
+        void* (*entry)(void*) = i < WRITER_THREADS ? writer_main : i < WRITER_THREADS + READER_THREADS ? reader_main
+                                                                                                      : churn_main;
+        if (pthread_create(&threads[i], NULL, entry, &workers[i]) == 0) {
+            started++;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    TEST_ASSERT_EQUAL_INT(WRITER_THREADS + READER_THREADS + 1, started);
+    for (int i = 0; i < started; i++) {
+        TEST_ASSERT_EQUAL_INT(0, workers[i].failures);
+    }
+}
+
+static void assert_final_values(DeviceManager* manager) {
+    char name[32];
+    for (int ident = 0; ident < WRITER_THREADS * DEVICES_PER_WRITER; ident++) {
+        snprintf(name, sizeof(name), "device-%d", ident);
+        int expected_attribute = ROUNDS - 1;
+        bool expected_state = ident % DEVICES_PER_WRITER == 1 || (ROUNDS - 1) % 2 != 0;
+        TEST_ASSERT_EQUAL_INT(expected_attribute, device_manager_get_device_attribute(manager, ident));
+        TEST_ASSERT_EQUAL(expected_state, device_manager_get_device_state(manager, ident, name));
+    }
+    TEST_ASSERT_EQUAL_INT(WRITER_THREADS * DEVICES_PER_WRITER + ROUNDS * 2, device_manager_get_device_count(manager));
+}
+
+void test_device_manager_concurrent_stress(void)
+{
+    DeviceManager* manager = device_manager_create_concurrent();
+    TEST_ASSERT_NOT_NULL(manager);
+    add_fleet(manager);
+
+    run_workers(manager);
+    assert_final_values(manager);
+
+    device_manager_destroy(manager);
+}
+
+void test_device_manager_concurrent_stress_with_journal(void)
+{
+    const char* filename = "test_concurrent_journal.txt";
+    DeviceManager* manager = device_manager_create_concurrent();
+    TEST_ASSERT_NOT_NULL(manager);
+    add_fleet(manager);
+    // No fsync per record, but frequent compactions racing the setters
+    TEST_ASSERT_TRUE(device_manager_enable_journal(manager, filename, 1024, 20000));
+
+    run_workers(manager);
+    assert_final_values(manager);
+    TEST_ASSERT_TRUE(device_manager_journal_sync(manager));
+    device_manager_destroy(manager);
+
+    // Snapshot plus log replay to the same final state
+    DeviceManager* loaded = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    assert_final_values(loaded);
+    device_manager_destroy(loaded);
+
+    remove(filename);
+    remove("test_concurrent_journal.txt.wal");
+}
+
+#define COUNTER_THREADS 8
+#define COUNTER_INCREMENTS 5000
+
+// Half the threads use fetch-add, half a compare-exchange loop, all on one device
+static void* counter_main(void* arg) {
+    Worker* worker = (Worker*)arg;
+    for (int i = 0; i < COUNTER_INCREMENTS; i++) {
+        if (worker->index % 2 == 0) {
+            if (!device_manager_attribute_fetch_add(worker->manager, 0, 1, NULL)) {
+                worker->failures++;
+            }
+            continue;
+        }
+        int expected = device_manager_get_device_attribute(worker->manager, 0);
+        while (!device_manager_attribute_compare_exchange(worker->manager, 0, &expected, expected + 1)) {
+        }
+        // Neighbouring devices share a state word with device 0
+        device_manager_set_device_state(worker->manager, worker->index, (i % 2) != 0);
+    }
+    return NULL;
+}
+
+void test_device_manager_concurrent_atomic_counters(void)
+{
+    const char* filename = "test_concurrent_counters.bin";
+    DeviceManager* manager = device_manager_create_concurrent();
+    TEST_ASSERT_NOT_NULL(manager);
+    add_fleet(manager);
+
+    pthread_t threads[COUNTER_THREADS];
+    Worker workers[COUNTER_THREADS];
+    int started = 0;
+    for (int i = 0; i < COUNTER_THREADS; i++) {
+        workers[i].manager = manager;
+        workers[i].index = i;
+        workers[i].failures = 0;
+        if (pthread_create(&threads[i], NULL, counter_main, &workers[i]) == 0) {
+            started++;
+        }
+    }
+    // Snapshots taken while the counters move still load and verify
+    bool saved = device_manager_save_binary(manager, filename);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL_INT(0, workers[i].failures);
+    }
+    TEST_ASSERT_EQUAL_INT(COUNTER_THREADS, started);
+    TEST_ASSERT_EQUAL_INT(COUNTER_THREADS * COUNTER_INCREMENTS, device_manager_get_device_attribute(manager, 0));
+    TEST_ASSERT_TRUE(device_manager_get_device_state(manager, 1, "device-1"));
+
+    TEST_ASSERT_TRUE(saved);
+    DeviceManager* loaded = device_manager_load_binary(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(WRITER_THREADS * DEVICES_PER_WRITER, device_manager_get_device_count(loaded));
+    device_manager_destroy(loaded);
+
+    device_manager_destroy(manager);
+    remove(filename);
+}
+
+void test_device_manager_concurrent_matches_sequential_behaviour(void)
+{
+    DeviceManager* manager = device_manager_create_concurrent();
+    TEST_ASSERT_NOT_NULL(manager);
+
+    TEST_ASSERT_TRUE(device_manager_add_device(manager, "Light", DEVICE_LIGHT, 1));
+    TEST_ASSERT_TRUE(device_manager_add_device(manager, "Thermostat", DEVICE_THERMOSTAT, 1));
+    TEST_ASSERT_TRUE(device_manager_set_device_attribute(manager, 1, 21));
+    TEST_ASSERT_EQUAL_INT(21, device_manager_get_device_attribute(manager, 1));
+    TEST_ASSERT_TRUE(device_manager_remove_device(manager, 1, "Thermostat"));
+    TEST_ASSERT_EQUAL_INT(0, device_manager_get_device_attribute(manager, 1));
+    TEST_ASSERT_FALSE(device_manager_set_device_state(manager, 2, true));
+    TEST_ASSERT_TRUE(device_manager_reserve(manager, 5000));
+    TEST_ASSERT_EQUAL_INT(1, device_manager_get_device_count(manager));
+
+    device_manager_destroy(manager);
+}
+
+#define FLEET_ROUNDS 50
+
+static void count_visit(const DeviceView* device, void* udata) {
+    (void)device;
+    (void)udata;
+}
+
+// Fleet-wide ops run on the manager's pool while another caller scans and setters run
+static void* fleet_main(void* arg) {
+    Worker* worker = (Worker*)arg;
+    DeviceFilter lights = {DEVICE_TYPE_BIT(DEVICE_LIGHT), DEVICE_STATE_ANY, false, 0, 0};
+    DeviceOp bump = {DEVICE_OP_ADD_ATTRIBUTE, 1, 0, 0, NULL, NULL};
+    for (int round = 0; round < FLEET_ROUNDS; round++) {
+        if (worker->index == 0) {
+            if (device_manager_apply_parallel(worker->manager, &lights, &bump) !=
+                (size_t)(WRITER_THREADS * DEVICES_PER_WRITER + 2) / 3) {
+                worker->failures++;
+            }
+        } else if (device_manager_for_each_parallel(worker->manager, NULL, count_visit, NULL) !=
+                   (size_t)(WRITER_THREADS * DEVICES_PER_WRITER)) {
+            worker->failures++;
+        }
+    }
+    return NULL;
+}
+
+void test_device_manager_concurrent_parallel_ops(void)
+{
+    const char* filename = "test_concurrent_parallel.txt";
+    DeviceManager* manager = device_manager_create_concurrent();
+    TEST_ASSERT_NOT_NULL(manager);
+    add_fleet(manager);
+    TEST_ASSERT_TRUE(device_manager_set_worker_threads(manager, 4));
+    TEST_ASSERT_TRUE(device_manager_enable_journal(manager, filename, 256, 5000));
+
+    pthread_t threads[2];
+    Worker workers[2];
+    int started = 0;
+    for (int i = 0; i < 2; i++) {
+        workers[i].manager = manager;
+        workers[i].index = i;
+        workers[i].failures = 0;
+        if (pthread_create(&threads[i], NULL, fleet_main, &workers[i]) == 0) {
+            started++;
+        }
+    }
+    for (int round = 0; round < FLEET_ROUNDS; round++) {
+        for (int ident = 1; ident < WRITER_THREADS * DEVICES_PER_WRITER; ident += 3) {
+            device_manager_set_device_attribute(manager, ident, round);
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL_INT(0, workers[i].failures);
+    }
+    TEST_ASSERT_EQUAL_INT(2, started);
+    TEST_ASSERT_EQUAL_INT(FLEET_ROUNDS, device_manager_get_device_attribute(manager, 0));
+    TEST_ASSERT_EQUAL_INT(FLEET_ROUNDS - 1, device_manager_get_device_attribute(manager, 1));
+    TEST_ASSERT_TRUE(device_manager_journal_sync(manager));
+    device_manager_destroy(manager);
+
+    DeviceManager* loaded = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(FLEET_ROUNDS, device_manager_get_device_attribute(loaded, 3));
+    TEST_ASSERT_EQUAL_INT(FLEET_ROUNDS - 1, device_manager_get_device_attribute(loaded, 4));
+    device_manager_destroy(loaded);
+    remove(filename);
+    remove("test_concurrent_parallel.txt.wal");
+}
+
+#define EVENT_ROUNDS 10
+
+// Latest attribute delivered per device
+static void record_attributes(const DeviceEvent* events, size_t count, void* udata) {
+    int* attributes = (int*)udata;
+    for (size_t i = 0; i < count; i++) {
+        attributes[events[i].ident] = events[i].attribute;
+    }
+}
+
+static void* event_writer_main(void* arg) {
+    Worker* worker = (Worker*)arg;
+    int first = worker->index * DEVICES_PER_WRITER;
+    for (int round = 1; round <= EVENT_ROUNDS; round++) {
+        for (int ident = first; ident < first + DEVICES_PER_WRITER; ident++) {
+            if (!device_manager_set_device_attribute(worker->manager, ident, round * 1000 + ident)) {
+                worker->failures++;
+            }
+        }
+    }
+    return NULL;
+}
+
+void test_device_manager_concurrent_events(void)
+{
+    DeviceManager* manager = device_manager_create_concurrent();
+    TEST_ASSERT_NOT_NULL(manager);
+    add_fleet(manager);
+    static int attributes[WRITER_THREADS * DEVICES_PER_WRITER];
+    TEST_ASSERT_TRUE(device_manager_subscribe(manager, NULL, record_attributes, attributes) != 0);
+
+    pthread_t threads[WRITER_THREADS];
+    Worker workers[WRITER_THREADS];
+    int started = 0;
+    for (int i = 0; i < WRITER_THREADS; i++) {
+        workers[i].manager = manager;
+        workers[i].index = i;
+        workers[i].failures = 0;
+        if (pthread_create(&threads[i], NULL, event_writer_main, &workers[i]) == 0) {
+            started++;
+        }
+    }
+    // Deliveries race the producers; whatever is delivered last must be the final value
+    for (int i = 0; i < 100; i++) {
+        device_manager_deliver_events(manager);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL_INT(0, workers[i].failures);
+    }
+    TEST_ASSERT_EQUAL_INT(WRITER_THREADS, started);
+    device_manager_deliver_events(manager);
+    for (int ident = 0; ident < WRITER_THREADS * DEVICES_PER_WRITER; ident++) {
+        TEST_ASSERT_EQUAL_INT(EVENT_ROUNDS * 1000 + ident, attributes[ident]);
+    }
+
+    device_manager_destroy(manager);
+}
+
+typedef struct DeltaBuffer {
+    char* data;
+    size_t size;
+} DeltaBuffer;
+
+static bool delta_sink(const char* data, size_t size, void* udata) {
+    DeltaBuffer* buffer = (DeltaBuffer*)udata;
+    char* grown = (char*)realloc(buffer->data, buffer->size + size);
+    if (!grown) {
+        return false;
+    }
+    memcpy(grown + buffer->size, data, size);
+    buffer->data = grown;
+    buffer->size += size;
+    return true;
+}
+
+// Deltas taken while setters race must never miss a change: the replica ends up equal
+void test_device_manager_concurrent_deltas(void)
+{
+    DeviceManager* manager = device_manager_create_concurrent();
+    DeviceManager* replica = device_manager_create();
+    TEST_ASSERT_NOT_NULL(manager);
+    add_fleet(manager);
+
+    pthread_t threads[WRITER_THREADS];
+    Worker workers[WRITER_THREADS];
+    int started = 0;
+    for (int i = 0; i < WRITER_THREADS; i++) {
+        workers[i].manager = manager;
+        workers[i].index = i;
+        workers[i].failures = 0;
+        if (pthread_create(&threads[i], NULL, event_writer_main, &workers[i]) == 0) {
+            started++;
+        }
+    }
+    DeltaBuffer delta = {NULL, 0};
+    uint64_t version = 0;
+    for (int i = 0; i < 50; i++) {
+        delta.size = 0;
+        TEST_ASSERT_TRUE(device_manager_export_changes_since(manager, version, delta_sink, &delta, &version));
+        TEST_ASSERT_TRUE(device_manager_apply_changes(replica, delta.data, delta.size));
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL_INT(0, workers[i].failures);
+    }
+    TEST_ASSERT_EQUAL_INT(WRITER_THREADS, started);
+    delta.size = 0;
+    TEST_ASSERT_TRUE(device_manager_export_changes_since(manager, version, delta_sink, &delta, &version));
+    TEST_ASSERT_TRUE(device_manager_apply_changes(replica, delta.data, delta.size));
+    TEST_ASSERT_EQUAL_INT(WRITER_THREADS * DEVICES_PER_WRITER, device_manager_get_device_count(replica));
+    for (int ident = 0; ident < WRITER_THREADS * DEVICES_PER_WRITER; ident++) {
+        TEST_ASSERT_EQUAL_INT(EVENT_ROUNDS * 1000 + ident, device_manager_get_device_attribute(replica, ident));
+    }
+
+    free(delta.data);
+    device_manager_destroy(manager);
+    device_manager_destroy(replica);
+}
+
+#define SNAPSHOT_ROUNDS 100
+
+// One thread sets every attribute at once per round; others flip single states
+static void* snapshot_writer_main(void* arg) {
+    Worker* worker = (Worker*)arg;
+    for (int round = 1; round <= SNAPSHOT_ROUNDS; round++) {
+        if (worker->index == 0) {
+            DeviceOp set = {DEVICE_OP_SET_ATTRIBUTE, round, 0, 0, NULL, NULL};
+            if (device_manager_apply_parallel(worker->manager, NULL, &set) !=
+                (size_t)(WRITER_THREADS * DEVICES_PER_WRITER)) {
+                worker->failures++;
+            }
+        } else {
+            for (int ident = worker->index; ident < WRITER_THREADS * DEVICES_PER_WRITER; ident += WRITER_THREADS) {
+                if (!device_manager_set_device_state(worker->manager, ident, (round % 2) != 0)) {
+                    worker->failures++;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+void test_device_manager_concurrent_snapshots(void)
+{
+    DeviceManager* manager = device_manager_create_concurrent();
+    TEST_ASSERT_NOT_NULL(manager);
+    add_fleet(manager);
+
+    pthread_t threads[WRITER_THREADS];
+    Worker workers[WRITER_THREADS];
+    int started = 0;
+    for (int i = 0; i < WRITER_THREADS; i++) {
+        workers[i].manager = manager;
+        workers[i].index = i;
+        workers[i].failures = 0;
+        if (pthread_create(&threads[i], NULL, snapshot_writer_main, &workers[i]) == 0) {
+            started++;
+        }
+    }
+    // Each snapshot sees whole rounds: every attribute equal, however the setters raced
+    for (int i = 0; i < 50; i++) {
+        DeviceManager* snapshot = device_manager_snapshot(manager);
+        TEST_ASSERT_NOT_NULL(snapshot);
+        TEST_ASSERT_EQUAL_INT(WRITER_THREADS * DEVICES_PER_WRITER, device_manager_get_device_count(snapshot));
+        AggregateResult first;
+        TEST_ASSERT_TRUE(device_manager_aggregate_attribute(snapshot, DEVICE_LIGHT, &first));
+        TEST_ASSERT_EQUAL_INT(first.min, first.max);
+        for (int type = DEVICE_LIGHT + 1; type <= DEVICE_CAMERA; type++) {
+            AggregateResult result;
+            TEST_ASSERT_TRUE(device_manager_aggregate_attribute(snapshot, (DeviceType)type, &result));
+            TEST_ASSERT_EQUAL_INT(first.min, result.min);
+            TEST_ASSERT_EQUAL_INT(first.min, result.max);
+        }
+        TEST_ASSERT_EQUAL_INT(first.min, device_manager_get_device_attribute(snapshot, 17));
+        device_manager_destroy(snapshot);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL_INT(0, workers[i].failures);
+    }
+    TEST_ASSERT_EQUAL_INT(WRITER_THREADS, started);
+    TEST_ASSERT_EQUAL_INT(SNAPSHOT_ROUNDS, device_manager_get_device_attribute(manager, 17));
+
+    device_manager_destroy(manager);
+}
+
+typedef struct SaveTally {
+    int done;
+    int failed;
+} SaveTally;
+
+// Runs on the saver thread only, one save at a time
+static void tally_save(const char* filename, bool saved, void* udata)
+{
+    (void)filename;
+    SaveTally* tally = (SaveTally*)udata;
+    tally->done++;
+    tally->failed += !saved;
+}
+
+static void check_saved_rounds(const char* filename, int round)
+{
+    DeviceManager* loaded = device_manager_load(filename);
+    TEST_ASSERT_NOT_NULL(loaded);
+    TEST_ASSERT_EQUAL_INT(WRITER_THREADS * DEVICES_PER_WRITER, device_manager_get_device_count(loaded));
+    int first = device_manager_get_device_attribute(loaded, 0);
+    TEST_ASSERT_TRUE(round < 0 || first == round);
+    for (int ident = 1; ident < WRITER_THREADS * DEVICES_PER_WRITER; ident++) {
+        TEST_ASSERT_EQUAL_INT(first, device_manager_get_device_attribute(loaded, ident));
+    }
+    device_manager_destroy(loaded);
+}
+
+void test_device_manager_concurrent_save_async(void)
+{
+    const char* filename = "test_concurrent_save_async.txt";
+    DeviceManager* manager = device_manager_create_concurrent();
+    TEST_ASSERT_NOT_NULL(manager);
+    add_fleet(manager);
+
+    pthread_t threads[WRITER_THREADS];
+    Worker workers[WRITER_THREADS];
+    int started = 0;
+    for (int i = 0; i < WRITER_THREADS; i++) {
+        workers[i].manager = manager;
+        workers[i].index = i;
+        workers[i].failures = 0;
+        if (pthread_create(&threads[i], NULL, snapshot_writer_main, &workers[i]) == 0) {
+            started++;
+        }
+    }
+    // Requests pile up faster than they are written; every one hears back, and
+    // whichever state lands on disk holds whole rounds
+    SaveTally tally = {0, 0};
+    for (int i = 0; i < 50; i++) {
+        TEST_ASSERT_TRUE(device_manager_save_async(manager, filename, tally_save, &tally));
+        if (i % 10 == 9) {
+            device_manager_wait_saves(manager);
+            TEST_ASSERT_EQUAL_INT(i + 1, tally.done);
+            check_saved_rounds(filename, -1);
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL_INT(0, workers[i].failures);
+    }
+    TEST_ASSERT_EQUAL_INT(WRITER_THREADS, started);
+    TEST_ASSERT_EQUAL_INT(0, tally.failed);
+
+    // Destroying the manager still writes the save it queued
+    TEST_ASSERT_TRUE(device_manager_save_async(manager, filename, tally_save, &tally));
+    device_manager_destroy(manager);
+    TEST_ASSERT_EQUAL_INT(51, tally.done);
+    check_saved_rounds(filename, SNAPSHOT_ROUNDS);
+    remove(filename);
+}
+
+typedef struct RegistryWorker {
+    DeviceRegistry* registry;
+    int index;
+    int failures;
+} RegistryWorker;
+
+// Writers race to load the same shards, then add and update disjoint id ranges
+static void* registry_writer_main(void* arg) {
+    RegistryWorker* worker = (RegistryWorker*)arg;
+    int first = worker->index * DEVICES_PER_WRITER;
+    for (int ident = first; ident < first + DEVICES_PER_WRITER; ident++) {
+        if (device_registry_get_device_attribute(worker->registry, ident) != ident) {
+            worker->failures++;
+        }
+    }
+    char name[32];
+    for (int round = 0; round < 20; round++) {
+        for (int ident = first; ident < first + DEVICES_PER_WRITER; ident++) {
+            snprintf(name, sizeof(name), "extra-%d-%d", ident, round);
+            if (!device_registry_add_device(worker->registry, name, DEVICE_CAMERA, CHURN_BASE + ident) ||
+                !device_registry_set_device_attribute(worker->registry, ident, round) ||
+                !device_registry_remove_device(worker->registry, CHURN_BASE + ident, name)) {
+                worker->failures++;
+            }
+        }
+    }
+    return NULL;
+}
+
+void test_device_manager_concurrent_registry(void)
+{
+    const char* path = "test_concurrent_registry";
+    DeviceRegistry* registry = device_registry_create(8, 1);
+    TEST_ASSERT_NOT_NULL(registry);
+    char name[32];
+    for (int i = 0; i < WRITER_THREADS * DEVICES_PER_WRITER; i++) {
+        snprintf(name, sizeof(name), "device-%d", i);
+        TEST_ASSERT_TRUE(device_registry_add_device(registry, name, (DeviceType)(i % 3), i));
+        TEST_ASSERT_TRUE(device_registry_set_device_attribute(registry, i, i));
+    }
+    TEST_ASSERT_TRUE(device_registry_save(registry, path, DEVICE_SHARD_BINARY));
+    device_registry_destroy(registry);
+    registry = device_registry_open(path, 4);
+    TEST_ASSERT_NOT_NULL(registry);
+
+    pthread_t threads[WRITER_THREADS];
+    RegistryWorker workers[WRITER_THREADS];
+    int started = 0;
+    for (int i = 0; i < WRITER_THREADS; i++) {
+        workers[i].registry = registry;
+        workers[i].index = i;
+        workers[i].failures = 0;
+        if (pthread_create(&threads[i], NULL, registry_writer_main, &workers[i]) == 0) {
+            started++;
+        }
+    }
+    // Fan-out counts never miss the original devices, whatever the writers are doing
+    for (int i = 0; i < 50; i++) {
+        size_t count = device_registry_get_device_count(registry);
+        TEST_ASSERT_TRUE(count >= WRITER_THREADS * DEVICES_PER_WRITER);
+        TEST_ASSERT_TRUE(device_registry_query(registry, NULL, NULL, 0) >= WRITER_THREADS * DEVICES_PER_WRITER);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_ASSERT_EQUAL_INT(0, workers[i].failures);
+    }
+    TEST_ASSERT_EQUAL_INT(WRITER_THREADS, started);
+    TEST_ASSERT_EQUAL_size_t(WRITER_THREADS * DEVICES_PER_WRITER, device_registry_get_device_count(registry));
+    TEST_ASSERT_EQUAL_INT(19, device_registry_get_device_attribute(registry, 5));
+
+    device_registry_destroy(registry);
+    remove(path);
+    char shard_file[64];
+    for (int i = 0; i < 8; i++) {
+        snprintf(shard_file, sizeof(shard_file), "%s.%d", path, i);
+        remove(shard_file);
+    }
+}
+
+int main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_device_manager_concurrent_matches_sequential_behaviour);
+    RUN_TEST(test_device_manager_concurrent_stress);
+    RUN_TEST(test_device_manager_concurrent_stress_with_journal);
+    RUN_TEST(test_device_manager_concurrent_atomic_counters);
+    RUN_TEST(test_device_manager_concurrent_parallel_ops);
+    RUN_TEST(test_device_manager_concurrent_events);
+    RUN_TEST(test_device_manager_concurrent_deltas);
+    RUN_TEST(test_device_manager_concurrent_snapshots);
+    RUN_TEST(test_device_manager_concurrent_save_async);
+    RUN_TEST(test_device_manager_concurrent_registry);
+
+    return UNITY_END();
+}
@@ -0,0 +1,199 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "unity.h"
+#include "log.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Sinks cannot be removed, so one file sink is shared by every test: a pipe whose
+// reader thread collects the output and can be paused so the pipe fills up and
+// the async writer blocks on it
+typedef struct Capture {
+    FILE* sink;
+    int read_fd;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    bool paused;
+    char* data;
+    size_t size;
+    size_t capacity;
+} Capture;
+
+static Capture capture;
+
+static void* capture_main(void* arg)
+{
+    (void)arg;
+    char chunk[4096];
+    for (;;) {
+        pthread_mutex_lock(&capture.lock);
+        while (capture.paused) {
+            pthread_cond_wait(&capture.changed, &capture.lock);
+        }
+        pthread_mutex_unlock(&capture.lock);
+        ssize_t got = read(capture.read_fd, chunk, sizeof(chunk));
+        if (got <= 0) {
+            return NULL;
+        }
+        pthread_mutex_lock(&capture.lock);
+        if (capture.size + (size_t)got + 1 > capture.capacity) {
+            capture.capacity = (capture.size + (size_t)got + 1) * 2;
+            capture.data = (char*)realloc(capture.data, capture.capacity);
+        }
+        memcpy(capture.data + capture.size, chunk, (size_t)got);
+        capture.size += (size_t)got;
+        capture.data[capture.size] = '\0';
+        pthread_cond_broadcast(&capture.changed);
+        pthread_mutex_unlock(&capture.lock);
+    }
+}
+
+static void capture_pause(bool paused)
+{
+    pthread_mutex_lock(&capture.lock);
+    capture.paused = paused;
+    pthread_cond_broadcast(&capture.changed);
+    pthread_mutex_unlock(&capture.lock);
+}
+
+// Logs a marker synchronously (async mode must be stopped) and waits for it to
+// come through; returns everything captured before it and starts a new capture
+static char* capture_take(void)
+{
+    static int markers;
+    char marker[32];
+    snprintf(marker, sizeof(marker), "capture marker %d", ++markers);
+    log_info("%s", marker);
+    pthread_mutex_lock(&capture.lock);
+    while (!capture.data || !strstr(capture.data, marker)) {
+        pthread_cond_wait(&capture.changed, &capture.lock);
+    }
+    char* taken = capture.data;
+    *strstr(taken, marker) = '\0';
+    capture.data = NULL;
+    capture.size = 0;
+    capture.capacity = 0;
+    pthread_mutex_unlock(&capture.lock);
+    return taken;
+}
+
+static size_t count_lines(const char* text, const char* needle)
+{
+    size_t count = 0;
+    for (const char* at = strstr(text, needle); at; at = strstr(at + 1, needle)) {
+        count++;
+    }
+    return count;
+}
+
+void setUp(void) {
+
+}
+
+void tearDown(void) {
+
+}
+
+void test_log_async_writes_file_sinks(void)
+{
+    TEST_ASSERT_EQUAL_INT(0, log_start_async());
+    for (int i = 0; i < 100; i++) {
+        log_info("async message %d", i);
+    }
+    log_debug("below the file level");
+    log_stop_async();
+
+    char* text = capture_take();
+    TEST_ASSERT_EQUAL_size_t(100, count_lines(text, "async message "));
+    TEST_ASSERT_NOT_NULL(strstr(text, "INFO  "));
+    TEST_ASSERT_NOT_NULL(strstr(text, "async message 99\n"));
+    TEST_ASSERT_NULL(strstr(text, "below the file level"));
+    TEST_ASSERT_NULL(strstr(text, "dropped"));
+    free(text);
+}
+
+void test_log_async_skips_filtered_levels(void)
+{
+    // With the writer stuck on a full pipe, every trace call taking a slot would
+    // overflow the ring and cost the records that matter
+    capture_pause(true);
+    TEST_ASSERT_EQUAL_INT(0, log_start_async());
+    for (int i = 0; i < 3000; i++) {
+        log_info("kept %d", i);
+    }
+    for (int i = 0; i < 100000; i++) {
+        log_trace("filtered %d", i);
+    }
+    log_error("still delivered");
+    capture_pause(false);
+    log_stop_async();
+
+    char* text = capture_take();
+    TEST_ASSERT_EQUAL_size_t(3000, count_lines(text, "kept "));
+    TEST_ASSERT_NOT_NULL(strstr(text, "still delivered"));
+    TEST_ASSERT_NULL(strstr(text, "filtered"));
+    TEST_ASSERT_NULL(strstr(text, "dropped"));
+    free(text);
+}
+
+void test_log_async_reports_dropped_messages(void)
+{
+    // Far more than the ring plus the pipe can hold while nothing reads the pipe
+    const size_t total = 20000;
+    capture_pause(true);
+    TEST_ASSERT_EQUAL_INT(0, log_start_async());
+    for (size_t i = 0; i < total; i++) {
+        log_warn("flood message %zu", i);
+    }
+    capture_pause(false);
+    log_stop_async();
+
+    char* text = capture_take();
+    size_t written = count_lines(text, "flood message ");
+    size_t dropped = 0;
+    for (const char* at = strstr(text, " log messages dropped"); at; at = strstr(at + 1, " log messages dropped")) {
+        const char* digits = at;
+        while (digits > text && digits[-1] >= '0' && digits[-1] <= '9') {
+            digits--;
+        }
+        dropped += strtoul(digits, NULL, 10);
+    }
+    TEST_ASSERT_GREATER_THAN(0, dropped);
+    TEST_ASSERT_LESS_THAN(total, written);
+    TEST_ASSERT_EQUAL_size_t(total, written + dropped);
+    free(text);
+}
+
+int main(void)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return 1;
+    }
+    capture.read_fd = fds[0];
+    capture.sink = fdopen(fds[1], "w");
+    pthread_mutex_init(&capture.lock, NULL);
+    pthread_cond_init(&capture.changed, NULL);
+    pthread_create(&capture.reader, NULL, capture_main, NULL);
+    log_set_quiet(true);
+    log_add_fp(capture.sink, LOG_INFO);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_log_async_writes_file_sinks);
+    RUN_TEST(test_log_async_skips_filtered_levels);
+    RUN_TEST(test_log_async_reports_dropped_messages);
+    int failures = UNITY_END();
+
+    fclose(capture.sink);
+    pthread_join(capture.reader, NULL);
+    close(capture.read_fd);
+    free(capture.data);
+    pthread_cond_destroy(&capture.changed);
+    pthread_mutex_destroy(&capture.lock);
+    return failures;
+}